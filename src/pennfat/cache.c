@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+blockCache *initCache(uint32_t capacity, uint32_t blockSize) {
+    if (capacity == 0) {
+        return NULL;
+    }
+
+    blockCache *cache = malloc(sizeof(blockCache));
+    if (cache == NULL) {
+        perror("ERROR: Fail to malloc the cache.");
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->blockSize = blockSize;
+
+    // At least one bucket per entry
+    cache->bucketCount = 1;
+    while (cache->bucketCount < capacity) {
+        cache->bucketCount *= 2;
+    }
+
+    cache->entries = calloc(capacity, sizeof(cacheEntry));
+    cache->data = malloc((size_t) capacity * blockSize);
+    cache->buckets = calloc(cache->bucketCount, sizeof(cacheEntry *));
+    if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL) {
+        perror("ERROR: Fail to malloc the cache.");
+        free(cache->entries);
+        free(cache->data);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    // Chain every entry in the LRU list, unused ones are evicted first
+    cache->lruHead = NULL;
+    cache->lruTail = NULL;
+    for (uint32_t i = 0; i < capacity; i++) {
+        cacheEntry *entry = &cache->entries[i];
+        entry->data = &cache->data[(size_t) i * blockSize];
+        entry->lruPrev = cache->lruTail;
+        if (cache->lruTail == NULL) {
+            cache->lruHead = entry;
+        } else {
+            cache->lruTail->lruNext = entry;
+        }
+        cache->lruTail = entry;
+    }
+
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache;
+}
+
+void freeCache(blockCache **cache) {
+    if (*cache == NULL) {
+        return;
+    }
+
+    free((*cache)->entries);
+    free((*cache)->data);
+    free((*cache)->buckets);
+    free(*cache);
+    *cache = NULL;
+}
+
+static cacheEntry **bucketOf(blockCache *cache, uint32_t block) { return &cache->buckets[(block * 2654435761u) & (cache->bucketCount - 1)]; }
+
+static cacheEntry *findEntry(blockCache *cache, uint32_t block) {
+    cacheEntry *entry = *bucketOf(cache, block);
+    while (entry != NULL && entry->block != block) {
+        entry = entry->hashNext;
+    }
+    return entry;
+}
+
+static void unhashEntry(blockCache *cache, cacheEntry *entry) {
+    cacheEntry **curr = bucketOf(cache, entry->block);
+    while (*curr != NULL) {
+        if (*curr == entry) {
+            *curr = entry->hashNext;
+            break;
+        }
+        curr = &(*curr)->hashNext;
+    }
+    entry->hashNext = NULL;
+    entry->block = 0;
+}
+
+static void unlinkEntry(blockCache *cache, cacheEntry *entry) {
+    if (entry->lruPrev == NULL) {
+        cache->lruHead = entry->lruNext;
+    } else {
+        entry->lruPrev->lruNext = entry->lruNext;
+    }
+
+    if (entry->lruNext == NULL) {
+        cache->lruTail = entry->lruPrev;
+    } else {
+        entry->lruNext->lruPrev = entry->lruPrev;
+    }
+}
+
+static void moveToHead(blockCache *cache, cacheEntry *entry) {
+    unlinkEntry(cache, entry);
+    entry->lruPrev = NULL;
+    entry->lruNext = cache->lruHead;
+    if (cache->lruHead != NULL) {
+        cache->lruHead->lruPrev = entry;
+    }
+    cache->lruHead = entry;
+    if (cache->lruTail == NULL) {
+        cache->lruTail = entry;
+    }
+}
+
+static void moveToTail(blockCache *cache, cacheEntry *entry) {
+    unlinkEntry(cache, entry);
+    entry->lruNext = NULL;
+    entry->lruPrev = cache->lruTail;
+    if (cache->lruTail != NULL) {
+        cache->lruTail->lruNext = entry;
+    }
+    cache->lruTail = entry;
+    if (cache->lruHead == NULL) {
+        cache->lruHead = entry;
+    }
+}
+
+uint8_t *cacheLookup(blockCache *cache, uint32_t block) {
+    cacheEntry *entry = findEntry(cache, block);
+    if (entry == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    moveToHead(cache, entry);
+    return entry->data;
+}
+
+uint8_t *cacheInsert(blockCache *cache, uint32_t block) {
+    cacheEntry *entry = findEntry(cache, block);
+
+    if (entry == NULL) {
+        // Reuse the least recently used entry
+        entry = cache->lruTail;
+        if (entry->block != 0) {
+            unhashEntry(cache, entry);
+        }
+
+        entry->block = block;
+        cacheEntry **bucket = bucketOf(cache, block);
+        entry->hashNext = *bucket;
+        *bucket = entry;
+    }
+
+    moveToHead(cache, entry);
+    return entry->data;
+}
+
+void cacheUpdate(blockCache *cache, uint32_t block, uint32_t offset, uint8_t *bytes, uint32_t len) {
+    cacheEntry *entry = findEntry(cache, block);
+    if (entry != NULL) {
+        memcpy(&entry->data[offset], bytes, len);
+    }
+}
+
+void cacheInvalidate(blockCache *cache, uint32_t block) {
+    cacheEntry *entry = findEntry(cache, block);
+    if (entry != NULL) {
+        unhashEntry(cache, entry);
+        moveToTail(cache, entry);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FAT_CACHE_BLOCKS 64 // Default block cache capacity
+
+/* ------------------------------------------------------------------------
+-------------------------------- Block Cache ------------------------------
+------------------------------------------------------------------------*/
+
+// Cached copy of one data block
+typedef struct cacheEntry {
+    uint32_t block; // Block index, 0 when the entry is unused
+    uint8_t *data;  // Block contents, blockSize bytes
+
+    struct cacheEntry *lruPrev;  // More recently used neighbour
+    struct cacheEntry *lruNext;  // Less recently used neighbour
+    struct cacheEntry *hashNext; // Next entry in the same bucket
+} cacheEntry;
+
+// Fixed-size LRU cache of data blocks, keyed by block index
+typedef struct blockCache {
+    uint32_t capacity;  // Entry number
+    uint32_t blockSize; // Bytes per entry
+
+    cacheEntry *entries; // All entries, allocated once
+    uint8_t *data;       // Contents of all entries, allocated once
+
+    cacheEntry **buckets; // Hash buckets of the used entries
+    uint32_t bucketCount; // Bucket number, a power of two
+
+    cacheEntry *lruHead; // Most recently used entry
+    cacheEntry *lruTail; // Least recently used entry, evicted first
+
+    uint64_t hits;   // Lookups served from the cache
+    uint64_t misses; // Lookups that went to the image
+} blockCache;
+
+blockCache *initCache(uint32_t capacity, uint32_t blockSize);
+void freeCache(blockCache **cache);
+uint8_t *cacheLookup(blockCache *cache, uint32_t block);                                 // Contents of a cached block, NULL on a miss
+uint8_t *cacheInsert(blockCache *cache, uint32_t block);                                 // Buffer to fill for the block, evicting the LRU entry
+void cacheUpdate(blockCache *cache, uint32_t block, uint32_t offset, uint8_t *bytes, uint32_t len); // Write through to a cached block
+void cacheInvalidate(blockCache *cache, uint32_t block);                                 // Drop the block if cached
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+initCache           Done
+freeCache           Done
+cacheLookup         Done
+cacheInsert         Done
+cacheUpdate         Done
+cacheInvalidate     Done
+*/
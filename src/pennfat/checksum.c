@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "checksum.h"
+#include "fat.h"
+
+#define CRC_POLY 0x82F63B78 // CRC-32C (Castagnoli), reflected
+
+// Each data block below the checksum region has its CRC32C in the region, four bytes at 4 * index.
+// The checksums change with the data but reach the image like the FAT, through the journal, so a
+// crash between a data write and the next commit leaves the old checksum of that block behind.
+
+static uint32_t crcTable[8][256]; // Slicing-by-8 tables, crcTable[k] advances a byte by k more bytes
+static uint32_t crcShort[4][256]; // Appends CRC_SHORT zero bytes to a CRC, one table per CRC byte
+static uint32_t crcLong[4][256];  // Appends CRC_LONG zero bytes to a CRC
+static uint32_t (*crcKernel)(uint32_t crc, const uint8_t *next, size_t len);
+static char *crcName;
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/* ------------------------------------------------------------------------
+---------------------------------- CRC32C ---------------------------------
+------------------------------------------------------------------------*/
+
+// Eight bytes per step through the tables, the host being little-endian like the image
+static uint32_t crcSoftware(uint32_t crc, const uint8_t *next, size_t len) {
+    while (len > 0 && ((uintptr_t) next & 7) != 0) {
+        crc = crcTable[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, sizeof(uint64_t));
+        word ^= crc;
+        crc = crcTable[7][word & 0xFF] ^ crcTable[6][(word >> 8) & 0xFF] ^ crcTable[5][(word >> 16) & 0xFF] ^ crcTable[4][(word >> 24) & 0xFF] ^
+              crcTable[3][(word >> 32) & 0xFF] ^ crcTable[2][(word >> 40) & 0xFF] ^ crcTable[1][(word >> 48) & 0xFF] ^ crcTable[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = crcTable[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+// Apply an operator held as four byte tables to a CRC
+static uint32_t crcShift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^ zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// Three lanes of lane bytes each, their CRCs joined by shifting over the zeros that follow them
+__attribute__((target("sse4.2"))) static uint64_t crcLanes(uint64_t crc0, const uint8_t *next, size_t lane, uint32_t zeros[][256]) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (size_t i = 0; i < lane; i += 8) {
+        uint64_t word0, word1, word2;
+        memcpy(&word0, &next[i], sizeof(uint64_t));
+        memcpy(&word1, &next[lane + i], sizeof(uint64_t));
+        memcpy(&word2, &next[2 * lane + i], sizeof(uint64_t));
+        crc0 = _mm_crc32_u64(crc0, word0);
+        crc1 = _mm_crc32_u64(crc1, word1);
+        crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    crc0 = crcShift(zeros, crc0) ^ crc1;
+    return crcShift(zeros, crc0) ^ crc2;
+}
+
+// The crc32 instruction has a latency of three cycles but takes one per cycle, so three independent lanes keep it busy
+__attribute__((target("sse4.2"))) static uint32_t crcHardware(uint32_t crc, const uint8_t *next, size_t len) {
+    uint64_t crc0 = crc;
+    while (len > 0 && ((uintptr_t) next & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+
+    while (len >= 3 * CRC_LONG) {
+        crc0 = crcLanes(crc0, next, CRC_LONG, crcLong);
+        next += 3 * CRC_LONG;
+        len -= 3 * CRC_LONG;
+    }
+    while (len >= 3 * CRC_SHORT) {
+        crc0 = crcLanes(crc0, next, CRC_SHORT, crcShort);
+        next += 3 * CRC_SHORT;
+        len -= 3 * CRC_SHORT;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, sizeof(uint64_t));
+        crc0 = _mm_crc32_u64(crc0, word);
+        next += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    return crc0;
+}
+#endif
+
+// Product of a GF(2) matrix, one column per bit, and a vector
+static uint32_t gf2Times(uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2Square(uint32_t *square, uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2Times(matrix, matrix[n]);
+    }
+}
+
+// Tables appending len zero bytes to a CRC, len being a power of two
+static void crcZeros(uint32_t zeros[][256], size_t len) {
+    uint32_t odd[32];
+    uint32_t even[32];
+
+    // One zero bit, then two, then four
+    odd[0] = CRC_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1U << (n - 1);
+    }
+    gf2Square(even, odd);
+    gf2Square(odd, even);
+
+    // Square up to one zero byte, then keep squaring until len is reached
+    uint32_t *op = even;
+    gf2Square(even, odd);
+    for (size_t bytes = 1; bytes < len; bytes <<= 1) {
+        if (op == even) {
+            gf2Square(odd, even);
+            op = odd;
+        } else {
+            gf2Square(even, odd);
+            op = even;
+        }
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2Times(op, n);
+        zeros[1][n] = gf2Times(op, n << 8);
+        zeros[2][n] = gf2Times(op, n << 16);
+        zeros[3][n] = gf2Times(op, n << 24);
+    }
+}
+
+static void initCrc() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+        }
+        crcTable[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            crcTable[k][n] = crcTable[0][crcTable[k - 1][n] & 0xFF] ^ (crcTable[k - 1][n] >> 8);
+        }
+    }
+    crcZeros(crcShort, CRC_SHORT);
+    crcZeros(crcLong, CRC_LONG);
+
+    // The instruction when the CPU has it, the tables otherwise
+    crcKernel = crcSoftware;
+    crcName = "slicing-by-8";
+    #if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) {
+            crcKernel = crcHardware;
+            crcName = "sse4.2";
+        }
+    #endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *bytes, size_t len) {
+    pthread_once(&crcOnce, initCrc);
+    return ~crcKernel(~crc, bytes, len);
+}
+
+char *crc32cKernel() {
+    pthread_once(&crcOnce, initCrc);
+    return crcName;
+}
+
+/* ------------------------------------------------------------------------
+------------------------------ Block Checksums ----------------------------
+------------------------------------------------------------------------*/
+
+// Byte offset of the checksum region in the image
+static off_t regionOffset(pennfat *fat) { return (off_t) fat->totalBlocks * fat->blockSize + (off_t) (fat->sums->start - 1) * fat->blockSize; }
+
+// Enough blocks for the checksums of every block left below them
+uint32_t sumRegionBlocks(uint32_t limit, uint32_t blockSize) { return ((uint64_t) limit * sizeof(uint32_t) + blockSize + sizeof(uint32_t) - 1) / (blockSize + sizeof(uint32_t)); }
+
+blockSums *initSums(pennfat *fat, uint32_t limit, bool creating) {
+    uint32_t blocks = sumRegionBlocks(limit, fat->blockSize);
+    if (limit < blocks + 3) {
+        printf("ERROR: The image is too small for block checksums.\n");
+        return NULL;
+    }
+
+    blockSums *sums = calloc(1, sizeof(blockSums));
+    if (sums == NULL) {
+        perror("ERROR: Fail to malloc the checksums.");
+        return NULL;
+    }
+    sums->blocks = blocks;
+    sums->start = limit - blocks;
+    sums->sums = malloc((size_t) sums->start * sizeof(uint32_t));
+    sums->committed = calloc(sums->start, sizeof(uint32_t));
+    sums->scratch = calloc(fat->blockSize, sizeof(uint8_t));
+    if (sums->sums == NULL || sums->committed == NULL || sums->scratch == NULL) {
+        perror("ERROR: Fail to malloc the checksums.");
+        freeSums(&sums);
+        return NULL;
+    }
+    fat->sums = sums;
+
+    // Every block of a new image reads as zeros, the first commit writes the whole region
+    if (creating) {
+        uint32_t zeroSum = crc32c(0, sums->scratch, fat->blockSize);
+        for (uint32_t i = 0; i < sums->start; i++) {
+            sums->sums[i] = zeroSum;
+        }
+        return sums;
+    }
+
+    size_t size = (size_t) sums->start * sizeof(uint32_t);
+    uint8_t *bytes = (uint8_t *) sums->sums;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fat->fd, bytes + done, size - done, regionOffset(fat) + done);
+        if (n == -1) {
+            perror("ERROR: Fail to read the checksums.");
+            fat->sums = NULL;
+            freeSums(&sums);
+            return NULL;
+        }
+        if (n == 0) {
+            memset(bytes + done, 0, size - done);
+            break;
+        }
+        done += n;
+    }
+    memcpy(sums->committed, sums->sums, size);
+    return sums;
+}
+
+void freeSums(blockSums **sums) {
+    if (*sums == NULL) {
+        return;
+    }
+
+    free((*sums)->sums);
+    free((*sums)->committed);
+    free((*sums)->scratch);
+    free(*sums);
+    *sums = NULL;
+}
+
+void setBlockSum(pennfat *fat, uint32_t index, uint8_t *data) {
+    if (fat->sums == NULL || index >= fat->sums->start) {
+        return;
+    }
+    fat->sums->sums[index] = crc32c(0, data, fat->blockSize);
+}
+
+int verifyBlock(pennfat *fat, uint32_t index, uint8_t *data) {
+    blockSums *sums = fat->sums;
+    if (sums == NULL || index >= sums->start) {
+        return 0;
+    }
+
+    sums->verified++;
+    uint32_t crc = crc32c(0, data, fat->blockSize);
+    if (crc != sums->sums[index]) {
+        sums->failures++;
+        printf("ERROR: Block %u does not match its checksum (%08x, expected %08x).\n", index, crc, sums->sums[index]);
+        return -1;
+    }
+    return 0;
+}
+
+bool blockMatches(pennfat *fat, uint32_t index, uint8_t *data) {
+    blockSums *sums = fat->sums;
+    if (sums == NULL || index >= sums->start) {
+        return true;
+    }
+    return crc32c(0, data, fat->blockSize) == sums->sums[index];
+}
+
+int journalSums(pennfat *fat) {
+    blockSums *sums = fat->sums;
+    if (sums == NULL) {
+        return 0;
+    }
+
+    // Every changed chunk, like the FAT
+    for (uint32_t i = 0; i < sums->start; i += SUM_CHUNK) {
+        uint32_t count = sums->start - i < SUM_CHUNK ? sums->start - i : SUM_CHUNK;
+        if (memcmp(&sums->sums[i], &sums->committed[i], count * sizeof(uint32_t)) == 0) {
+            continue;
+        }
+
+        if (journalWrite(fat, regionOffset(fat) + (off_t) i * sizeof(uint32_t), &sums->sums[i], count * sizeof(uint32_t)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void commitSums(blockSums *sums) {
+    if (sums != NULL) {
+        memcpy(sums->committed, sums->sums, (size_t) sums->start * sizeof(uint32_t));
+    }
+}
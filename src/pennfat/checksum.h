@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FAT_SUM_FLAG 0x80    // Bit of the block size byte of FAT[0] marking an image with block checksums
+#define SUM_CHUNK 64         // Checksums per journal record
+#define CRC_SHORT 256        // Lane length of the hardware kernel for short buffers
+#define CRC_LONG 8192        // Lane length of the hardware kernel for long buffers
+
+/* ------------------------------------------------------------------------
+---------------------------------- CRC32C ---------------------------------
+------------------------------------------------------------------------*/
+
+uint32_t crc32c(uint32_t crc, const void *bytes, size_t len); // Extend crc over len bytes, 0 starts a new checksum
+char *crc32cKernel();                                           // Name of the kernel picked for this CPU
+
+/* ------------------------------------------------------------------------
+------------------------------ Block Checksums ----------------------------
+------------------------------------------------------------------------*/
+
+// CRC32C of every data block, stored in blocks set aside at the end of the data region
+typedef struct blockSums {
+    uint32_t start;      // First block of the checksum region, no data block lies past it
+    uint32_t blocks;     // Blocks of the checksum region
+    uint32_t *sums;      // Checksum of each block below start, a private copy reaching the image through the journal
+    uint32_t *committed; // sums as of the last commit
+    uint8_t *scratch;    // One block, for checks and partial writes
+
+    uint64_t verified; // Blocks checked since mount
+    uint64_t failures; // Blocks whose contents did not match since mount
+} blockSums;
+
+struct pennfat;
+
+uint32_t sumRegionBlocks(uint32_t limit, uint32_t blockSize);                // Blocks of the checksum region of an image whose blocks end at limit
+blockSums *initSums(struct pennfat *fat, uint32_t limit, bool creating);    // Read the checksum region, or set it up for a new image
+void freeSums(blockSums **sums);
+void setBlockSum(struct pennfat *fat, uint32_t index, uint8_t *data);       // Record the checksum of a whole block about to be written
+int verifyBlock(struct pennfat *fat, uint32_t index, uint8_t *data);        // Check a whole block read from the image; -1 on a mismatch
+bool blockMatches(struct pennfat *fat, uint32_t index, uint8_t *data);      // Whether a whole block matches its checksum, neither counted nor reported
+int journalSums(struct pennfat *fat);                                       // Log the changed checksums into the transaction
+void commitSums(blockSums *sums);                                           // The logged checksums are on disk
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+crc32c              Done
+crc32cKernel        Done
+sumRegionBlocks     Done
+initSums            Done
+freeSums            Done
+setBlockSum         Done
+verifyBlock         Done
+blockMatches        Done
+journalSums         Done
+commitSums          Done
+*/
@@ -0,0 +1,597 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defrag.h"
+#include "file.h"
+#include "reflink.h"
+
+#define PREV_HEAD 0x0000      // Predecessor of the first block of a chain
+#define PREV_NONE UINT32_MAX  // Predecessor of a block in no chain
+#define NO_DEST UINT32_MAX    // Planned place of a block that stays where it is
+
+// A defrag plans the layout once, then moves blocks step by step. The used blocks would end at a known block once
+// compacted. A run of a chain that is already contiguous stays where it is, unless it lies past that end and a hole
+// below it fits the run whole, or it is in the way of a run that follows a block that never moves, like the rest of
+// the root directory after block 1, which goes right after that block. Every other run takes the best fitting hole below that end, or else the lowest one
+// past it, where the holes are the free blocks and the blocks of the runs that move. A block goes straight to its
+// planned place once that place is free, so it moves once; only when the moves all wait on each other does one of
+// them go through a spare block. A block is moved by copying it to a free block and relinking its predecessor, and
+// the block it leaves stays taken until the step holding the move committed, so the committed FAT never points at
+// a block that was written over. Blocks shared by reflink copies belong to the first chain reaching them, and a
+// block several FAT entries link to is never moved. The plan outlives a step, and is only made again once
+// something else took or released a block.
+
+// Chain of a file or a directory
+typedef struct defragChain {
+    dirEntryNode *node; // Entry owning the chain, NULL for the root directory
+    uint32_t first;     // First block of the chain
+} defragChain;
+
+// Run of a chain laid out whole, ended by the chain or by a block that never moves
+typedef struct defragPiece {
+    uint32_t first;  // First block of the run
+    uint32_t length; // Blocks in the run
+    uint32_t after;  // Block that never moves the run follows, PREV_HEAD when it starts its chain
+    bool inPlace;    // Contiguous, and right after that block when there is one
+} defragPiece;
+
+// Layout of the chains and the planned moves, kept from one defrag step to the next
+typedef struct defragState {
+    defragChain *chains; // Every chain, in layout order
+    uint32_t numChains;
+    uint32_t chainsCap;  // Allocated length of chains
+
+    uint32_t *prev;   // Predecessor of each block in its chain, PREV_HEAD or PREV_NONE
+    uint32_t *owner;  // Chain of each block in a chain
+    uint8_t *touched; // Chain had a block moved in this step
+    uint8_t *shares;  // Chain has blocks in another chain too
+    uint8_t *buf;     // One block, staging the copies
+
+    uint32_t *dest;        // Planned place of each block, NO_DEST for the blocks that stay
+    uint32_t *pending;     // Blocks still to move, in the order they were planned
+    uint32_t numPending;
+    uint64_t *open;        // Bit i is set when block i is free and no move is planned to it
+    uint64_t chainChanges; // Blocks taken or released by the FAT when the last step ended
+} defragState;
+
+static int addChain(defragState *state, dirEntryNode *node, uint32_t first) {
+    if (state->numChains == state->chainsCap) {
+        uint32_t newCap = state->chainsCap == 0 ? 64 : state->chainsCap * 2;
+        defragChain *newChains = realloc(state->chains, newCap * sizeof(defragChain));
+        if (newChains == NULL) {
+            perror("ERROR: Fail to malloc the chain list.");
+            return -1;
+        }
+        state->chains = newChains;
+        state->chainsCap = newCap;
+    }
+
+    state->chains[state->numChains].node = node;
+    state->chains[state->numChains].first = first;
+    state->numChains++;
+    return 0;
+}
+
+// Chain of dir, then the chains of its entries, walking into every subdirectory
+static int collectChains(pennfat *fat, directory *dir, defragState *state) {
+    if (addChain(state, dir->node, dir->node == NULL ? 1 : dir->node->entry->firstBlock) == -1) {
+        return -1;
+    }
+
+    for (dirEntryNode *curr = dir->head; curr != NULL; curr = curr->next) {
+        if (curr->entry->type == DIRECTORY_FILETYPE) {
+            directory *subDir = getDirectory(fat, curr);
+            if (subDir == NULL || collectChains(fat, subDir, state) == -1) {
+                return -1;
+            }
+        } else if (curr->entry->firstBlock != 0x0000 && curr->entry->firstBlock != FAT_END) {
+            if (addChain(state, curr, curr->entry->firstBlock) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void freeDefragState(defragState *state) {
+    free(state->chains);
+    free(state->prev);
+    free(state->owner);
+    free(state->touched);
+    free(state->shares);
+    free(state->buf);
+    free(state->dest);
+    free(state->pending);
+    free(state->open);
+}
+
+void freeDefrag(defragState **state) {
+    if (*state == NULL) {
+        return;
+    }
+
+    freeDefragState(*state);
+    free(*state);
+    *state = NULL;
+}
+
+static bool isOpen(uint64_t *open, uint32_t index) { return open[index / 64] & (1ULL << (index % 64)); }
+
+static void setOpen(uint64_t *open, uint32_t index, bool value) {
+    if (value) {
+        open[index / 64] |= 1ULL << (index % 64);
+    } else {
+        open[index / 64] &= ~(1ULL << (index % 64));
+    }
+}
+
+// First block of an open run of length blocks below limit: the smallest run that fits among those starting
+// below end, else the lowest one that fits; 0 when none does
+static uint32_t findRun(uint64_t *open, uint32_t length, uint32_t end, uint32_t limit) {
+    uint32_t best = 0;
+    uint32_t bestLength = UINT32_MAX;
+    uint32_t i = 2;
+    while (i < limit) {
+        if (!isOpen(open, i)) {
+            i += i % 64 == 0 && open[i / 64] == 0 ? 64 : 1;
+            continue;
+        }
+
+        uint32_t start = i;
+        while (i < limit && isOpen(open, i)) {
+            i++;
+        }
+        if (i - start < length) {
+            continue;
+        }
+        if (start >= end) {
+            return best != 0 ? best : start;
+        }
+        if (i - start < bestLength) {
+            best = start;
+            bestLength = i - start;
+        }
+    }
+    return best;
+}
+
+// Plan the blocks of the run from first to go to the blocks from to on, one after the other
+static void planRun(pennfat *fat, defragState *state, uint32_t first, uint32_t length, uint32_t to) {
+    uint32_t curr = first;
+    for (uint32_t i = 0; i < length; i++, curr = fat->blocks[curr]) {
+        setOpen(state->open, to + i, false);
+        if (curr != to + i) {
+            state->dest[curr] = to + i;
+            state->pending[state->numPending++] = curr;
+        }
+    }
+}
+
+// Runs following a block that never moves first, then the longest, then the ones starting first
+static int comparePieces(const void *a, const void *b) {
+    const defragPiece *x = a;
+    const defragPiece *y = b;
+    if ((x->after == PREV_HEAD) != (y->after == PREV_HEAD)) {
+        return x->after == PREV_HEAD ? 1 : -1;
+    }
+    if (x->length != y->length) {
+        return x->length > y->length ? -1 : 1;
+    }
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// Runs starting last first
+static int comparePiecesBack(const void *a, const void *b) {
+    const defragPiece *x = a;
+    const defragPiece *y = b;
+    return x->first > y->first ? -1 : x->first < y->first;
+}
+
+// Split the chains into the runs laid out whole
+static defragPiece *collectPieces(pennfat *fat, defragState *state, uint32_t *numPieces) {
+    defragPiece *pieces = malloc((size_t) fat->numEntries * sizeof(defragPiece));
+    if (pieces == NULL) {
+        perror("ERROR: Fail to malloc the runs.");
+        return NULL;
+    }
+
+    *numPieces = 0;
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        // The root directory always starts at block 1
+        uint32_t after = state->chains[c].node == NULL ? 1 : PREV_HEAD;
+        uint32_t curr = state->chains[c].node == NULL ? fat->blocks[1] : state->chains[c].first;
+        defragPiece *piece = NULL;
+        for (; curr != FAT_END && curr != 0x0000 && state->owner[curr] == c; curr = fat->blocks[curr]) {
+            if (blockLinks(fat, curr) > 1) {
+                piece = NULL;
+                after = curr;
+                continue;
+            }
+
+            if (piece != NULL) {
+                piece->inPlace = piece->inPlace && curr == piece->first + piece->length;
+                piece->length++;
+                continue;
+            }
+            piece = &pieces[(*numPieces)++];
+            piece->first = curr;
+            piece->length = 1;
+            piece->after = after;
+            piece->inPlace = after == PREV_HEAD || curr == after + 1;
+        }
+    }
+    return pieces;
+}
+
+// Give every block that moves its place in the compacted layout
+static int planMoves(pennfat *fat, defragState *state) {
+    uint32_t limit = blockLimit(fat);
+    state->dest = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state->pending = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state->open = calloc(limit / 64 + 1, sizeof(uint64_t));
+    uint32_t numPieces = 0;
+    defragPiece *pieces = state->dest == NULL || state->pending == NULL || state->open == NULL ? NULL : collectPieces(fat, state, &numPieces);
+    if (pieces == NULL) {
+        perror("ERROR: Fail to malloc the defrag plan.");
+        return -1;
+    }
+    for (uint32_t i = 0; i < fat->numEntries; i++) {
+        state->dest[i] = NO_DEST;
+    }
+
+    // The used blocks, compacted, end at end
+    uint32_t used = 0;
+    for (uint32_t i = 2; i < limit; i++) {
+        if (fat->freeMap[i / 64] & (1ULL << (i % 64))) {
+            setOpen(state->open, i, true);
+        } else {
+            used++;
+        }
+    }
+    uint32_t end = 2 + used;
+
+    // A run following a block that never moves, like the rest of the root directory, takes the blocks right after
+    // it from the runs in place there, as long as only free blocks and such runs are in the way
+    for (uint32_t p = 0; p < numPieces; p++) {
+        if (pieces[p].inPlace || pieces[p].after == PREV_HEAD || pieces[p].after + 1 + pieces[p].length > limit) {
+            continue;
+        }
+        uint32_t from = pieces[p].after + 1;
+        uint32_t to = from + pieces[p].length;
+        bool clear = true;
+        for (uint32_t i = from; i < to && clear; i++) {
+            clear = isOpen(state->open, i) || (state->prev[i] != PREV_NONE && blockLinks(fat, i) <= 1);
+        }
+        for (uint32_t q = 0; q < numPieces && clear; q++) {
+            if (pieces[q].inPlace && pieces[q].first < to && pieces[q].first + pieces[q].length > from) {
+                pieces[q].inPlace = false;
+            }
+        }
+    }
+
+    // The runs out of place give their blocks to the holes, then take the holes that fit them best,
+    // longest first, right after the block they follow when they can
+    uint32_t numMoving = 0;
+    for (uint32_t p = 0; p < numPieces; p++) {
+        if (pieces[p].inPlace) {
+            continue;
+        }
+        uint32_t curr = pieces[p].first;
+        for (uint32_t i = 0; i < pieces[p].length; i++, curr = fat->blocks[curr]) {
+            setOpen(state->open, curr, true);
+        }
+        defragPiece moving = pieces[p];
+        pieces[p] = pieces[numMoving];
+        pieces[numMoving++] = moving;
+    }
+    qsort(pieces, numMoving, sizeof(defragPiece), comparePieces);
+    uint32_t lowest = 2;
+    for (uint32_t p = 0; p < numMoving; p++) {
+        defragPiece *piece = &pieces[p];
+        uint32_t to = 0;
+        if (piece->after != PREV_HEAD && piece->after + 1 + piece->length <= limit) {
+            to = piece->after + 1;
+            for (uint32_t i = to; i < to + piece->length && to != 0; i++) {
+                to = isOpen(state->open, i) ? to : 0;
+            }
+        }
+        if (to == 0) {
+            to = findRun(state->open, piece->length, end, limit);
+        }
+        if (to != 0) {
+            planRun(fat, state, piece->first, piece->length, to);
+            continue;
+        }
+
+        // No hole fits it whole, so it fills the lowest ones; there are as many open blocks as blocks that move
+        uint32_t curr = piece->first;
+        for (uint32_t i = 0; i < piece->length; i++, curr = fat->blocks[curr]) {
+            while (lowest < limit && !isOpen(state->open, lowest)) {
+                lowest++;
+            }
+            if (lowest == limit) {
+                break;
+            }
+            planRun(fat, state, curr, 1, lowest);
+        }
+    }
+
+    // Then the runs in place that lie past the end, last first, move to a hole below them that fits them best
+    uint32_t numPast = 0;
+    for (uint32_t p = numMoving; p < numPieces; p++) {
+        if (pieces[p].first + pieces[p].length > end) {
+            pieces[numMoving + numPast++] = pieces[p];
+        }
+    }
+    qsort(&pieces[numMoving], numPast, sizeof(defragPiece), comparePiecesBack);
+    for (uint32_t p = numMoving; p < numMoving + numPast; p++) {
+        uint32_t below = pieces[p].first < end ? pieces[p].first : end;
+        uint32_t to = findRun(state->open, pieces[p].length, below, below);
+        if (to != 0) {
+            planRun(fat, state, pieces[p].first, pieces[p].length, to);
+        }
+    }
+
+    free(pieces);
+    return 0;
+}
+
+// Collect the chains and link each block back to its predecessor
+static int initDefragState(pennfat *fat, defragState *state) {
+    memset(state, 0, sizeof(defragState));
+    if (collectChains(fat, fat->root, state) == -1) {
+        freeDefragState(state);
+        return -1;
+    }
+
+    state->prev = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state->owner = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state->touched = calloc(state->numChains, sizeof(uint8_t));
+    state->shares = calloc(state->numChains, sizeof(uint8_t));
+    state->buf = malloc(fat->blockSize);
+    if (state->prev == NULL || state->owner == NULL || state->touched == NULL || state->shares == NULL || state->buf == NULL) {
+        perror("ERROR: Fail to malloc the defrag state.");
+        freeDefragState(state);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < fat->numEntries; i++) {
+        state->prev[i] = PREV_NONE;
+    }
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        uint32_t prev = PREV_HEAD;
+        for (uint32_t curr = state->chains[c].first; curr != FAT_END && curr != 0x0000; curr = fat->blocks[curr]) {
+            // The rest of a chain joining an earlier one belongs to the earlier one
+            if (curr < fat->numEntries && state->prev[curr] != PREV_NONE && prev != PREV_HEAD && state->owner[curr] != c && blockLinks(fat, curr) > 1) {
+                state->shares[c] = 1;
+                state->shares[state->owner[curr]] = 1;
+                break;
+            }
+            if (curr >= fat->numEntries || state->prev[curr] != PREV_NONE) {
+                printf("ERROR: Block %u is linked twice, the FAT needs a check.\n", curr);
+                freeDefragState(state);
+                return -1;
+            }
+            state->prev[curr] = prev;
+            state->owner[curr] = c;
+            prev = curr;
+        }
+    }
+
+    if (planMoves(fat, state) == -1) {
+        freeDefragState(state);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy block from to the free block to, taking its place in the chain
+static int moveBlock(pennfat *fat, defragState *state, uint32_t from, uint32_t to) {
+    if (copyBlock(from, to, state->buf, fat) == -1) {
+        return -1;
+    }
+
+    uint32_t next = fat->blocks[from];
+    uint32_t prev = state->prev[from];
+    defragChain *chain = &state->chains[state->owner[from]];
+    fat->blocks[to] = next;
+    if (prev == PREV_HEAD) {
+        chain->node->entry->firstBlock = to;
+        chain->first = to;
+        markDirEntryDirty(fat, chain->node);
+    } else {
+        fat->blocks[prev] = to;
+    }
+    if (next != FAT_END && next != 0x0000) {
+        state->prev[next] = to;
+    }
+    state->prev[to] = prev;
+    state->owner[to] = state->owner[from];
+    state->touched[state->owner[from]] = 1;
+
+    // Still taken in the bitmap until the step commits
+    releaseBlock(fat, from);
+    state->prev[from] = PREV_NONE;
+    return 0;
+}
+
+// Drop what was built from the chains that moved
+static int refreshChains(pennfat *fat, defragState *state, uint32_t moved) {
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        // A chain sharing blocks may have had them moved by another one
+        if (!state->touched[c] && !(state->shares[c] && moved > 0)) {
+            continue;
+        }
+        state->touched[c] = 0;
+
+        dirEntryNode *node = state->chains[c].node;
+        if (node == NULL) {
+            if (loadDirChain(fat, fat->root, 1) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        dropExtents(node);
+        dropBlockMap(node);
+        if (node->dir != NULL && loadDirChain(fat, node->dir, node->entry->firstBlock) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int defragStep(pennfat *fat, uint32_t budget) {
+    if (fat == NULL) {
+        printf("ERROR: No mounted FAT.\n");
+        return -1;
+    }
+
+    if (budget == 0) {
+        return 0;
+    }
+
+    // A process switched out in the middle of an operation may hold extents, a block map or a place in a chain
+    // that a step would free or move
+    if (fat->busy > 0) {
+        return DEFRAG_BUSY;
+    }
+
+    // Blocks freed by earlier changes can only be filled once they are no longer in the committed FAT
+    if (fat->journal->numFreed > 0 && journalCommit(fat, true) == -1) {
+        return -1;
+    }
+
+    // The layout of the last step only holds if nothing else took or released a block since
+    if (fat->defrag != NULL && fat->defrag->chainChanges != fat->chainChanges) {
+        freeDefrag(&fat->defrag);
+    }
+    if (fat->defrag == NULL) {
+        defragState *newState = malloc(sizeof(defragState));
+        if (newState == NULL) {
+            perror("ERROR: Fail to malloc the defrag state.");
+            return -1;
+        }
+        if (initDefragState(fat, newState) == -1) {
+            free(newState);
+            return -1;
+        }
+        fat->defrag = newState;
+    }
+    defragState *state = fat->defrag;
+
+    // Each block goes straight to its place once the place is free, the others wait for a later step
+    int result = 0;
+    uint32_t moved = 0;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < state->numPending; i++) {
+        uint32_t block = state->pending[i];
+        if (result == 0 && moved < budget && takeBlock(fat, state->dest[block])) {
+            if (moveBlock(fat, state, block, state->dest[block]) == -1) {
+                result = -1;
+            } else {
+                state->dest[block] = NO_DEST;
+                moved++;
+                continue;
+            }
+        }
+        state->pending[kept++] = block;
+    }
+    state->numPending = kept;
+
+    // Every move waits on another one: the first block goes through the last free block no move is planned to
+    if (result == 0 && moved == 0 && state->numPending > 0) {
+        uint32_t block = state->pending[0];
+        uint32_t spare = 0;
+        for (uint32_t i = blockLimit(fat) - 1; i >= 2 && spare == 0; i--) {
+            spare = isOpen(state->open, i) && (fat->freeMap[i / 64] & (1ULL << (i % 64))) ? i : 0;
+        }
+        if (spare == 0) {
+            printf("ERROR: No free block is left to break a cycle of moves, %u blocks stay out of place.\n", state->numPending);
+            state->numPending = 0;
+        } else if (!takeBlock(fat, spare) || moveBlock(fat, state, block, spare) == -1) {
+            result = -1;
+        } else {
+            setOpen(state->open, spare, false);
+            state->dest[spare] = state->dest[block];
+            state->dest[block] = NO_DEST;
+            state->pending[0] = spare;
+            moved++;
+        }
+    }
+
+    // The moves reach the image in one transaction, which frees the blocks they left
+    state->chainChanges = fat->chainChanges;
+    if (refreshChains(fat, state, moved) == -1 || journalCommit(fat, true) == -1) {
+        result = -1;
+    }
+
+    #ifdef DEBUGGING
+        printf("Defrag step moved %u blocks, %u left to move\n", moved, state->numPending);
+    #endif
+
+    if (result == -1) {
+        freeDefrag(&fat->defrag);
+        return -1;
+    }
+    return (int) moved;
+}
+
+int getDefragReport(pennfat *fat, defragReport *report) {
+    memset(report, 0, sizeof(defragReport));
+    if (fat == NULL) {
+        printf("ERROR: No mounted FAT.\n");
+        return -1;
+    }
+
+    defragState state;
+    memset(&state, 0, sizeof(defragState));
+    if (collectChains(fat, fat->root, &state) == -1) {
+        freeDefragState(&state);
+        return -1;
+    }
+
+    for (uint32_t c = 0; c < state.numChains; c++) {
+        uint32_t runs = 0;
+        uint32_t length = 0;
+        uint32_t prev = 0;
+        for (uint32_t curr = state.chains[c].first; curr != FAT_END && curr != 0x0000 && length < fat->numEntries; curr = fat->blocks[curr]) {
+            if (length == 0 || curr != prev + 1) {
+                runs++;
+            }
+            prev = curr;
+            length++;
+        }
+
+        report->chains++;
+        report->blocks += length;
+        report->extents += runs;
+        report->fragmented += runs > 1 ? 1 : 0;
+    }
+
+    // Free runs from the bitmap, which never holds the reserved blocks
+    uint32_t run = 0;
+    for (uint32_t i = 2; i <= fat->numEntries; i++) {
+        if (i < fat->numEntries && (fat->freeMap[i / 64] & (1ULL << (i % 64)))) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            report->freeRuns++;
+            report->largestFree = run > report->largestFree ? run : report->largestFree;
+        }
+        run = 0;
+    }
+
+    freeDefragState(&state);
+    return 0;
+}
+
+void printDefragReport(char *label, defragReport *report) {
+    // Share of the neighbouring blocks of a chain that are adjacent in the image
+    uint32_t pairs = report->blocks - report->chains;
+    double contiguity = pairs == 0 ? 100.0 : 100.0 * (report->blocks - report->extents) / pairs;
+
+    printf("%s: %u files in %u blocks, %u extents, %u fragmented, %.1f%% contiguous; %u free runs, largest %u blocks\n", label, report->chains, report->blocks,
+           report->extents, report->fragmented, contiguity, report->freeRuns, report->largestFree);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fat.h"
+
+#define DEFRAG_STEP_BLOCKS 256 // Blocks moved by one defrag step before it commits
+#define DEFRAG_BUSY -2         // Result of a defrag step left for later, another process is in the middle of an operation on the FAT
+#define DEFRAG_BUSY_TICKS 1    // PennOS ticks defrag sleeps before it tries a step again
+
+/* ------------------------------------------------------------------------
+------------------------------- Defragmenter ------------------------------
+------------------------------------------------------------------------*/
+
+// Layout of the chains and of the free space
+typedef struct defragReport {
+    uint32_t chains;      // Files and directories with blocks, the root included
+    uint32_t blocks;      // Blocks in those chains
+    uint32_t extents;     // Runs of physically adjacent blocks in those chains
+    uint32_t fragmented;  // Chains in more than one run
+    uint32_t freeRuns;    // Runs of free blocks
+    uint32_t largestFree; // Blocks in the longest free run
+} defragReport;
+
+int getDefragReport(pennfat *fat, defragReport *report);   // Walk every chain, loading every directory
+void printDefragReport(char *label, defragReport *report);
+int defragStep(pennfat *fat, uint32_t budget); // Move up to budget blocks toward the front and commit; returns the blocks moved, 0 once compact, DEFRAG_BUSY or -1 on error
+void freeDefrag(struct defragState **state);    // Drop the layout kept between steps
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+getDefragReport     Done
+printDefragReport   Done
+defragStep          Done
+freeDefrag          Done
+*/
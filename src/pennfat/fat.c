@@ -7,14 +7,30 @@
 #include <string.h>
 #include <sys/mman.h>
 
+#include "defrag.h"
 #include "file.h"
+#include "reflink.h"
+#include "scrub.h"
 #include "utils.h"
 
-dirEntryNode *initDirEntryNode(char *fileName, uint32_t size, uint16_t firstBlock, uint8_t type, uint8_t perm, time_t time) {
+dirEntryNode *initDirEntryNode(char *fileName, uint64_t size, uint32_t firstBlock, uint8_t type, uint8_t perm, time_t time) {
     dirEntryNode *newNode = malloc(sizeof(dirEntryNode));
 
     newNode->entry = malloc(sizeof(dirEntry));
     newNode->next = NULL;
+    newNode->prev = NULL;
+    newNode->hashNext = NULL;
+    newNode->parent = NULL;
+    newNode->dir = NULL;
+    newNode->slot = NO_SLOT;
+    newNode->extents = NULL;
+    newNode->numExtents = 0;
+    newNode->blockMap = NULL;
+    newNode->mapBlocks = 0;
+    newNode->mapCap = 0;
+    newNode->ownBlocks = 0;
+    newNode->opens = 0;
+    newNode->writing = false;
 
     dirEntry *entry = newNode->entry;
     entry->size = size;
@@ -28,7 +44,7 @@ dirEntryNode *initDirEntryNode(char *fileName, uint32_t size, uint16_t firstBloc
     }
     strcpy(entry->name, fileName);
 
-    for (int i = 0; i < 16; i++) {
+    for (size_t i = 0; i < sizeof(entry->reserved); i++) {
         entry->reserved[i] = '\0';
     }
     
@@ -36,16 +52,788 @@ dirEntryNode *initDirEntryNode(char *fileName, uint32_t size, uint16_t firstBloc
 }
 
 void freeDirEntryNode(dirEntryNode *fNode) {
+    free(fNode->extents);
+    free(fNode->blockMap);
     free(fNode->entry);
     free(fNode);
 }
 
-pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bool creating) {
+directory *initDirectory(directory *parent, dirEntryNode *node) {
+    directory *dir = malloc(sizeof(directory));
+    if (dir == NULL) {
+        perror("ERROR: Fail to malloc the directory.");
+        return NULL;
+    }
+
+    dir->node = node;
+    dir->parent = parent;
+    dir->head = NULL;
+    dir->tail = NULL;
+    dir->numFile = 0;
+
+    dir->indexSize = FAT_INDEX_SIZE;
+    dir->index = calloc(dir->indexSize, sizeof(dirEntryNode *));
+
+    dir->slots = NULL;
+    dir->slotDirty = NULL;
+    dir->numSlots = 0;
+    dir->slotsCap = 0;
+    dir->dirtySlots = NULL;
+    dir->numDirty = 0;
+    dir->holes = NULL;
+    dir->numHoles = 0;
+
+    dir->dirBlocks = NULL;
+    dir->numDirBlocks = 0;
+    dir->dirBlocksCap = 0;
+
+    dir->nextDirty = NULL;
+    dir->queued = false;
+
+    if (dir->index == NULL) {
+        perror("ERROR: Fail to malloc the index.");
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+void freeDirectory(directory *dir) {
+    if (dir == NULL) {
+        return;
+    }
+
+    while (dir->head != NULL) {
+        dirEntryNode *curr = dir->head;
+        dir->head = curr->next;
+        freeDirectory(curr->dir);
+        freeDirEntryNode(curr);
+    }
+    free(dir->index);
+    free(dir->slots);
+    free(dir->slotDirty);
+    free(dir->dirtySlots);
+    free(dir->holes);
+    free(dir->dirBlocks);
+    free(dir);
+}
+
+// FNV-1a over the name, which is at most MAX_FILENAME bytes and may not be null terminated
+static uint32_t hashFileName(char *fileName) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && fileName[i] != '\0'; i++) {
+        hash ^= (uint8_t) fileName[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void indexInsert(directory *dir, dirEntryNode *fNode) {
+    uint32_t bucket = hashFileName(fNode->entry->name) & (dir->indexSize - 1);
+    fNode->hashNext = dir->index[bucket];
+    dir->index[bucket] = fNode;
+}
+
+static void indexRemove(directory *dir, dirEntryNode *fNode) {
+    dirEntryNode **curr = &dir->index[hashFileName(fNode->entry->name) & (dir->indexSize - 1)];
+    while (*curr != NULL) {
+        if (*curr == fNode) {
+            *curr = fNode->hashNext;
+            break;
+        }
+        curr = &(*curr)->hashNext;
+    }
+    fNode->hashNext = NULL;
+}
+
+// Double the bucket number once the load factor reaches 1
+static void indexGrow(directory *dir) {
+    dirEntryNode **newIndex = calloc(dir->indexSize * 2, sizeof(dirEntryNode *));
+    if (newIndex == NULL) {
+        // Keep the old index, lookups are only slower
+        return;
+    }
+
+    free(dir->index);
+    dir->index = newIndex;
+    dir->indexSize *= 2;
+
+    for (dirEntryNode *curr = dir->head; curr != NULL; curr = curr->next) {
+        indexInsert(dir, curr);
+    }
+}
+
+// Make room for at least numSlots + 1 slots
+static int growSlots(directory *dir) {
+    if (dir->numSlots < dir->slotsCap) {
+        return 0;
+    }
+
+    uint32_t newCap = dir->slotsCap == 0 ? FAT_INDEX_SIZE : dir->slotsCap * 2;
+    dirEntryNode **newSlots = realloc(dir->slots, newCap * sizeof(dirEntryNode *));
+    if (newSlots == NULL) {
+        return -1;
+    }
+    dir->slots = newSlots;
+
+    uint8_t *newDirty = realloc(dir->slotDirty, newCap);
+    if (newDirty == NULL) {
+        return -1;
+    }
+    dir->slotDirty = newDirty;
+
+    uint32_t *newList = realloc(dir->dirtySlots, newCap * sizeof(uint32_t));
+    if (newList == NULL) {
+        return -1;
+    }
+    dir->dirtySlots = newList;
+
+    uint32_t *newHoles = realloc(dir->holes, newCap * sizeof(uint32_t));
+    if (newHoles == NULL) {
+        return -1;
+    }
+    dir->holes = newHoles;
+
+    memset(&dir->slotDirty[dir->slotsCap], 0, newCap - dir->slotsCap);
+    dir->slotsCap = newCap;
+    return 0;
+}
+
+// Queue the slot, and its directory for the next commit
+static void markSlotDirty(pennfat *fat, directory *dir, uint32_t slot) {
+    if (!dir->slotDirty[slot]) {
+        dir->slotDirty[slot] = 1;
+        dir->dirtySlots[dir->numDirty++] = slot;
+    }
+    if (!dir->queued) {
+        dir->queued = true;
+        dir->nextDirty = fat->dirtyDirs;
+        fat->dirtyDirs = dir;
+    }
+}
+
+void markDirEntryDirty(pennfat *fat, dirEntryNode *fNode) {
+    if (fNode->slot != NO_SLOT) {
+        markSlotDirty(fat, fNode->parent, fNode->slot);
+    }
+}
+
+void forgetDirectory(pennfat *fat, directory *dir) {
+    scrubForget(fat->scrub, dir);
+    for (directory **curr = &fat->dirtyDirs; *curr != NULL; curr = &(*curr)->nextDirty) {
+        if (*curr == dir) {
+            *curr = dir->nextDirty;
+            break;
+        }
+    }
+    dir->queued = false;
+    dir->nextDirty = NULL;
+
+    // The loaded directories under it go with it
+    for (dirEntryNode *curr = dir->head; curr != NULL; curr = curr->next) {
+        if (curr->dir != NULL) {
+            forgetDirectory(fat, curr->dir);
+        }
+    }
+}
+
+void addDirEntryNode(pennfat *fat, directory *dir, dirEntryNode *fNode) {
+    fNode->next = NULL;
+    fNode->prev = dir->tail;
+    fNode->parent = dir;
+    if (fNode->dir != NULL) {
+        fNode->dir->parent = dir;
+    }
+
+    if (dir->numFile == 0) { // Directory is empty
+        dir->head = fNode;
+    } else {
+        dir->tail->next = fNode;
+    }
+    dir->tail = fNode;
+    dir->numFile++;
+
+    // Place a new entry in a deleted slot, or after the last one
+    if (fNode->slot == NO_SLOT) {
+        if (dir->numHoles > 0) {
+            fNode->slot = dir->holes[--dir->numHoles];
+        } else if (growSlots(dir) == 0) {
+            fNode->slot = dir->numSlots++;
+        }
+
+        if (fNode->slot != NO_SLOT) {
+            dir->slots[fNode->slot] = fNode;
+            markSlotDirty(fat, dir, fNode->slot);
+        }
+    }
+
+    if (dir->numFile > dir->indexSize) {
+        indexGrow(dir);
+    } else {
+        indexInsert(dir, fNode);
+    }
+}
+
+void removeDirEntryNode(pennfat *fat, dirEntryNode *fNode) {
+    directory *dir = fNode->parent;
+    indexRemove(dir, fNode);
+
+    // Leave a deleted entry in the slot until it is reused
+    if (fNode->slot != NO_SLOT) {
+        dir->slots[fNode->slot] = NULL;
+        dir->holes[dir->numHoles++] = fNode->slot;
+        markSlotDirty(fat, dir, fNode->slot);
+        fNode->slot = NO_SLOT;
+    }
+
+    if (fNode->prev == NULL) {
+        dir->head = fNode->next;
+    } else {
+        fNode->prev->next = fNode->next;
+    }
+
+    if (fNode->next == NULL) {
+        dir->tail = fNode->prev;
+    } else {
+        fNode->next->prev = fNode->prev;
+    }
+
+    fNode->next = NULL;
+    fNode->prev = NULL;
+    dir->numFile--;
+}
+
+// A name fills the whole field when it is MAX_FILENAME bytes long, without a terminating null
+static void setEntryName(dirEntry *entry, char *fileName) {
+    size_t len = strnlen(fileName, MAX_FILENAME);
+    memset(entry->name, '\0', MAX_FILENAME);
+    memcpy(entry->name, fileName, len);
+}
+
+void renameDirEntryNode(pennfat *fat, dirEntryNode *fNode, directory *newDir, char *newFileName) {
+    // Another directory takes the entry in one of its own slots
+    if (newDir != fNode->parent) {
+        removeDirEntryNode(fat, fNode);
+        setEntryName(fNode->entry, newFileName);
+        addDirEntryNode(fat, newDir, fNode);
+        return;
+    }
+
+    indexRemove(newDir, fNode);
+    setEntryName(fNode->entry, newFileName);
+    indexInsert(newDir, fNode);
+    markDirEntryDirty(fat, fNode);
+}
+
+dirEntryNode *lookupDirEntryNode(pennfat *fat, directory *dir, char *fileName) {
+    fat->lookups++;
+
+    dirEntryNode *curr = dir->index[hashFileName(fileName) & (dir->indexSize - 1)];
+    while (curr != NULL) {
+        fat->probes++;
+        if (strncmp(curr->entry->name, fileName, MAX_FILENAME) == 0) {
+            return curr;
+        }
+        curr = curr->hashNext;
+    }
+
+    return NULL;
+}
+
+int addDirBlock(directory *dir, uint32_t block) {
+    if (dir->numDirBlocks == dir->dirBlocksCap) {
+        uint32_t newCap = dir->dirBlocksCap == 0 ? 4 : dir->dirBlocksCap * 2;
+        uint32_t *newBlocks = realloc(dir->dirBlocks, newCap * sizeof(uint32_t));
+        if (newBlocks == NULL) {
+            perror("ERROR: Fail to malloc the directory chain.");
+            return -1;
+        }
+        dir->dirBlocks = newBlocks;
+        dir->dirBlocksCap = newCap;
+    }
+
+    dir->dirBlocks[dir->numDirBlocks++] = block;
+    return 0;
+}
+
+int loadDirChain(pennfat *fat, directory *dir, uint32_t first) {
+    dir->numDirBlocks = 0;
+    for (uint32_t curr = first; curr != FAT_END && curr != 0x0000 && dir->numDirBlocks < fat->numEntries; curr = fat->blocks[curr]) {
+        if (addDirBlock(dir, curr) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+directory *getDirectory(pennfat *fat, dirEntryNode *fNode) {
+    if (fNode->entry->type != DIRECTORY_FILETYPE) {
+        return NULL;
+    }
+    if (fNode->dir != NULL) {
+        return fNode->dir;
+    }
+
+    // Only the directories on a path that was walked are ever read
+    directory *dir = initDirectory(fNode->parent, fNode);
+    if (dir == NULL) {
+        return NULL;
+    }
+    if (loadDirChain(fat, dir, fNode->entry->firstBlock) == -1 || loadDirEntries(fat, dir) == -1) {
+        freeDirectory(dir);
+        return NULL;
+    }
+    if (dir->numDirBlocks == 0) {
+        printf("ERROR: The directory %s has no blocks.\n", fNode->entry->name);
+        freeDirectory(dir);
+        return NULL;
+    }
+
+    fNode->dir = dir;
+    return dir;
+}
+
+// One step of a path walk, NULL when the component is not a directory
+static directory *walkComponent(pennfat *fat, directory *dir, char *component) {
+    if (strcmp(component, ".") == 0) {
+        return dir;
+    }
+    if (strcmp(component, "..") == 0) {
+        return dir->parent == NULL ? dir : dir->parent;
+    }
+
+    dirEntryNode *fNode = lookupDirEntryNode(fat, dir, component);
+    if (fNode == NULL || fNode->entry->type != DIRECTORY_FILETYPE) {
+        return NULL;
+    }
+    return getDirectory(fat, fNode);
+}
+
+// Walk every component of path but the last one, leaving it in name; an empty name means path names dir itself
+static directory *walkPath(pennfat *fat, char *path, char *name) {
+    directory *dir = path[0] == '/' ? fat->root : fat->cwd;
+    name[0] = '\0';
+
+    char *curr = path;
+    while (*curr != '\0') {
+        while (*curr == '/') {
+            curr++;
+        }
+        if (*curr == '\0') {
+            break;
+        }
+
+        size_t len = strcspn(curr, "/");
+        if (len >= MAX_FILENAME) {
+            printf("ERROR: File name %.*s is too long.\n", (int) len, curr);
+            return NULL;
+        }
+
+        // The previous component was a directory on the way
+        if (name[0] != '\0' && (dir = walkComponent(fat, dir, name)) == NULL) {
+            printf("ERROR: %s is not a directory.\n", name);
+            return NULL;
+        }
+        memcpy(name, curr, len);
+        name[len] = '\0';
+        curr += len;
+    }
+
+    return dir;
+}
+
+int resolvePath(pennfat *fat, char *path, directory **parent, char *name) {
+    directory *dir = walkPath(fat, path, name);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    // "/", "." and ".." name a directory, not an entry of one
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        *parent = name[0] == '\0' ? dir : walkComponent(fat, dir, name);
+        name[0] = '\0';
+        return 1;
+    }
+
+    *parent = dir;
+    return 0;
+}
+
+directory *resolveDirectory(pennfat *fat, char *path) {
+    char name[MAX_FILENAME];
+    directory *dir = walkPath(fat, path, name);
+    if (dir == NULL || name[0] == '\0') {
+        return dir;
+    }
+
+    directory *result = walkComponent(fat, dir, name);
+    if (result == NULL) {
+        printf("ERROR: %s is not a directory.\n", path);
+    }
+    return result;
+}
+
+// Blocks the format can address, 0xFFFF being the end of chain mark of a 16-bit FAT
+static uint32_t formatLimit(pennfat *fat) {
+    return fat->wide || fat->numEntries < 0xFFFF ? fat->numEntries : 0xFFFF;
+}
+
+// Blocks 0 (metadata) and 1 (root directory) are never free, and the checksum and link regions end the data blocks
+uint32_t blockLimit(pennfat *fat) {
+    if (fat->sums != NULL) {
+        return fat->sums->start;
+    }
+    return fat->refs != NULL ? fat->refs->start : formatLimit(fat);
+}
+
+static void markFree(pennfat *fat, uint32_t index) {
+    fat->freeMap[index / 64] |= 1ULL << (index % 64);
+    fat->freeSummary[index / 4096] |= 1ULL << ((index / 64) % 64);
+}
+
+static void markUsed(pennfat *fat, uint32_t index) {
+    uint32_t word = index / 64;
+    fat->freeMap[word] &= ~(1ULL << (index % 64));
+    if (fat->freeMap[word] == 0) {
+        fat->freeSummary[word / 64] &= ~(1ULL << (word % 64));
+    }
+}
+
+int buildFreeMap(pennfat *fat) {
+    free(fat->freeMap);
+    free(fat->freeSummary);
+
+    fat->freeWords = (fat->numEntries + 63) / 64;
+    fat->freeMap = calloc(fat->freeWords, sizeof(uint64_t));
+    fat->freeSummary = calloc((fat->freeWords + 63) / 64, sizeof(uint64_t));
+    fat->freeHint = 0;
+    if (fat->freeMap == NULL || fat->freeSummary == NULL) {
+        perror("ERROR: Fail to malloc the free block bitmap.");
+        return -1;
+    }
+
+    // Blocks waiting for a commit stay taken
+    fat->freeBlocks = 0;
+    uint64_t *freed = fat->journal != NULL ? fat->journal->freed : NULL;
+    for (uint32_t i = 2; i < blockLimit(fat); i++) {
+        if (fat->blocks[i] == 0x0000 && (freed == NULL || !(freed[i / 64] & (1ULL << (i % 64))))) {
+            markFree(fat, i);
+            fat->freeBlocks++;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t allocBlock(pennfat *fat) {
+    if (fat->freeBlocks == 0) {
+        return 0;
+    }
+
+    // Search the summary from the hint, wrapping around once
+    uint32_t summaryWords = (fat->freeWords + 63) / 64;
+    for (uint32_t n = 0; n <= summaryWords; n++) {
+        uint32_t s = (fat->freeHint / 64 + n) % summaryWords;
+        uint64_t summary = fat->freeSummary[s];
+        if (n == 0) {
+            // Skip the words before the hint on the first pass
+            summary &= ~0ULL << (fat->freeHint % 64);
+        }
+        if (summary == 0) {
+            continue;
+        }
+
+        uint32_t word = s * 64 + __builtin_ctzll(summary);
+        uint32_t index = word * 64 + __builtin_ctzll(fat->freeMap[word]);
+
+        markUsed(fat, index);
+        fat->freeHint = word;
+        fat->freeBlocks--;
+        fat->chainChanges++;
+        fat->blocks[index] = FAT_END;
+        return index;
+    }
+
+    return 0;
+}
+
+uint32_t allocLastBlock(pennfat *fat) {
+    if (fat->freeBlocks == 0) {
+        return 0;
+    }
+
+    // Search the summary backwards from the end of the image
+    uint32_t summaryWords = (fat->freeWords + 63) / 64;
+    for (uint32_t s = summaryWords; s-- > 0;) {
+        if (fat->freeSummary[s] == 0) {
+            continue;
+        }
+
+        uint32_t word = s * 64 + 63 - __builtin_clzll(fat->freeSummary[s]);
+        uint32_t index = word * 64 + 63 - __builtin_clzll(fat->freeMap[word]);
+
+        markUsed(fat, index);
+        fat->freeBlocks--;
+        fat->chainChanges++;
+        fat->blocks[index] = FAT_END;
+        return index;
+    }
+
+    return 0;
+}
+
+bool takeBlock(pennfat *fat, uint32_t index) {
+    if (index < 2 || index >= blockLimit(fat) || !(fat->freeMap[index / 64] & (1ULL << (index % 64)))) {
+        return false;
+    }
+
+    markUsed(fat, index);
+    fat->freeBlocks--;
+    fat->chainChanges++;
+    fat->blocks[index] = FAT_END;
+    return true;
+}
+
+uint32_t allocRun(pennfat *fat, uint32_t want, uint32_t *got) {
+    *got = 0;
+    if (fat->freeBlocks == 0 || want == 0) {
+        return 0;
+    }
+    if (want > fat->freeBlocks) {
+        want = fat->freeBlocks;
+    }
+
+    // First fit from the hint to the end, then from the start to the hint, remembering the longest run
+    uint32_t bestStart = 0;
+    uint32_t bestLength = 0;
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+    for (int pass = 0; pass < 2 && bestLength < want; pass++) {
+        uint32_t from = pass == 0 ? fat->freeHint * 64 : 0;
+        uint32_t to = pass == 0 ? blockLimit(fat) : fat->freeHint * 64;
+        runLength = 0;
+
+        for (uint32_t i = from; i < to && bestLength < want;) {
+            uint64_t word = fat->freeMap[i / 64];
+            if (i % 64 == 0 && word == 0) {
+                // A whole word in use
+                runLength = 0;
+                i += 64;
+                continue;
+            } else if (i % 64 == 0 && word == ~0ULL) {
+                // A whole word free
+                if (runLength == 0) {
+                    runStart = i;
+                }
+                runLength += 64;
+                i += 64;
+            } else if (word & (1ULL << (i % 64))) {
+                if (runLength == 0) {
+                    runStart = i;
+                }
+                runLength++;
+                i++;
+            } else {
+                runLength = 0;
+                i++;
+                continue;
+            }
+
+            if (runLength > bestLength) {
+                bestStart = runStart;
+                bestLength = runLength;
+            }
+        }
+    }
+
+    if (bestLength > want) {
+        bestLength = want;
+    }
+
+    // Chain the run in order
+    for (uint32_t i = bestStart; i < bestStart + bestLength; i++) {
+        markUsed(fat, i);
+        fat->blocks[i] = i + 1 < bestStart + bestLength ? i + 1 : FAT_END;
+    }
+    fat->freeBlocks -= bestLength;
+    fat->chainChanges++;
+    fat->freeHint = (bestStart + bestLength) / 64 < fat->freeWords ? (bestStart + bestLength) / 64 : 0;
+
+    *got = bestLength;
+    return bestStart;
+}
+
+void releaseBlock(pennfat *fat, uint32_t index) {
+    if (index == 0x0000 || index == FAT_END) {
+        return;
+    }
+
+    fat->blocks[index] = 0x0000;
+    fat->chainChanges++;
+    if (fat->cache != NULL) {
+        cacheInvalidate(fat->cache, index);
+    }
+    if (index < 2 || index >= blockLimit(fat)) {
+        return;
+    }
+
+    // The committed FAT still links to the block, a crash before the next commit would read whatever it got next
+    journal *journal = fat->journal;
+    if (journal != NULL && journal->committed[index] != 0x0000) {
+        if (!(journal->freed[index / 64] & (1ULL << (index % 64)))) {
+            journal->freed[index / 64] |= 1ULL << (index % 64);
+            journal->numFreed++;
+        }
+        return;
+    }
+
+    markFree(fat, index);
+    fat->freeBlocks++;
+}
+
+void releasePending(pennfat *fat) {
+    journal *journal = fat->journal;
+    for (uint32_t word = 0; journal->numFreed > 0 && word < fat->freeWords; word++) {
+        while (journal->freed[word] != 0) {
+            uint32_t index = word * 64 + __builtin_ctzll(journal->freed[word]);
+            journal->freed[word] &= journal->freed[word] - 1;
+            journal->numFreed--;
+
+            markFree(fat, index);
+            fat->freeBlocks++;
+        }
+    }
+}
+
+int reclaimBlocks(pennfat *fat, uint32_t needed) {
+    if (fat->freeBlocks >= needed || fat->journal == NULL || fat->journal->numFreed == 0) {
+        return 0;
+    }
+
+    // Called before an operation changes anything, so what the FAT holds is whole
+    return journalCommit(fat, true);
+}
+
+int setCacheCapacity(pennfat *fat, uint32_t capacity) {
+    freeCache(&fat->cache);
+
+    // The mapping already serves reads from the page cache
+    if (fat->image != NULL || capacity == 0) {
+        return 0;
+    }
+
+    fat->cache = initCache(capacity, fat->blockSize);
+    return fat->cache == NULL ? -1 : 0;
+}
+
+int setIoBackend(pennfat *fat, char *name) {
+    ioBackend *io = initIoBackend(name);
+    if (io == NULL) {
+        return -1;
+    }
+
+    freeIoBackend(&fat->io);
+    fat->io = io;
+    return 0;
+}
+
+uint32_t fatEntrySize(pennfat *fat) { return fat->wide ? sizeof(uint32_t) : sizeof(uint16_t); }
+
+void encodeFat(pennfat *fat, uint32_t first, uint32_t count, uint8_t *bytes) {
+    if (fat->wide) {
+        memcpy(bytes, &fat->blocks[first], count * sizeof(uint32_t));
+        return;
+    }
+
+    uint16_t *narrow = (uint16_t *) bytes;
+    for (uint32_t i = 0; i < count; i++) {
+        narrow[i] = fat->blocks[first + i] == FAT_END ? 0xFFFF : fat->blocks[first + i];
+    }
+}
+
+// Read the FAT region of the image into blocks, widening a 16-bit FAT
+static int decodeFat(pennfat *fat, int f) {
+    size_t fatSize = (size_t) fat->totalBlocks * fat->blockSize;
+    uint8_t *bytes = fat->wide ? (uint8_t *) fat->blocks : malloc(fatSize);
+    if (bytes == NULL) {
+        perror("ERROR: Fail to malloc FAT.\n");
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < fatSize) {
+        ssize_t n = pread(f, bytes + done, fatSize - done, done);
+        if (n == -1) {
+            perror("ERROR: Fail to read FAT.\n");
+            if (!fat->wide)
+                free(bytes);
+            return -1;
+        }
+        if (n == 0) {
+            memset(bytes + done, 0, fatSize - done);
+            break;
+        }
+        done += n;
+    }
+
+    if (!fat->wide) {
+        uint16_t *narrow = (uint16_t *) bytes;
+        for (uint32_t i = 0; i < fat->numEntries; i++) {
+            fat->blocks[i] = narrow[i] == 0xFFFF ? FAT_END : narrow[i];
+        }
+        free(bytes);
+    }
+    return 0;
+}
+
+// The 16-bit layout keeps the original offsets: size at 32, first block at 36, type at 38, perm at 39, mtime at 40
+void encodeDirEntry(pennfat *fat, dirEntry *entry, uint8_t *bytes) {
+    if (fat->wide) {
+        memcpy(bytes, entry, sizeof(dirEntry));
+        return;
+    }
+
+    uint32_t size = entry->size;
+    uint16_t firstBlock = entry->firstBlock;
+    memset(bytes, 0, sizeof(dirEntry));
+    memcpy(&bytes[0], entry->name, MAX_FILENAME);
+    memcpy(&bytes[32], &size, sizeof(uint32_t));
+    memcpy(&bytes[36], &firstBlock, sizeof(uint16_t));
+    bytes[38] = entry->type;
+    bytes[39] = entry->perm;
+    memcpy(&bytes[40], &entry->mtime, sizeof(time_t));
+    memcpy(&bytes[48], entry->reserved, sizeof(entry->reserved));
+}
+
+void decodeDirEntry(pennfat *fat, uint8_t *bytes, dirEntry *entry) {
+    if (fat->wide) {
+        memcpy(entry, bytes, sizeof(dirEntry));
+        return;
+    }
+
+    uint32_t size;
+    uint16_t firstBlock;
+    memcpy(entry->name, &bytes[0], MAX_FILENAME);
+    memcpy(&size, &bytes[32], sizeof(uint32_t));
+    memcpy(&firstBlock, &bytes[36], sizeof(uint16_t));
+    entry->size = size;
+    entry->firstBlock = firstBlock;
+    entry->type = bytes[38];
+    entry->perm = bytes[39];
+    memcpy(&entry->mtime, &bytes[40], sizeof(time_t));
+    memcpy(entry->reserved, &bytes[48], sizeof(entry->reserved));
+}
+
+pennfat *initFat(char *fileName, uint32_t totalBlocks, uint8_t blockSizeIndex, bool wide, bool checksums, bool reflinks, bool creating, bool mapImage, bool readOnly) {
     // Check FAT block size
-    if (totalBlocks < 1 || totalBlocks > 32) {
+    if (!wide && (totalBlocks < 1 || totalBlocks > 32)) {
         printf("WARNING: Number of blocks should be [1-32].\n");
         return NULL;
     }
+    if (wide && (totalBlocks < 1 || totalBlocks > FAT_WIDE_MAX_BLOCKS)) {
+        printf("WARNING: Number of blocks of a 32-bit FAT should be [1-%d].\n", FAT_WIDE_MAX_BLOCKS);
+        return NULL;
+    }
 
     // check if numBlocks is valid
     if (blockSizeIndex < 1 || blockSizeIndex > 4) {
@@ -68,15 +856,30 @@ pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bo
     strcpy(newFAT->fileName, fileName);
 
     newFAT->totalBlocks = totalBlocks;
+    newFAT->wide = wide;
     newFAT->blockSize = FAT_BLOCK_SIZE[blockSizeIndex];
 
-    newFAT->numEntries = (newFAT->blockSize * newFAT->totalBlocks) / 2;
+    newFAT->numEntries = (newFAT->blockSize * newFAT->totalBlocks) / fatEntrySize(newFAT);
 
-    newFAT->numFile = 0;
-    newFAT->head = NULL;
-    newFAT->tail = NULL;
+    newFAT->root = initDirectory(NULL, NULL);
+    newFAT->cwd = newFAT->root;
+    newFAT->dirtyDirs = NULL;
+    newFAT->scrub = NULL;
+    newFAT->defrag = NULL;
+    newFAT->busy = 0;
+    newFAT->lookups = 0;
+    newFAT->probes = 0;
+    if (newFAT->root == NULL) {
+        return NULL;
+    }
 
-    newFAT->freeBlocks = newFAT->numEntries - 2;
+    newFAT->freeBlocks = 0;
+    newFAT->chainChanges = 0;
+    newFAT->journal = NULL;
+    newFAT->freeMap = NULL;
+    newFAT->freeSummary = NULL;
+    newFAT->sums = NULL;
+    newFAT->refs = NULL;
 
     int f;
     if (creating) {
@@ -93,27 +896,86 @@ pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bo
         }
     } else {
         // otherwise, just load the file
-        if ((f = open(fileName, O_RDWR, 0644)) == -1) {
+        if ((f = open(fileName, readOnly ? O_RDONLY : O_RDWR, 0644)) == -1) {
         perror("ERROR: Fail to open the file.");
         return NULL;
         }
     }
     
-    // Map FAT table in memory to disk
-    newFAT->blocks = mmap(NULL, newFAT->totalBlocks * newFAT->blockSize, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
-    if (newFAT->blocks == MAP_FAILED) {
-        perror("ERROR: Fail to map FAT.\n");
+    // Finish the last committed transaction before trusting the FAT
+    off_t journalOffset = (off_t) newFAT->totalBlocks * newFAT->blockSize + (off_t) (newFAT->numEntries - 1) * newFAT->blockSize;
+    if (!creating && !readOnly && replayJournal(f, journalOffset) == -1) {
+        printf("ERROR: Fail to replay the journal.\n");
         return NULL;
     }
 
-    // Close the file
-    if (close(f) == -1) {
-        perror("ERROR: Fail to close the file.");
+    // Keep the FAT in memory with 32-bit entries, changes reach the image through the journal
+    size_t fatSize = (size_t) newFAT->totalBlocks * newFAT->blockSize;
+    newFAT->blocks = calloc(newFAT->numEntries, sizeof(uint32_t));
+    if (newFAT->blocks == NULL) {
+        perror("ERROR: Fail to malloc FAT.\n");
+        return NULL;
+    }
+    if (!creating && decodeFat(newFAT, f) == -1) {
+        return NULL;
+    }
+
+    // Map the data region in mapped mode
+    newFAT->image = NULL;
+    newFAT->mapSize = 0;
+    if (mapImage) {
+        newFAT->mapSize = fatSize + (size_t) (newFAT->numEntries - 1) * newFAT->blockSize;
+
+        // Grow the image to its full size, the unwritten blocks stay holes
+        struct stat st;
+        if (fstat(f, &st) == -1) {
+            perror("ERROR: Fail to stat the file.");
+            return NULL;
+        }
+        if ((size_t) st.st_size < newFAT->mapSize && ftruncate(f, newFAT->mapSize) == -1) {
+            perror("ERROR: Fail to truncate the file.");
+            return NULL;
+        }
+
+        newFAT->image = mmap(NULL, newFAT->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+        if (newFAT->image == MAP_FAILED) {
+            perror("ERROR: Fail to map the image.\n");
+            return NULL;
+        }
+    }
+
+    // Cache data blocks
+    newFAT->cache = NULL;
+    if (setCacheCapacity(newFAT, FAT_CACHE_BLOCKS) == -1) {
+        return NULL;
+    }
+
+    // Transfer blocks with io_uring when the kernel allows it
+    newFAT->io = NULL;
+    if (setIoBackend(newFAT, NULL) == -1) {
+        return NULL;
+    }
+
+    // Keep the file open until the FAT is freed
+    newFAT->fd = f;
+    newFAT->readOnly = readOnly;
+    newFAT->reads = 0;
+    newFAT->writes = 0;
+    newFAT->raHits = 0;
+    newFAT->raMisses = 0;
+    newFAT->raBlocks = 0;
+
+    // Set the link region aside at the end of the data blocks, then the checksum region before it
+    if (reflinks && initRefTable(newFAT, formatLimit(newFAT), creating) == NULL) {
+        return NULL;
+    }
+    if (checksums && initSums(newFAT, reflinks ? newFAT->refs->start : formatLimit(newFAT), creating) == NULL) {
         return NULL;
     }
 
     // Store FAT metadata
-    newFAT->blocks[0] = (uint16_t) totalBlocks << 8 | blockSizeIndex;
+    uint8_t sizeByte = blockSizeIndex | (checksums ? FAT_SUM_FLAG : 0) | (reflinks ? FAT_REF_FLAG : 0);
+    newFAT->blocks[0] = wide ? totalBlocks << 16 | FAT_WIDE_MARK << 8 | sizeByte : totalBlocks << 8 | sizeByte;
     #ifdef DEBUGGING
         printf("Storing the FAT metadata at %d\n", newFAT->blocks[0]);
     #endif
@@ -123,12 +985,33 @@ pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bo
         #ifdef DEBUGGING
             printf("Link the first init (%d) by the root directory ", newFAT->blocks[1]);
         #endif
-        newFAT->blocks[1] = 0xFFFF;
+        newFAT->blocks[1] = FAT_END;
         #ifdef DEBUGGING
             printf("%d\n", newFAT->blocks[1]);
         #endif
     }
 
+    // Log changes against the FAT as the image holds it, nothing for a new one
+    newFAT->journal = initJournal(newFAT, creating);
+    if (newFAT->journal == NULL) {
+        return NULL;
+    }
+
+    // Index the free blocks
+    if (buildFreeMap(newFAT) == -1) {
+        return NULL;
+    }
+
+    // Remember the root directory chain, which always starts at block 1
+    if (loadDirChain(newFAT, newFAT->root, 1) == -1) {
+        return NULL;
+    }
+
+    // A new image is usable as soon as it is created
+    if (creating && journalCommit(newFAT, true) == -1) {
+        return NULL;
+    }
+
     #ifdef DEBUGGING
         if(creating) {
             printf("Creating new FAT...\n");
@@ -140,7 +1023,6 @@ pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bo
         printf("newFAT->freeBlocks =  %d\n", newFAT->freeBlocks);
         printf("newFAT->blockSize =  %d\n", newFAT->blockSize);
         printf("newFAT->numEntries =  %d\n", newFAT->numEntries);
-        printf("newFAT->numFile =  %d\n", newFAT->numFile);
         printf("newFAT->blocks[0] =  %d\n", newFAT->blocks[0]);
         printf("newFAT->blocks[1] =  %d\n", newFAT->blocks[1]);
     #endif
@@ -148,14 +1030,14 @@ pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bo
     return newFAT;
 }
 
-int loadDirEntries(pennfat *fat) {
+int loadDirEntries(pennfat *fat, directory *dir) {
     // Directory entry already initialized
-    if (fat->numFile != 0) {
+    if (dir->numFile != 0) {
         writeHelper("Directory entry already initialized.\n");
         return -1;
     }
 
-    file *file = getAllFile(fat);
+    file *file = getAllFile(dir, fat);
 
     if (file == NULL) {
         #ifdef DEBUGGING
@@ -166,13 +1048,36 @@ int loadDirEntries(pennfat *fat) {
     
     // Create new dir node
     for (int i = 0; i < file->len; i = i + 64) {
-        dirEntryNode *newNode = malloc(sizeof(dirEntryNode));
-        newNode->next = NULL;
+        if (growSlots(dir) == -1) {
+            perror("ERROR: Fail to malloc the slots.");
+            return -1;
+        }
 
+        // Deleted entries leave a slot to reuse
+        uint32_t slot = dir->numSlots++;
+        if (file->contents[i] == 1 || file->contents[i] == 2) {
+            dir->slots[slot] = NULL;
+            dir->holes[dir->numHoles++] = slot;
+            continue;
+        }
+
+        dirEntryNode *newNode = malloc(sizeof(dirEntryNode));
         if (newNode == NULL) {
             perror("ERROR: Fail to malloc the file.");
             return -1;
         }
+        newNode->hashNext = NULL;
+        newNode->dir = NULL;
+        newNode->slot = slot;
+        newNode->extents = NULL;
+        newNode->numExtents = 0;
+        newNode->blockMap = NULL;
+        newNode->mapBlocks = 0;
+        newNode->mapCap = 0;
+        newNode->ownBlocks = 0;
+        newNode->opens = 0;
+        newNode->writing = false;
+        dir->slots[slot] = newNode;
 
         dirEntry *newEntry = malloc(sizeof(dirEntry));
         if (newEntry == NULL) {
@@ -181,38 +1086,19 @@ int loadDirEntries(pennfat *fat) {
             return -1;
         }
 
-        memcpy((uint8_t *) &newEntry->name,         &file->contents[i],         32 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->size,         &file->contents[i + 32],     4 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->firstBlock,   &file->contents[i + 36],     2 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->type,         &file->contents[i + 38],     1 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->perm,         &file->contents[i + 39],     1 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->mtime,        &file->contents[i + 40],     8 * sizeof(uint8_t));
-        memcpy((uint8_t *) &newEntry->reserved,     &file->contents[i + 48],    16 * sizeof(uint8_t));
+        decodeDirEntry(fat, &file->contents[i], newEntry);
 
         newNode->entry = newEntry;
 
-        if (fat->numFile == 0) { // FAT is empty
-            // initialize FAT
-            fat->head = newNode;
-            fat->tail = newNode;
-        } else {
-            // Append FAT
-            fat->tail->next = newNode;
-            fat->tail = newNode;
-        }
-
-        // Get the number of freeblocks
-        fat->freeBlocks -= ceil((double) newEntry->size / fat->blockSize);
-
-        // Increment numFile
-        fat->numFile++;
+        // Append to the list and the index, incrementing numFile
+        addDirEntryNode(fat, dir, newNode);
     }
 
     freeFile(file);
     return 0;
 }
 
-pennfat *loadFat(char *fileName) {
+pennfat *loadFat(char *fileName, bool mapImage, bool readOnly) {
     int f;
     if ((f = open(fileName, O_RDONLY, 0644)) == -1) {
         perror("ERROR: Fail to open the file.");
@@ -224,18 +1110,27 @@ pennfat *loadFat(char *fileName) {
     if (read(f, &blockSizeIndex, sizeof(uint8_t)) == -1) {
         return NULL;
     }
+    bool checksums = blockSizeIndex & FAT_SUM_FLAG;
+    bool reflinks = blockSizeIndex & FAT_REF_FLAG;
+    blockSizeIndex &= ~(FAT_SUM_FLAG | FAT_REF_FLAG);
     #ifdef DEBUGGING
         printf("blockSizeIndex is %d\n", blockSizeIndex);
     #endif
 
-    // Get the totalBlocks
+    // Get the totalBlocks, a zero here marks a 32-bit FAT with the number in the next two bytes
     uint8_t totalBlocks = 0;
     if (read(f, &totalBlocks, sizeof(uint8_t)) == -1) {
         perror("ERROR: Fail to read the file.");
         return NULL;
     }
+    bool wide = totalBlocks == FAT_WIDE_MARK;
+    uint16_t wideBlocks = 0;
+    if (wide && read(f, &wideBlocks, sizeof(uint16_t)) == -1) {
+        perror("ERROR: Fail to read the file.");
+        return NULL;
+    }
     #ifdef DEBUGGING
-        printf("totalBlocks is %d\n", totalBlocks);
+        printf("totalBlocks is %d\n", wide ? wideBlocks : totalBlocks);
     #endif
 
     if (close(f) == -1) {
@@ -244,14 +1139,14 @@ pennfat *loadFat(char *fileName) {
     }
 
     // Overwrite the FAT
-    pennfat *output = initFat(fileName, totalBlocks, blockSizeIndex, false);
+    pennfat *output = initFat(fileName, wide ? wideBlocks : totalBlocks, blockSizeIndex, wide, checksums, reflinks, false, mapImage && !readOnly, readOnly);
 
     if (output == NULL) {
         printf("ERROR: Fail to load FAT.\n");
         return NULL;
     }
 
-    if (loadDirEntries(output) == -1) {
+    if (loadDirEntries(output, output->root) == -1) {
         freeFat(&output);
         return NULL;
     }
@@ -259,6 +1154,19 @@ pennfat *loadFat(char *fileName) {
     return output;
 }
 
+int syncFat(pennfat *fat) {
+    if (fat == NULL || fat->journal == NULL || fat->journal->ops == 0) {
+        return 0;
+    }
+
+    if (journalCommit(fat, true) == -1) {
+        printf("ERROR: Fail to commit the journal\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 int saveFat(pennfat *fat) {
     if (fat == NULL) {
         printf("WARNING: The FAT is NULL.\n");
@@ -268,8 +1176,8 @@ int saveFat(pennfat *fat) {
     #ifdef DEBUGGING
         writeHelper("Saving the Fat...");
     #endif
-    if (writeDirEntries(fat) == -1) {
-        printf("ERROR: Fail to write directory entries\n");
+    if (journalCommit(fat, false) == -1) {
+        printf("ERROR: Fail to commit the journal\n");
         return -1;
     }
 
@@ -283,23 +1191,39 @@ void freeFat(pennfat **fat) {
         return;
     }
 
+    // Bring the image up to date before dropping the metadata
+    if (!thisFat->readOnly && closeJournal(thisFat) == -1) {
+        printf("ERROR: Fail to close the journal.\n");
+    }
+    freeJournal(&thisFat->journal);
+
     // Free fileName
     if (thisFat->fileName != NULL)
         free(thisFat->fileName);
 
-    // Free directory entries
-    while (thisFat->head != NULL) {
-        dirEntryNode *curr = thisFat->head;
-        thisFat->head = curr->next;
-        freeDirEntryNode(curr);
-    }
+    // Free directory entries, every loaded directory with them
+    freeDirectory(thisFat->root);
+    freeScrubber(&thisFat->scrub);
+    freeDefrag(&thisFat->defrag);
+    freeSums(&thisFat->sums);
+    freeRefTable(&thisFat->refs);
+    free(thisFat->freeMap);
+    free(thisFat->freeSummary);
+    freeCache(&thisFat->cache);
+    freeIoBackend(&thisFat->io);
+    free(thisFat->blocks);
 
-    // Unmap FAT
-    if (munmap(thisFat->blocks, thisFat->totalBlocks * thisFat->blockSize) == -1) {
-        perror("ERROR: Fail to unmap FAT.\n");
+    // Unmap the image
+    if (thisFat->image != NULL && munmap(thisFat->image, thisFat->mapSize) == -1) {
+        perror("ERROR: Fail to unmap the image.\n");
         return;
     }
 
+    // Close the file
+    if (close(thisFat->fd) == -1) {
+        perror("ERROR: Fail to close the file.");
+    }
+
     free(thisFat);
     *fat = NULL;
 }
\ No newline at end of file
@@ -5,7 +5,17 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "cache.h"
+#include "checksum.h"
+#include "io.h"
+#include "journal.h"
+
 #define MAX_FILENAME 32
+#define FAT_END 0xFFFFFFFF        // End of chain mark in the FAT in memory, stored as 0xFFFF in a 16-bit FAT
+#define FAT_WIDE_MARK 0x00        // Second byte of a 32-bit FAT, where a 16-bit FAT holds its block number
+#define FAT_WIDE_MAX_BLOCKS 4096  // FAT blocks of a 32-bit FAT at most, 4M entries with 4096 byte blocks
+#define FAT_INDEX_SIZE 64 // Initial bucket number of the file entry index
+#define NO_SLOT UINT32_MAX // Slot of a node not yet placed in the directory file
 
 static int FAT_BLOCK_SIZE[] = {256, 512, 1024, 2048, 4096};
 
@@ -13,60 +23,208 @@ static int FAT_BLOCK_SIZE[] = {256, 512, 1024, 2048, 4096};
 --------------------------------- Dir Entry -------------------------------
 ------------------------------------------------------------------------*/
 
-// Dir entry
+// Dir entry, as a 32-bit FAT stores it; a 16-bit FAT stores a 32-bit size and a 16-bit first block
 typedef struct dirEntry {
     char name[MAX_FILENAME]; // name[0] - 0: end of directory; 1: deleted entry; the file is also deleted; 2: deleted entry; the file is still being used
-    uint32_t size;
-    uint16_t firstBlock;
+    uint64_t size;
+    uint32_t firstBlock;
     uint8_t type; // – 0: unknown; 1: a regular file; 2: a directory file; 4: a symbolic link
     uint8_t perm; // 0: none; 2: write only; 4: read only; 5: read and executable (shell scripts); 6: read and write; 7: read, write, and executable
     time_t mtime;
 
-    uint8_t reserved[16]; // For extra credits
+    uint8_t reserved[8]; // For extra credits
 } dirEntry;
 
+// Run of physically adjacent blocks in a file
+typedef struct extent {
+    uint32_t start;  // First block of the run
+    uint32_t length; // Block number of the run
+} extent;
+
 // Dir entry Linked-list struct
 typedef struct dirEntryNode {
     dirEntry *entry;
     struct dirEntryNode *next;
+    struct dirEntryNode *prev;
+    struct dirEntryNode *hashNext; // Next node in the same index bucket
+    struct directory *parent;      // Directory holding the entry
+    struct directory *dir;         // Contents of a directory file, NULL until loaded
+    uint32_t slot;                 // Position of the entry in the directory file
+    extent *extents;               // Runs of the chain, NULL until built or after the chain changes
+    uint32_t numExtents;
+    uint32_t *blockMap;            // Block of each logical block, NULL until built, extended by appends
+    uint32_t mapBlocks;            // Logical blocks in blockMap
+    uint32_t mapCap;               // Allocated length of blockMap
+    uint32_t ownBlocks;            // Leading logical blocks no other chain reaches, at least
+    uint32_t opens;                // Open file table entries on this file
+    bool writing;                  // Open with F_WRITE or F_APPEND
 } dirEntryNode;
 
-dirEntryNode *initDirEntryNode(char *fileName, uint32_t size, uint16_t firstBlock, uint8_t type, uint8_t perm, time_t time); // Create a new file entry
+dirEntryNode *initDirEntryNode(char *fileName, uint64_t size, uint32_t firstBlock, uint8_t type, uint8_t perm, time_t time); // Create a new file entry
 void freeDirEntryNode(dirEntryNode *fNode);                                                                                  // Free the file entry node
 
+/* ------------------------------------------------------------------------
+--------------------------------- Directory -------------------------------
+------------------------------------------------------------------------*/
+
+// Directory file in memory, each one with its own list, index and slots
+typedef struct directory {
+    dirEntryNode *node;       // Entry of the directory in its parent, NULL for the root
+    struct directory *parent; // Parent directory, NULL for the root
+
+    dirEntryNode *head; // First node in the file entry linked-list
+    dirEntryNode *tail; // Last node in the file entry linked-list
+    uint32_t numFile;   // File number
+
+    dirEntryNode **index; // Hash index of the file entries, keyed on name
+    uint32_t indexSize;   // Bucket number, always a power of two
+
+    dirEntryNode **slots; // Node in each directory slot, NULL for a deleted entry
+    uint8_t *slotDirty;   // Slot changed since the last save
+    uint32_t numSlots;    // Slots in use in the directory file, deleted ones included
+    uint32_t slotsCap;    // Allocated length of slots and slotDirty
+    uint32_t *dirtySlots; // Dirty slot numbers, numDirty of them
+    uint32_t numDirty;
+    uint32_t *holes;      // Deleted slots to reuse, numHoles of them
+    uint32_t numHoles;
+
+    uint32_t *dirBlocks;  // Blocks of the directory chain, in order
+    uint32_t numDirBlocks;
+    uint32_t dirBlocksCap; // Allocated length of dirBlocks
+
+    struct directory *nextDirty; // Next directory with dirty slots
+    bool queued;                 // On the dirty directory list
+} directory;
+
+directory *initDirectory(directory *parent, dirEntryNode *node); // Empty directory, its chain is set by the caller
+void freeDirectory(directory *dir);                               // Free the directory and every loaded one under it
+int addDirBlock(directory *dir, uint32_t block);                  // Append a block to the chain list of the directory
+
 /* ------------------------------------------------------------------------
 ---------------------------------- Penn Fat -------------------------------
 ------------------------------------------------------------------------*/
 
+struct refTable;
+struct scrubber;
+struct defragState;
+
 typedef struct pennfat {
     char *fileName; // Filename on disk
+    int fd;         // Descriptor of the image, open for the whole mount
+    bool readOnly;  // Opened to be inspected: the journal is neither replayed nor closed, nothing reaches the image
 
-    uint8_t totalBlocks; // FAT blocks number
-    uint32_t freeBlocks; // Free block number
-    uint32_t blockSize;  // Block size
+    uint32_t totalBlocks; // FAT blocks number
+    bool wide;            // 32-bit FAT entries and 64-bit file sizes, otherwise the original 16-bit format
+    uint32_t freeBlocks;  // Free block number
+    uint32_t blockSize;   // Block size
 
     uint32_t numEntries; // Entry number
-    uint32_t numFile;    // File number
-
-    dirEntryNode *head; // First node in the file entry linked-list
-    dirEntryNode *tail; // Last node in the file entry linked-list
 
-    uint16_t *blocks; // Blocks metadata
+    directory *root;      // Root directory, its chain starts at block 1
+    directory *cwd;       // Directory relative paths start from
+    directory *dirtyDirs; // Directories with slots to log at the next commit
+    uint64_t lookups;     // Index lookups done since mount
+    uint64_t probes;      // Nodes compared by those lookups
+
+    uint32_t *blocks; // Blocks metadata, a private copy reaching the image through the journal
+    uint8_t *image;   // Whole image mapping in mapped mode, otherwise NULL
+    size_t mapSize;   // Length of the image mapping
+
+    uint64_t *freeMap;     // Bit i is set when block i is free
+    uint64_t *freeSummary; // Bit w is set when freeMap[w] has a free block
+    uint32_t freeWords;    // Word number of freeMap
+    uint32_t freeHint;     // freeMap word where the next search starts
+    uint64_t chainChanges; // Blocks taken or released since mount
+
+    uint64_t reads;  // pread calls on the image since mount
+    uint64_t writes; // pwrite calls on the image since mount
+
+    uint64_t raHits;   // Sequential reads served by prefetched blocks
+    uint64_t raMisses; // Reads that broke a sequential stream
+    uint64_t raBlocks; // Blocks prefetched
+
+    blockCache *cache;          // Data block cache, NULL when disabled or in mapped mode
+    ioBackend *io;              // Backend of the block transfers outside the mapping
+    journal *journal;           // Metadata changes waiting for the next commit
+    blockSums *sums;            // Data block checksums, NULL when the image has none
+    struct refTable *refs;      // Links into each block, NULL when the image has no link table and cp makes full copies
+    struct scrubber *scrub;     // Background check cursor, NULL until the first scrub step
+    struct defragState *defrag; // Layout left by the last defrag step, NULL until the first one
+    uint32_t busy;              // PennOS processes in the middle of an operation on the FAT, any of them may be switched out halfway
 } pennfat;
 
-pennfat *initFat(char *fileName, uint8_t totalBlocks, uint8_t blockSizeIndex, bool creating);
-int loadDirEntries(pennfat *fat);
-pennfat *loadFat(char *fileName);
-int saveFat(pennfat *fat);
+void addDirEntryNode(pennfat *fat, directory *dir, dirEntryNode *fNode); // Append the node to the list and the index of dir
+void removeDirEntryNode(pennfat *fat, dirEntryNode *fNode);              // Unlink the node from the list and the index of its directory
+void renameDirEntryNode(pennfat *fat, dirEntryNode *fNode, directory *newDir, char *newFileName); // Rename the node, moving it to newDir
+dirEntryNode *lookupDirEntryNode(pennfat *fat, directory *dir, char *fileName);
+void markDirEntryDirty(pennfat *fat, dirEntryNode *fNode);               // Queue the entry for the next saveFat
+void forgetDirectory(pennfat *fat, directory *dir);                      // Drop the pending slots of a directory about to be freed
+
+directory *getDirectory(pennfat *fat, dirEntryNode *fNode);                    // Contents of a directory entry, loaded on first use
+int loadDirChain(pennfat *fat, directory *dir, uint32_t first);                // Remember the chain of a directory file starting at first
+int resolvePath(pennfat *fat, char *path, directory **parent, char *name);     // Directory holding the last component of path, and that component; 1 when path names a directory itself
+directory *resolveDirectory(pennfat *fat, char *path);                         // Directory named by path
+
+uint32_t blockLimit(pennfat *fat);                 // Blocks below this one may hold data, the ones past it never do
+int buildFreeMap(pennfat *fat);                    // Rebuild the free block bitmap from the FAT
+uint32_t allocBlock(pennfat *fat);                 // Take a free block and mark it as the end of a chain, 0 if none
+uint32_t allocRun(pennfat *fat, uint32_t want, uint32_t *got); // Take up to want adjacent free blocks chained in order, 0 if none
+uint32_t allocLastBlock(pennfat *fat);             // Take the free block nearest the end of the image, 0 if none
+bool takeBlock(pennfat *fat, uint32_t index);      // Take a given block marked as the end of a chain, false if it is not free
+void releaseBlock(pennfat *fat, uint32_t index);   // Clear the FAT entry and return the block to the bitmap, after the next commit if the image still links to it
+void releasePending(pennfat *fat);                 // Return the blocks released before the last commit to the bitmap
+int reclaimBlocks(pennfat *fat, uint32_t needed);  // Commit early when only the blocks waiting for a commit would make needed free
+int setCacheCapacity(pennfat *fat, uint32_t capacity); // Replace the block cache, 0 disables it
+int setIoBackend(pennfat *fat, char *name);            // Replace the I/O backend, NULL picks the best available
+
+uint32_t fatEntrySize(pennfat *fat);                                           // Bytes per FAT entry on disk
+void encodeFat(pennfat *fat, uint32_t first, uint32_t count, uint8_t *bytes);    // FAT entries as the image stores them
+void encodeDirEntry(pennfat *fat, dirEntry *entry, uint8_t *bytes);              // Directory entry as the image stores it
+void decodeDirEntry(pennfat *fat, uint8_t *bytes, dirEntry *entry);
+
+pennfat *initFat(char *fileName, uint32_t totalBlocks, uint8_t blockSizeIndex, bool wide, bool checksums, bool reflinks, bool creating, bool mapImage, bool readOnly);
+int loadDirEntries(pennfat *fat, directory *dir);                // Read the entries of a directory whose chain is known
+pennfat *loadFat(char *fileName, bool mapImage, bool readOnly);  // A read-only FAT leaves the image as it is, a pending transaction included
+int saveFat(pennfat *fat);                                       // Queue the metadata changes, committing them as a group
+int syncFat(pennfat *fat);                                       // Commit the queued changes now, when nothing else is coming
 void freeFat(pennfat **fat);
 
 /* PROGRESS NOTES:
 FUNCTION_NAME       IMPLEMENTATION      TESTING
 initDirEntryNode    Done
 freeDirEntryNode    Done
+initDirectory       Done
+freeDirectory       Done
+addDirBlock         Done
+addDirEntryNode     Done
+removeDirEntryNode  Done
+renameDirEntryNode  Done
+lookupDirEntryNode  Done
+markDirEntryDirty   Done
+forgetDirectory     Done
+getDirectory        Done
+loadDirChain        Done
+resolvePath         Done
+resolveDirectory    Done
+blockLimit          Done
+buildFreeMap        Done
+allocBlock          Done
+allocRun            Done
+allocLastBlock      Done
+takeBlock           Done
+releaseBlock        Done
+releasePending      Done
+reclaimBlocks       Done
+setCacheCapacity    Done
+setIoBackend        Done
+fatEntrySize        Done
+encodeFat           Done
+encodeDirEntry      Done
+decodeDirEntry      Done
 initFat             Done
 loadDirEntry        Done
 loadFat             Done
 saveFat             Done
+syncFat             Done
 freeFat             Done
 */
\ No newline at end of file
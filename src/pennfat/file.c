@@ -1,3 +1,6 @@
+#define _GNU_SOURCE // copy_file_range
+
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <stdbool.h>
@@ -5,131 +8,381 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "../macros.h"
 #include "../pennos/mounted_fat.h"
+#include "../pennos/process_control.h"
 #include "file.h"
 #include "pennfat_handler.h"
+#include "reflink.h"
 #include "utils.h"
 
-int bytesToBlocks(int numBytes, pennfat *fat) { return ceil((double)numBytes / fat->blockSize); }
+int bytesToBlocks(uint64_t numBytes, pennfat *fat) { return (numBytes + fat->blockSize - 1) / fat->blockSize; }
 
-void freeFile(file *file) {
-    free(file->contents);
-    free(file);
+// Byte offset of a data block in the image
+static off_t blockOffset(uint32_t index, pennfat *fat) { return (off_t)fat->totalBlocks * fat->blockSize + (off_t)(index - 1) * fat->blockSize; }
+
+// Run a batch of transfers through the I/O backend, or against the mapping for mapped reads
+static int transferImage(ioRequest *requests, uint32_t count, bool writing, pennfat *fat) {
+    if (count == 0) {
+        return 0;
+    }
+
+    if (fat->image != NULL && !writing) {
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(requests[i].buf, &fat->image[requests[i].offset], requests[i].count);
+        }
+        return 0;
+    }
+
+    int calls = fat->io->submit(fat->io, fat->fd, requests, count, writing);
+    if (calls == -1) {
+        return -1;
+    }
+    if (writing) {
+        fat->writes += calls;
+    } else {
+        fat->reads += calls;
+    }
+    return 0;
 }
 
-void getDirEntryNode(dirEntryNode **prev, dirEntryNode **target, char *fileName, pennfat *fat) {
-    dirEntryNode *prevNode = NULL;
-    dirEntryNode *targetNode = fat->head;
+// Read count bytes of the image at offset, bytes past the end of the image read as zero
+static int readImage(uint8_t *buf, size_t count, off_t offset, pennfat *fat) {
+    ioRequest request = {.buf = buf, .count = count, .offset = offset};
+    return transferImage(&request, 1, false, fat);
+}
 
-    if (fileName == NULL) {
-        return;
+// Read count bytes at offset in a data block, through the block cache; with checksums the whole block is read and checked
+static int readBlock(uint8_t *buf, uint32_t count, uint32_t offset, uint32_t index, pennfat *fat) {
+    if (fat->cache == NULL) {
+        if (fat->sums == NULL) {
+            return readImage(buf, count, blockOffset(index, fat) + offset, fat);
+        }
+
+        // A whole block is read and checked in place
+        uint8_t *data = count == fat->blockSize ? buf : fat->sums->scratch;
+        if (readImage(data, fat->blockSize, blockOffset(index, fat), fat) == -1 || verifyBlock(fat, index, data) == -1) {
+            return -1;
+        }
+        if (data != buf) {
+            memcpy(buf, &data[offset], count);
+        }
+        return 0;
     }
 
-    while (targetNode != NULL) {
-        if (strcmp(targetNode->entry->name, fileName) == 0) {
-            break;
-        } else {
-            prevNode = targetNode;
-            targetNode = targetNode->next;
+    // Cached blocks were checked when they came in, and writes keep them current
+    uint8_t *data = cacheLookup(fat->cache, index);
+    if (data == NULL) {
+        data = cacheInsert(fat->cache, index);
+        if (readImage(data, fat->blockSize, blockOffset(index, fat), fat) == -1 || verifyBlock(fat, index, data) == -1) {
+            cacheInvalidate(fat->cache, index);
+            return -1;
         }
     }
 
-    if (prev != NULL) {
-        *prev = prevNode;
+    memcpy(buf, &data[offset], count);
+    return 0;
+}
+
+// Write count bytes of the image at offset
+static int writeImage(uint8_t *buf, size_t count, off_t offset, pennfat *fat) {
+    ioRequest request = {.buf = buf, .count = count, .offset = offset};
+    return transferImage(&request, 1, true, fat);
+}
+
+// Record the checksum of a block about to get len bytes at position, before the write reaches the image or the cache;
+// the rest of a fresh block is written as zeros by the caller
+static int sumPiece(uint32_t index, uint32_t position, uint8_t *bytes, uint32_t len, bool fresh, pennfat *fat) {
+    if (fat->sums == NULL) {
+        return 0;
+    }
+    if (len == fat->blockSize) {
+        setBlockSum(fat, index, bytes);
+        return 0;
     }
 
-    if (target != NULL) {
-        *target = targetNode;
+    // The block as it is now, then the new bytes over it
+    uint8_t *block = fat->sums->scratch;
+    uint8_t *cached = fat->cache != NULL ? cacheLookup(fat->cache, index) : NULL;
+    if (fresh) {
+        memset(block, 0, fat->blockSize);
+    } else if (cached != NULL) {
+        memcpy(block, cached, fat->blockSize);
+    } else if (readImage(block, fat->blockSize, blockOffset(index, fat), fat) == -1 || verifyBlock(fat, index, block) == -1) {
+        return -1;
     }
+    memcpy(&block[position], bytes, len);
+    setBlockSum(fat, index, block);
+    return 0;
 }
 
-file *getAllFile(pennfat *fat) {
-    // Open the file
-    int fd;
-    if ((fd = open(fat->fileName, O_RDWR, 0644)) == -1) {
-        perror("ERROR: Fail to open the file");
-        return NULL;
+int readImageBlock(uint32_t index, uint8_t *buf, pennfat *fat) { return readImage(buf, fat->blockSize, blockOffset(index, fat), fat); }
+
+int copyBlock(uint32_t from, uint32_t to, uint8_t *buf, pennfat *fat) {
+    if (readImage(buf, fat->blockSize, blockOffset(from, fat), fat) == -1) {
+        perror("ERROR: Fail to copy the block.");
+        return -1;
     }
+    if (verifyBlock(fat, from, buf) == -1) {
+        return -1;
+    }
+    setBlockSum(fat, to, buf);
+    if (writeImage(buf, fat->blockSize, blockOffset(to, fat), fat) == -1) {
+        perror("ERROR: Fail to copy the block.");
+        return -1;
+    }
+    if (fat->cache != NULL) {
+        cacheInvalidate(fat->cache, from);
+        cacheInvalidate(fat->cache, to);
+    }
+    return 0;
+}
 
-    // Seek to the first block
-    uint32_t fatSize = fat->totalBlocks * fat->blockSize;
-    uint16_t currIndex = 1;
+// Blocks moveCommitted would move for the logical blocks first to last, with the blocks shared with a copy unshared
+static uint32_t committedBlocks(dirEntryNode *entryNode, uint32_t first, uint32_t last, pennfat *fat) {
+    if (fat->sums == NULL || fat->journal == NULL || getBlockMap(entryNode, fat) == NULL || entryNode->mapBlocks == 0) {
+        return 0;
+    }
+    if (last >= entryNode->mapBlocks) {
+        last = entryNode->mapBlocks - 1;
+    }
 
-    if (lseek(fd, fatSize, SEEK_SET) == -1) {
-        perror("ERROR: Fail to find the first block.\n");
-        return NULL;
+    // The blocks from the first shared one on are copied before the write, the copies being new
+    uint32_t count = 0;
+    for (uint32_t logical = first; logical <= last && blockLinks(fat, entryNode->blockMap[logical]) < 2; logical++) {
+        count += fat->journal->committed[entryNode->blockMap[logical]] != 0x0000 ? 1 : 0;
     }
+    return count;
+}
 
-    // Track counted files
-    unsigned int filesCounted = 0;
+// With checksums, a block the last commit left in a chain keeps its contents until the next commit, so a crash finds
+// it matching its committed checksum: the blocks len bytes at offset fall in move to new blocks before the write, a
+// block the write covers only in part with a copy of its contents
+static int moveCommitted(dirEntryNode *entryNode, uint64_t offset, uint32_t len, pennfat *fat) {
+    if (len == 0) {
+        return 0;
+    }
+    uint32_t first = offset / fat->blockSize;
+    uint32_t last = (offset + len - 1) / fat->blockSize;
+    uint32_t moves = committedBlocks(entryNode, first, last, fat);
+    if (moves == 0) {
+        return 0;
+    }
 
-    // Buffer for read
-    uint8_t buffer[sizeof(dirEntry)];
-    for (int i = 0; i < sizeof(dirEntry); i++) {
-        buffer[i] = 0x00;
+    // A commit making room commits the blocks written since the last one too
+    if (reclaimBlocks(fat, moves) == -1) {
+        return -1;
+    }
+    moves = committedBlocks(entryNode, first, last, fat);
+    if (moves > fat->freeBlocks) {
+        printf("ERROR: Fail to find enough free blocks, %d blocks required, %d blocks is free.\n", moves, fat->freeBlocks);
+        return -1;
+    }
+    uint8_t *buf = malloc(fat->blockSize);
+    if (buf == NULL) {
+        perror("ERROR: Fail to malloc the buffer.");
+        return -1;
     }
 
-    bool endedAtEdgeOfBlock = false;
-    while (1) {
-        if (filesCounted != 0 && (filesCounted * sizeof(dirEntry)) % fat->blockSize == 0) {
-            if (fat->blocks[currIndex] == 0xFFFF) {
-                // Last block
-                endedAtEdgeOfBlock = true;
-                break;
-            }
-            // Get next block
-            currIndex = fat->blocks[currIndex];
-            if (lseek(fd, fatSize + ((currIndex - 1) * fat->blockSize), SEEK_SET) == -1) {
-                perror("ERROR: Fail to lseek the file.");
-                return NULL;
+    // Each new block takes the place of the old one in the chain, which is freed at the next commit
+    uint32_t *map = entryNode->blockMap;
+    uint32_t run = 0;
+    uint32_t got = 0;
+    int result = 0;
+    for (uint32_t logical = first; logical <= last && logical < entryNode->mapBlocks && moves > 0; logical++) {
+        uint32_t from = map[logical];
+        if (blockLinks(fat, from) > 1) {
+            break;
+        }
+        if (fat->journal->committed[from] == 0x0000) {
+            continue;
+        }
+        if (got == 0 && (run = allocRun(fat, moves, &got), got == 0)) {
+            printf("ERROR: Run out of free blocks.\n");
+            result = -1;
+            break;
+        }
+        uint32_t to = run++;
+        got--;
+        moves--;
+
+        bool whole = (uint64_t) logical * fat->blockSize >= offset && (uint64_t) (logical + 1) * fat->blockSize <= offset + len;
+        if (!whole && copyBlock(from, to, buf, fat) == -1) {
+            releaseBlock(fat, to);
+            result = -1;
+            break;
+        }
+        fat->blocks[to] = fat->blocks[from];
+        if (logical == 0) {
+            entryNode->entry->firstBlock = to;
+            markDirEntryDirty(fat, entryNode);
+        } else {
+            fat->blocks[map[logical - 1]] = to;
+        }
+        releaseBlock(fat, from);
+        map[logical] = to;
+    }
+    for (uint32_t i = run; i < run + got; i++) {
+        releaseBlock(fat, i);
+    }
+    free(buf);
+
+    dropExtents(entryNode);
+    return result;
+}
+
+// Add a transfer to the batch, extending the last one when it continues it both in memory and in the image
+static void queueRequest(ioRequest *requests, uint32_t *count, uint8_t *buf, uint32_t len, off_t offset) {
+    if (*count > 0) {
+        ioRequest *last = &requests[*count - 1];
+        if (last->buf + last->count == buf && last->offset + last->count == offset) {
+            last->count += len;
+            return;
+        }
+    }
+
+    requests[*count].buf = buf;
+    requests[*count].count = len;
+    requests[*count].offset = offset;
+    (*count)++;
+}
+
+// Move len bytes at offset in a file whose blocks are in map, as one request per run of adjacent blocks;
+// a read inside one block goes through the block cache, which writes keep current
+static int transferBlocks(uint32_t *map, uint8_t *buf, uint64_t offset, uint32_t len, bool writing, pennfat *fat) {
+    if (len == 0) {
+        return 0;
+    }
+
+    uint32_t firstBlock = offset / fat->blockSize;
+    uint32_t numBlocks = (offset + len - 1) / fat->blockSize - firstBlock + 1;
+    if (numBlocks == 1 && !writing) {
+        return readBlock(buf, len, offset % fat->blockSize, map[firstBlock], fat);
+    }
+
+    ioRequest *requests = malloc(numBlocks * sizeof(ioRequest));
+    if (requests == NULL) {
+        perror("ERROR: Fail to malloc the requests.");
+        return -1;
+    }
+
+    uint32_t count = 0;
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t index = map[(offset + done) / fat->blockSize];
+        uint32_t blockPosition = (offset + done) % fat->blockSize;
+        uint32_t piece = fat->blockSize - blockPosition;
+        if (piece > len - done) {
+            piece = len - done;
+        }
+
+        // A part of a block can only be checked with the rest of it
+        if (!writing && fat->sums != NULL && piece != fat->blockSize) {
+            if (readBlock(&buf[done], piece, blockPosition, index, fat) == -1) {
+                free(requests);
+                return -1;
             }
+            done += piece;
+            continue;
+        }
+        if (writing && sumPiece(index, blockPosition, &buf[done], piece, false, fat) == -1) {
+            free(requests);
+            return -1;
         }
 
-        if (read(fd, buffer, sizeof(dirEntry)) == -1) {
-            perror("ERROR: Fail to read the file.");
-            return NULL;
+        queueRequest(requests, &count, &buf[done], piece, blockOffset(index, fat) + blockPosition);
+        if (writing && fat->cache != NULL) {
+            cacheUpdate(fat->cache, index, blockPosition, &buf[done], piece);
         }
+        done += piece;
+    }
 
-        if (buffer[0] == 0x00) {
-            break;
-        } else {
-            filesCounted++;
+    int result = transferImage(requests, count, writing, fat);
+    free(requests);
+
+    // Then the whole blocks read straight into buf
+    if (result == 0 && !writing && fat->sums != NULL) {
+        for (uint32_t position = (fat->blockSize - offset % fat->blockSize) % fat->blockSize; position + fat->blockSize <= len; position += fat->blockSize) {
+            if (verifyBlock(fat, map[(offset + position) / fat->blockSize], &buf[position]) == -1) {
+                return -1;
+            }
         }
     }
+    return result;
+}
+
+void freeFile(file *file) {
+    free(file->contents);
+    free(file);
+}
+
+void getDirEntryNode(dirEntryNode **prev, dirEntryNode **target, char *fileName, pennfat *fat) {
+    dirEntryNode *targetNode = NULL;
+
+    // Walk the path, then look the last component up in its own directory
+    directory *parent;
+    char name[MAX_FILENAME];
+    if (fileName != NULL && resolvePath(fat, fileName, &parent, name) == 0) {
+        targetNode = lookupDirEntryNode(fat, parent, name);
+    }
+
+    if (prev != NULL) {
+        *prev = targetNode == NULL ? NULL : targetNode->prev;
+    }
 
-    // Close fd
-    f_close(fd);
+    if (target != NULL) {
+        *target = targetNode;
+    }
+}
+
+file *getAllFile(directory *dir, pennfat *fat) {
+    // Read the whole directory chain, one request per run, then count the entries up to the end of directory mark
+    uint32_t capacity = dir->numDirBlocks * fat->blockSize;
+    uint8_t *contents = malloc(capacity + 1);
+    if (contents == NULL) {
+        perror("ERROR: Fail to malloc.");
+        return NULL;
+    }
+
+    if (transferBlocks(dir->dirBlocks, contents, 0, capacity, false, fat) == -1) {
+        perror("ERROR: Fail to read the file.");
+        free(contents);
+        return NULL;
+    }
+
+    uint32_t length = 0;
+    while (length < capacity && contents[length] != 0x00) {
+        length += sizeof(dirEntry);
+    }
 
 #ifdef DEBUGGING
     writeHelper("Finishing counting files...");
-    printf("filesCounted = %d\n", filesCounted);
+    printf("filesCounted = %d\n", (int) (length / sizeof(dirEntry)));
 #endif
 
-    if (filesCounted == 0) {
+    if (length == 0) {
+        free(contents);
         return NULL;
-    } else {
-        uint8_t *contents = getContents(1, filesCounted * sizeof(dirEntry) + endedAtEdgeOfBlock, fat);
+    }
 
-        // Check if getContents() failed
-        if (contents == NULL) {
-            perror("ERROR: Fail to get the content.");
-            return NULL;
-        }
+    // Add null terminator
+    contents[length] = '\0';
 
-        file *result = malloc(sizeof(file));
-        result->contents = contents;
-        result->len = filesCounted * sizeof(dirEntry);
-        result->type = DIRECTORY_FILETYPE;
-        result->perm = NONE_PERMS;
+    file *result = malloc(sizeof(file));
+    result->contents = contents;
+    result->len = length;
+    result->type = DIRECTORY_FILETYPE;
+    result->perm = NONE_PERMS;
 
-        return result;
-    }
+    return result;
 }
 
-uint8_t *getContents(uint16_t startIndex, uint32_t length, pennfat *fat) {
+uint8_t *getContents(uint32_t startIndex, uint32_t length, pennfat *fat) {
     uint8_t *result = malloc(length * sizeof(uint8_t) + 1);
     if (result == NULL) {
         perror("ERROR: Fail to malloc.");
@@ -139,56 +392,214 @@ uint8_t *getContents(uint16_t startIndex, uint32_t length, pennfat *fat) {
     // Add null terminator
     result[length] = '\0';
 
-    // Open the file
-    int fd;
-    if ((fd = open(fat->fileName, O_RDONLY, 0644)) == -1) {
-        perror("ERROR: Fail to open the file.");
+    // Find every block of the chain, then read them as one batch
+    uint32_t numBlocks = bytesToBlocks(length, fat);
+    uint32_t *map = malloc((numBlocks + 1) * sizeof(uint32_t));
+    if (map == NULL) {
+        perror("ERROR: Fail to malloc.");
         free(result);
         return NULL;
     }
+    uint32_t currIndex = startIndex;
+    for (uint32_t i = 0; i < numBlocks; i++) {
+        map[i] = currIndex;
+        currIndex = fat->blocks[currIndex];
+    }
 
-    // Read the content
-    uint32_t fatSize = fat->totalBlocks * fat->blockSize;
-    uint16_t currIndex = startIndex;
-
-    if (lseek(fd, fatSize + ((currIndex - 1) * fat->blockSize), SEEK_SET) == -1) {
-        perror("ERROR: Fail to lseek the file.");
+    if (transferBlocks(map, result, 0, length, false, fat) == -1) {
+        perror("ERROR: fail to read the file.");
+        free(map);
         free(result);
         return NULL;
     }
 
-    for (int i = 0; i < length; i = i + fat->blockSize) {
-        if (i != 0 && i % fat->blockSize == 0) {
-            // Get the next block
-            currIndex = fat->blocks[currIndex];
-            if (lseek(fd, fatSize + ((currIndex - 1) * fat->blockSize), SEEK_SET) == -1) {
-                perror("ERROR: fail to lseek the file.");
-                free(result);
-                return NULL;
-            }
+    free(map);
+    return result;
+}
+
+extent *getExtents(dirEntryNode *entryNode, pennfat *fat) {
+    if (entryNode->extents != NULL || entryNode->entry->size == 0) {
+        return entryNode->extents;
+    }
+
+    uint32_t numBlocks = bytesToBlocks(entryNode->entry->size, fat);
+    extent *extents = malloc(numBlocks * sizeof(extent));
+    if (extents == NULL) {
+        perror("ERROR: Fail to malloc the extents.");
+        return NULL;
+    }
+
+    // Walk the chain, starting a new extent wherever the next block is not adjacent
+    uint32_t count = 0;
+    uint32_t currIndex = entryNode->entry->firstBlock;
+    for (uint32_t i = 0; i < numBlocks; i++) {
+        if (count > 0 && extents[count - 1].start + extents[count - 1].length == currIndex) {
+            extents[count - 1].length++;
+        } else {
+            extents[count].start = currIndex;
+            extents[count].length = 1;
+            count++;
         }
+        currIndex = fat->blocks[currIndex];
+    }
 
-        int bytesToRead = fat->blockSize;
-        if (bytesToRead > length - i) {
-            bytesToRead = length - i;
+    entryNode->extents = realloc(extents, count * sizeof(extent));
+    if (entryNode->extents == NULL) {
+        entryNode->extents = extents;
+    }
+    entryNode->numExtents = count;
+    return entryNode->extents;
+}
+
+void dropExtents(dirEntryNode *entryNode) {
+    free(entryNode->extents);
+    entryNode->extents = NULL;
+    entryNode->numExtents = 0;
+}
+
+uint32_t *getBlockMap(dirEntryNode *entryNode, pennfat *fat) {
+    if (entryNode->blockMap != NULL || entryNode->entry->size == 0) {
+        return entryNode->blockMap;
+    }
+
+    uint32_t numBlocks = bytesToBlocks(entryNode->entry->size, fat);
+    entryNode->blockMap = malloc(numBlocks * sizeof(uint32_t));
+    if (entryNode->blockMap == NULL) {
+        perror("ERROR: Fail to malloc the block map.");
+        return NULL;
+    }
+
+    uint32_t currIndex = entryNode->entry->firstBlock;
+    for (uint32_t i = 0; i < numBlocks; i++) {
+        entryNode->blockMap[i] = currIndex;
+        currIndex = fat->blocks[currIndex];
+    }
+    entryNode->mapBlocks = numBlocks;
+    entryNode->mapCap = numBlocks;
+
+    return entryNode->blockMap;
+}
+
+void dropBlockMap(dirEntryNode *entryNode) {
+    free(entryNode->blockMap);
+    entryNode->blockMap = NULL;
+    entryNode->mapBlocks = 0;
+    entryNode->mapCap = 0;
+}
+
+// Record the block of a logical block reached by a write, keeping a built map valid
+static void mapBlock(dirEntryNode *entryNode, uint32_t logical, uint32_t index) {
+    if (entryNode == NULL || entryNode->blockMap == NULL) {
+        return;
+    }
+
+    if (logical >= entryNode->mapCap) {
+        uint32_t newCap = entryNode->mapCap * 2 > logical + 1 ? entryNode->mapCap * 2 : logical + 1;
+        uint32_t *newMap = realloc(entryNode->blockMap, newCap * sizeof(uint32_t));
+        if (newMap == NULL) {
+            // Rebuilt from the chain on next use
+            dropBlockMap(entryNode);
+            return;
+        }
+        entryNode->blockMap = newMap;
+        entryNode->mapCap = newCap;
+    }
+
+    entryNode->blockMap[logical] = index;
+    if (logical >= entryNode->mapBlocks) {
+        entryNode->mapBlocks = logical + 1;
+    }
+}
+
+uint8_t *getExtentContents(dirEntryNode *entryNode, pennfat *fat) {
+    // Whole files are loaded into one buffer, bigger ones go through f_read or exportFile
+    uint64_t length = entryNode->entry->size;
+    if (length >= UINT32_MAX) {
+        printf("ERROR: The file is too large to load at once.\n");
+        return NULL;
+    }
+    // With checksums the last block is read whole to check it
+    uint64_t capacity = fat->sums != NULL ? (uint64_t) bytesToBlocks(length, fat) * fat->blockSize : length;
+    uint8_t *result = malloc(capacity * sizeof(uint8_t) + 1);
+    if (result == NULL) {
+        perror("ERROR: Fail to malloc.");
+        return NULL;
+    }
+
+    extent *extents = getExtents(entryNode, fat);
+    if (length != 0 && extents == NULL) {
+        free(result);
+        return NULL;
+    }
+
+    ioRequest *requests = malloc((entryNode->numExtents + 1) * sizeof(ioRequest));
+    if (requests == NULL) {
+        perror("ERROR: Fail to malloc the requests.");
+        free(result);
+        return NULL;
+    }
+
+    // One request per extent, all in flight together; single cached blocks come from the block cache
+    uint32_t count = 0;
+    uint32_t i = 0;
+    for (uint32_t e = 0; e < entryNode->numExtents && i < capacity; e++) {
+        uint32_t bytesToRead = extents[e].length * fat->blockSize;
+        if (bytesToRead > capacity - i) {
+            bytesToRead = capacity - i;
         }
 
-        if (read(fd, &result[i], bytesToRead) == -1) {
-            perror("ERROR: fail to lseek the file.");
-            free(result);
-            return NULL;
+        uint8_t *cached = extents[e].length == 1 && fat->cache != NULL ? cacheLookup(fat->cache, extents[e].start) : NULL;
+        if (cached != NULL) {
+            memcpy(&result[i], cached, bytesToRead);
+        } else {
+            requests[count].buf = &result[i];
+            requests[count].count = bytesToRead;
+            requests[count].offset = blockOffset(extents[e].start, fat);
+            count++;
         }
+        i += bytesToRead;
     }
 
-    // Close the file
-    if (close(fd) == -1) {
+    int readResult = transferImage(requests, count, false, fat);
+    free(requests);
+    if (readResult == -1) {
+        perror("ERROR: fail to read the file.");
         free(result);
         return NULL;
     }
 
+    // Every block read is whole, check them in file order
+    if (fat->sums != NULL) {
+        i = 0;
+        for (uint32_t e = 0; e < entryNode->numExtents && i < capacity; e++) {
+            for (uint32_t b = 0; b < extents[e].length && i < capacity; b++, i += fat->blockSize) {
+                if (verifyBlock(fat, extents[e].start + b, &result[i]) == -1) {
+                    free(result);
+                    return NULL;
+                }
+            }
+        }
+    }
+
+    // Add null terminator
+    result[length] = '\0';
     return result;
 }
 
+// Check the blocks under len bytes at data, the first of them being index; a partial last block is checked whole
+static int verifyBlocks(uint32_t index, uint8_t *data, uint64_t len, pennfat *fat) {
+    if (fat->sums == NULL) {
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < len; i += fat->blockSize, index++) {
+        if (verifyBlock(fat, index, &data[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 file *readFile(char *fileName, pennfat *fat) {
     // Find the directory entry contain the file
     dirEntryNode *entryNode;
@@ -199,6 +610,11 @@ file *readFile(char *fileName, pennfat *fat) {
         return NULL;
     }
 
+    if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("Error: %s is a directory.\n", fileName);
+        return NULL;
+    }
+
     // Check read permission
     if (entryNode->entry->perm != READWRITE_PERMS && entryNode->entry->perm != READ_PERMS) {
         printf("Error: Lack of read permission for %s.\n", fileName);
@@ -212,7 +628,7 @@ file *readFile(char *fileName, pennfat *fat) {
         return NULL;
     }
 
-    result->contents = getContents(entryNode->entry->firstBlock, entryNode->entry->size, fat);
+    result->contents = getExtentContents(entryNode, fat);
 
     if (result->contents == NULL) {
         free(result);
@@ -225,113 +641,486 @@ file *readFile(char *fileName, pennfat *fat) {
     return result;
 }
 
-void deleteFileHelper(dirEntryNode *prev, dirEntryNode *entryNode, pennfat *fat, bool dirFile) {
-    // Clear blocks
-    uint16_t currBlock;
-    if (dirFile) {
-        currBlock = 1;
-    } else {
-        currBlock = entryNode->entry->firstBlock;
-    }
-
-    if (dirFile || entryNode->entry->size != 0) {
-        // Delete all blocks for this file
-        do {
-            uint16_t nextBlock = fat->blocks[currBlock];
-            fat->blocks[currBlock] = 0;
-            currBlock = nextBlock;
-        } while (currBlock != 0xFFFF && currBlock != 0x0000);
+int mapFile(char *fileName, struct iovec **iov, pennfat *fat) {
+    if (fat->image == NULL) {
+        printf("ERROR: The image is not mapped.\n");
+        return -1;
     }
-}
 
-int deleteFile(char *fileName, pennfat *fat, bool flag) {
-    // Find the corresponidng directory entry
-    dirEntryNode *prev;
+    // Find the directory entry contain the file
     dirEntryNode *entryNode;
-    getDirEntryNode(&prev, &entryNode, fileName, fat);
+    getDirEntryNode(NULL, &entryNode, fileName, fat);
 
     if (entryNode == NULL) {
-        printf("ERROR: Fail to find %s.\n", fileName);
+        printf("Error: Cannot found %s.\n", fileName);
         return -1;
     }
 
-    // Check write permissions
-    if (!flag && entryNode != NULL && entryNode->entry->perm != WRITE_PERMS && entryNode->entry->perm != READWRITE_PERMS) {
-        printf("ERROR: Fail to delete the file %s due to lack of write permission.\n", fileName);
+    if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("Error: %s is a directory.\n", fileName);
         return -1;
     }
 
-    // Delete block
-    deleteFileHelper(prev, entryNode, fat, false);
+    // Check read permission
+    if (entryNode->entry->perm != READWRITE_PERMS && entryNode->entry->perm != READ_PERMS) {
+        printf("Error: Lack of read permission for %s.\n", fileName);
+        return -1;
+    }
 
-    // Delete the entry node
-    if (entryNode == fat->head) {
-        fat->head = entryNode->next;
-    } else {
-        prev->next = entryNode->next;
+    uint64_t length = entryNode->entry->size;
+    extent *extents = getExtents(entryNode, fat);
+    if (length != 0 && extents == NULL) {
+        return -1;
     }
 
-    // Set the tail
-    if (entryNode == fat->tail) {
-        fat->tail = prev;
+    *iov = malloc((entryNode->numExtents + 1) * sizeof(struct iovec));
+    if (*iov == NULL) {
+        perror("ERROR: Fail to malloc.");
+        return -1;
     }
 
-    // Decrement numFile and increase freeblocks
-    fat->numFile--;
-    fat->freeBlocks += bytesToBlocks(entryNode->entry->size, fat);
+    // One iovec per extent, checked as it is added since the caller copies it unseen; exportFile checks as it copies
+    uint32_t count = 0;
+    for (uint64_t i = 0; count < entryNode->numExtents && i < length; count++) {
+        uint64_t bytesToRead = (uint64_t) extents[count].length * fat->blockSize;
+        if (bytesToRead > length - i) {
+            bytesToRead = length - i;
+        }
+
+        (*iov)[count].iov_base = &fat->image[blockOffset(extents[count].start, fat)];
+        (*iov)[count].iov_len = bytesToRead;
+        if (verifyBlocks(extents[count].start, (*iov)[count].iov_base, bytesToRead, fat) == -1) {
+            free(*iov);
+            return -1;
+        }
+        i += bytesToRead;
+    }
 
-    // Free the node
-    freeDirEntryNode(entryNode);
+    // The runs are read front to back once
+    long pageSize = sysconf(_SC_PAGESIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        uintptr_t start = (uintptr_t) (*iov)[i].iov_base & ~(pageSize - 1);
+        size_t span = (uintptr_t) (*iov)[i].iov_base + (*iov)[i].iov_len - start;
+        madvise((void *) start, span, MADV_SEQUENTIAL);
+        madvise((void *) start, span, MADV_WILLNEED);
+    }
 
-    return 0;
+    return (int) count;
 }
 
-int renameFile(char *oldFileName, char *newFileName, pennfat *fat) {
-    // get directory entry for filename
+int exportFile(char *fileName, int fd, pennfat *fat) {
+    // Find the directory entry contain the file
     dirEntryNode *entryNode;
-    getDirEntryNode(NULL, &entryNode, oldFileName, fat);
+    getDirEntryNode(NULL, &entryNode, fileName, fat);
 
     if (entryNode == NULL) {
-        printf("ERROR: file %s does not exist.\n", oldFileName);
+        printf("Error: Cannot found %s.\n", fileName);
         return -1;
     }
 
-    // Check permission
+    if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("Error: %s is a directory.\n", fileName);
+        return -1;
+    }
+
+    // Check read permission
+    if (entryNode->entry->perm != READWRITE_PERMS && entryNode->entry->perm != READ_PERMS) {
+        printf("Error: Lack of read permission for %s.\n", fileName);
+        return -1;
+    }
+
+    uint64_t length = entryNode->entry->size;
+    extent *extents = getExtents(entryNode, fat);
+    if (length != 0 && extents == NULL) {
+        return -1;
+    }
+
+    // Copy inside the kernel until the descriptor refuses it, then gather the runs into vectored writes;
+    // the kernel copies the runs unseen, so an image with checksums never goes that way
+    bool copyRange = fat->sums == NULL;
+    struct iovec iov[EXPORT_IOVECS];
+    int iovCount = 0;
+    uint8_t *buffer = NULL;
+    uint32_t filled = 0;
+    uint64_t done = 0;
+    for (uint32_t e = 0; e < entryNode->numExtents && done < length; e++) {
+        uint64_t runBytes = (uint64_t) extents[e].length * fat->blockSize;
+        if (runBytes > length - done) {
+            runBytes = length - done;
+        }
+
+        off_t position = blockOffset(extents[e].start, fat);
+        uint64_t copied = 0;
+        while (copied < runBytes) {
+            if (copyRange) {
+                ssize_t n = copy_file_range(fat->fd, &position, fd, NULL, runBytes - copied, 0);
+                fat->reads++;
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    // Not supported between these descriptors, or a hole past the end of the image
+                    copyRange = false;
+                    continue;
+                }
+                copied += n;
+                continue;
+            }
+
+            // A mapped run goes out whole, otherwise it is staged in the bounded buffer; with checksums both go in
+            // chunks of whole blocks, still in the CPU cache when they are written after the check
+            size_t chunk = runBytes - copied;
+            bool bounded = fat->image == NULL || fat->sums != NULL;
+            if (bounded && chunk > EXPORT_CHUNK_SIZE - filled) {
+                chunk = EXPORT_CHUNK_SIZE - filled;
+            }
+
+            uint8_t *data;
+            if (fat->image != NULL) {
+                data = &fat->image[position];
+            } else {
+                if (buffer == NULL && (buffer = malloc(EXPORT_CHUNK_SIZE)) == NULL) {
+                    perror("ERROR: Fail to malloc the buffer.");
+                    return -1;
+                }
+                size_t readBytes = fat->sums != NULL ? (chunk + fat->blockSize - 1) / fat->blockSize * fat->blockSize : chunk;
+                if (readImage(&buffer[filled], readBytes, position, fat) == -1) {
+                    perror("ERROR: fail to read the file.");
+                    free(buffer);
+                    return -1;
+                }
+                data = &buffer[filled];
+            }
+            if (verifyBlocks(extents[e].start + copied / fat->blockSize, data, chunk, fat) == -1) {
+                free(buffer);
+                return -1;
+            }
+            if (bounded) {
+                filled += chunk;
+            }
+            iov[iovCount].iov_base = data;
+            iov[iovCount].iov_len = chunk;
+            iovCount++;
+            position += chunk;
+            copied += chunk;
+
+            if (iovCount == EXPORT_IOVECS || filled == EXPORT_CHUNK_SIZE) {
+                if (writeIovecs(fd, iov, iovCount) == -1) {
+                    perror("ERROR: fail to write the file.");
+                    free(buffer);
+                    return -1;
+                }
+                iovCount = 0;
+                filled = 0;
+            }
+        }
+        done += runBytes;
+    }
+
+    if (iovCount > 0 && writeIovecs(fd, iov, iovCount) == -1) {
+        perror("ERROR: fail to write the file.");
+        free(buffer);
+        return -1;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+int readFileAt(dirEntryNode *entryNode, uint8_t *buf, uint64_t offset, uint32_t len, pennfat *fat) {
+    if (len == 0) {
+        return 0;
+    }
+    if (getBlockMap(entryNode, fat) == NULL) {
+        return -1;
+    }
+
+    // The whole range as one batch
+    if (transferBlocks(entryNode->blockMap, buf, offset, len, false, fat) == -1) {
+        perror("ERROR: Fail to read the file.");
+        return -1;
+    }
+
+    return 0;
+}
+
+void deleteFileHelper(dirEntryNode *entryNode, pennfat *fat, bool dirFile) {
+    // Clear blocks
+    uint32_t currBlock;
+    if (dirFile) {
+        currBlock = 1;
+    } else {
+        currBlock = entryNode->entry->firstBlock;
+    }
+
+    if (dirFile || entryNode->entry->size != 0) {
+        // Delete all blocks for this file, up to the ones a copy still shares
+        releaseChain(fat, currBlock);
+    }
+}
+
+int deleteFile(char *fileName, pennfat *fat, bool flag) {
+    // Find the corresponidng directory entry
+    dirEntryNode *entryNode;
+    getDirEntryNode(NULL, &entryNode, fileName, fat);
+
+    if (entryNode == NULL) {
+        printf("ERROR: Fail to find %s.\n", fileName);
+        return -1;
+    }
+
+    return deleteEntry(entryNode, fileName, fat, flag);
+}
+
+int deleteEntry(dirEntryNode *entryNode, char *fileName, pennfat *fat, bool flag) {
+    // Check write permissions
+    if (!flag && entryNode != NULL && entryNode->entry->perm != WRITE_PERMS && entryNode->entry->perm != READWRITE_PERMS) {
+        printf("ERROR: Fail to delete the file %s due to lack of write permission.\n", fileName);
+        return -1;
+    }
+
+    // Open descriptors still point at the entry
+    if (entryNode->opens != 0) {
+        printf("ERROR: Fail to delete the file %s while it is open.\n", fileName);
+        return -1;
+    }
+
+    // Only an empty directory goes, and never one the working directory is in
+    directory *dir = getDirectory(fat, entryNode);
+    if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+        if (dir == NULL) {
+            return -1;
+        }
+        if (dir->numFile != 0) {
+            printf("ERROR: Fail to delete the directory %s as it is not empty.\n", fileName);
+            return -1;
+        }
+        for (directory *curr = fat->cwd; curr != NULL; curr = curr->parent) {
+            if (curr == dir) {
+                printf("ERROR: Fail to delete the directory %s as it is the working directory.\n", fileName);
+                return -1;
+            }
+        }
+        forgetDirectory(fat, dir);
+    }
+
+    // Delete block
+    deleteFileHelper(entryNode, fat, false);
+
+    // Delete the entry node, decrementing numFile
+    removeDirEntryNode(fat, entryNode);
+
+    // Free the node
+    freeDirectory(dir);
+    freeDirEntryNode(entryNode);
+
+    return 0;
+}
+
+// Grow the chain of a directory to hold numSlots slots, the directory entry keeps the chain size
+static int growDirectory(directory *dir, uint32_t numSlots, pennfat *fat) {
+    uint32_t blocksNeeded = bytesToBlocks(numSlots * sizeof(dirEntry), fat);
+    if (dir->numDirBlocks >= blocksNeeded) {
+        return 0;
+    }
+
+    while (dir->numDirBlocks < blocksNeeded) {
+        uint32_t newBlock = allocBlock(fat);
+        if (newBlock == 0) {
+            printf("ERROR: Fail to find enough free blocks for the directory.\n");
+            return -1;
+        }
+
+        // Start the block empty, so its unused slots read as the end of directory
+        uint8_t *zeros = calloc(fat->blockSize, sizeof(uint8_t));
+        if (zeros != NULL) {
+            setBlockSum(fat, newBlock, zeros);
+        }
+        if (zeros == NULL || writeImage(zeros, fat->blockSize, blockOffset(newBlock, fat), fat) == -1) {
+            perror("ERROR: Fail to write the directory block.");
+            free(zeros);
+            releaseBlock(fat, newBlock);
+            return -1;
+        }
+        free(zeros);
+        if (fat->cache != NULL) {
+            cacheInvalidate(fat->cache, newBlock);
+        }
+
+        uint32_t last = dir->dirBlocks[dir->numDirBlocks - 1];
+        if (addDirBlock(dir, newBlock) == -1) {
+            releaseBlock(fat, newBlock);
+            return -1;
+        }
+        fat->blocks[last] = newBlock;
+    }
+
+    if (dir->node != NULL) {
+        dir->node->entry->size = (uint64_t) dir->numDirBlocks * fat->blockSize;
+        dropExtents(dir->node);
+        dropBlockMap(dir->node);
+        markDirEntryDirty(fat, dir->node);
+    }
+    return 0;
+}
+
+int renameFile(char *oldFileName, char *newFileName, pennfat *fat) {
+    // get directory entry for filename
+    dirEntryNode *entryNode;
+    getDirEntryNode(NULL, &entryNode, oldFileName, fat);
+
+    if (entryNode == NULL) {
+        printf("ERROR: file %s does not exist.\n", oldFileName);
+        return -1;
+    }
+
+    // Check permission
     if (entryNode->entry->perm == NONE_PERMS || entryNode->entry->perm == READ_PERMS) {
         printf("%s lacks write permission\n", oldFileName);
         return -1;
     }
 
-    // Check if file with newFileName already exists
-    dirEntryNode *newFileNode;
-    getDirEntryNode(NULL, &newFileNode, newFileName, fat);
+    // Find where the entry goes, an existing directory takes it under its current name
+    directory *newParent;
+    char newName[MAX_FILENAME];
+    int resolved = resolvePath(fat, newFileName, &newParent, newName);
+    if (resolved == -1) {
+        return -1;
+    }
+    dirEntryNode *newFileNode = resolved == 1 ? NULL : lookupDirEntryNode(fat, newParent, newName);
+    if (resolved == 1 || (newFileNode != NULL && newFileNode != entryNode && newFileNode->entry->type == DIRECTORY_FILETYPE)) {
+        if (resolved == 0 && (newParent = getDirectory(fat, newFileNode)) == NULL) {
+            return -1;
+        }
+        strncpy(newName, entryNode->entry->name, MAX_FILENAME - 1);
+        newName[MAX_FILENAME - 1] = '\0';
+        newFileNode = lookupDirEntryNode(fat, newParent, newName);
+    }
+
+    // A directory cannot go under itself
+    for (directory *curr = newParent; curr != NULL; curr = curr->parent) {
+        if (entryNode->dir != NULL && curr == entryNode->dir) {
+            printf("ERROR: Fail to move %s into itself.\n", oldFileName);
+            return -1;
+        }
+    }
+
+    // Another directory may need one more block for the entry, taken before anything moves
+    if (newParent != entryNode->parent && newFileNode == NULL && newParent->numHoles == 0) {
+        if (reclaimBlocks(fat, 1) == -1 || growDirectory(newParent, newParent->numSlots + 1, fat) == -1) {
+            printf("ERROR: Fail to make room for %s in the directory.\n", oldFileName);
+            return -1;
+        }
+    }
 
     // Delete the exisitng file
-    if (newFileNode != NULL) {
-        if (deleteFile(newFileNode->entry->name, fat, false) == -1) {
+    if (newFileNode != NULL && newFileNode != entryNode) {
+        if (newFileNode->entry->type == DIRECTORY_FILETYPE) {
+            printf("Failed to overwrite the directory %s\n", newFileNode->entry->name);
+            return -1;
+        }
+        if (deleteEntry(newFileNode, newName, fat, false) == -1) {
             printf("Failed to overwrite %s\n", newFileNode->entry->name);
+            return -1;
         }
     }
 
     // Rename
-    strcpy(entryNode->entry->name, newFileName);
+    directory *oldParent = entryNode->parent;
+    renameDirEntryNode(fat, entryNode, newParent, newName);
 
-    // Update timestamp
+    // Update timestamp, the directories that changed too
     entryNode->entry->mtime = time(NULL);
-    fat->head->entry->mtime = entryNode->entry->mtime;
+    for (int i = 0; i < 2; i++) {
+        dirEntryNode *dirNode = i == 0 ? oldParent->node : newParent->node;
+        if (dirNode != NULL) {
+            dirNode->entry->mtime = entryNode->entry->mtime;
+            markDirEntryDirty(fat, dirNode);
+        }
+    }
 
     return 0;
 }
 
-int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uint8_t type, uint8_t perm, pennfat *fat, bool appending, bool flag, bool writeDir) {
-    // Find the corresponidng directory entry
-    dirEntryNode *prev;
-    dirEntryNode *entryNode;
-#ifdef DEBUGGING
-    writeHelper("Getting dirctory entry node\n");
-#endif
-    getDirEntryNode(&prev, &entryNode, fileName, fat);
+int overwriteBlocks(dirEntryNode *entryNode, uint8_t *bytes, uint64_t offset, uint32_t len, pennfat *fat) {
+    // Blocks shared with a copy are copied before they change, and committed ones move
+    if (len > 0 && unshareBlocks(entryNode, (offset + len - 1) / fat->blockSize, fat) == -1) {
+        return -1;
+    }
+    if (moveCommitted(entryNode, offset, len, fat) == -1) {
+        return -1;
+    }
+    if (getBlockMap(entryNode, fat) == NULL) {
+        return -1;
+    }
+
+    if (transferBlocks(entryNode->blockMap, bytes, offset, len, true, fat) == -1) {
+        perror("ERROR: Fail to write the block.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int truncateFile(dirEntryNode *entryNode, uint64_t size, pennfat *fat) {
+    uint64_t oldSize = entryNode->entry->size;
+
+    if (size > oldSize) {
+        // Files have no holes, the new bytes read as zeros
+        uint8_t *zeros = calloc(EXPORT_CHUNK_SIZE, sizeof(uint8_t));
+        if (zeros == NULL) {
+            perror("ERROR: Fail to malloc the buffer.");
+            return -1;
+        }
+        for (uint64_t position = oldSize; position < size; position += EXPORT_CHUNK_SIZE) {
+            uint32_t chunk = size - position > EXPORT_CHUNK_SIZE ? EXPORT_CHUNK_SIZE : size - position;
+            if (appendEntry(entryNode, zeros, chunk, fat) == -1) {
+                free(zeros);
+                return -1;
+            }
+        }
+        free(zeros);
+        return 0;
+    }
+
+    if (size < oldSize) {
+        uint32_t keepBlocks = bytesToBlocks(size, fat);
+        if (keepBlocks > 0 && unshareBlocks(entryNode, keepBlocks - 1, fat) == -1) {
+            return -1;
+        }
+        if (getBlockMap(entryNode, fat) == NULL) {
+            return -1;
+        }
 
+        // End the chain at the last kept block, which is this file's own, then free the tail a copy does not share
+        uint32_t tail = keepBlocks < entryNode->mapBlocks ? entryNode->blockMap[keepBlocks] : FAT_END;
+        if (keepBlocks == 0) {
+            entryNode->entry->firstBlock = 0;
+        } else {
+            fat->blocks[entryNode->blockMap[keepBlocks - 1]] = FAT_END;
+        }
+        releaseChain(fat, tail);
+        if (entryNode->ownBlocks > keepBlocks) {
+            entryNode->ownBlocks = keepBlocks;
+        }
+
+        if (keepBlocks == 0) {
+            dropBlockMap(entryNode);
+        } else {
+            entryNode->mapBlocks = keepBlocks;
+        }
+        dropExtents(entryNode);
+    }
+
+    entryNode->entry->size = size;
+    entryNode->entry->mtime = time(NULL);
+    markDirEntryDirty(fat, entryNode);
+
+    return 0;
+}
+
+// Body of writeFile once the entry, or the directory and the name of a new one, is known
+static int writeEntry(directory *parent, char *fileName, dirEntryNode *entryNode, uint8_t *bytes, uint64_t offset, uint32_t len, uint8_t type, uint8_t perm, pennfat *fat, bool appending, bool flag, bool writeDir) {
 // Check write permissions
 #ifdef DEBUGGING
     writeHelper("Checking write perm\n");
@@ -340,6 +1129,10 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
         printf("ERROR: Fail to delete the file %s due to lack of write permission.\n", fileName);
         return -1;
     }
+    if (entryNode != NULL && entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("ERROR: %s is a directory.\n", fileName);
+        return -1;
+    }
 
 // Get the number of free blocks needed
 #ifdef DEBUGGING
@@ -351,7 +1144,7 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
         // Do not need to create new directory entires
     } else if (entryNode == NULL) {
         // Need new directory entries
-        if (fat->numFile != 0 && (sizeof(dirEntry) * fat->numFile) % fat->blockSize == 0) {
+        if (parent->numHoles == 0 && parent->numSlots != 0 && (sizeof(dirEntry) * parent->numSlots) % fat->blockSize == 0) {
             newNumOfFreeBlocks -= 1;
         }
         newNumOfFreeBlocks -= bytesToBlocks(len, fat);
@@ -368,22 +1161,64 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
         newNumOfFreeBlocks -= bytesToBlocks(len, fat) - bytesToBlocks(entryNode->entry->size, fat);
     }
 
-    // Fail to find enough space
+    // Blocks shared with a copy, up to the last one the write changes, are copied first, and the committed ones it changes move
+    if (!writeDir && entryNode != NULL && entryNode->entry->size != 0 && len != 0) {
+        uint32_t firstChanged = (appending ? entryNode->entry->size : offset) / fat->blockSize;
+        uint32_t lastChanged = appending || offset + len > entryNode->entry->size ? UINT32_MAX : (offset + len - 1) / fat->blockSize;
+        newNumOfFreeBlocks -= (int32_t) sharedBlocks(entryNode, lastChanged, fat);
+        newNumOfFreeBlocks -= (int32_t) committedBlocks(entryNode, firstChanged, lastChanged, fat);
+    }
+
+    // Fail to find enough space, counting the blocks freed before that a commit gives back
+    if ((int32_t)fat->freeBlocks + newNumOfFreeBlocks < 0 && reclaimBlocks(fat, -newNumOfFreeBlocks) == -1) {
+        return -1;
+    }
     if ((int32_t)fat->freeBlocks + newNumOfFreeBlocks < 0) {
         printf("ERROR: Fail to find enough free blocks, %d blocks required, %d blocks is free.\n", -newNumOfFreeBlocks, fat->freeBlocks);
         return -1;
     }
 
-// If not appending, delete the exisitng file
+// Overwrite an existing file in place, its chain only changes at the tail
 #ifdef DEBUGGING
-    writeHelper("Deleting the existing file\n");
+    writeHelper("Overwriting the existing file\n");
 #endif
-    if (writeDir || (entryNode != NULL && !appending)) {
-        deleteFileHelper(prev, entryNode, fat, flag && writeDir);
+    if (!writeDir && entryNode != NULL && !appending) {
+        if (offset > entryNode->entry->size) {
+            printf("ERROR: Offset is greater than file length.\n");
+            return -1;
+        }
+
+        // A plain overwrite drops what lies past the new contents
+        if (offset == 0 && len < entryNode->entry->size && truncateFile(entryNode, len, fat) == -1) {
+            return -1;
+        }
+
+        uint32_t inPlace = entryNode->entry->size - offset > len ? len : entryNode->entry->size - offset;
+        if (inPlace > 0 && overwriteBlocks(entryNode, bytes, offset, inPlace, fat) == -1) {
+            return -1;
+        }
+
+        // Grow from the tail for the rest
+        if (inPlace < len) {
+            return appendEntry(entryNode, &bytes[inPlace], len - inPlace, fat);
+        }
+
+        entryNode->entry->mtime = time(NULL);
+        markDirEntryDirty(fat, entryNode);
+        return 0;
+    }
+
+    if (writeDir) {
+        deleteFileHelper(entryNode, fat, flag && writeDir);
+        if (entryNode != NULL) {
+            dropBlockMap(entryNode);
+        }
     }
 
-    uint16_t currIndex = 1;
+    uint32_t currIndex = 1;
     uint32_t thisOffset = 0;
+    uint32_t logical = 0;   // Logical block of currIndex in the file
+    uint32_t tailIndex = 0; // Block of the file the write starts in, the others are taken by this write
 
 #ifdef DEBUGGING
     writeHelper("Checking the write type\n");
@@ -395,165 +1230,125 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
 #endif
         currIndex = 1;
         thisOffset = 0;
+        fat->blocks[1] = FAT_END;
     } else if (appending && entryNode != NULL && entryNode->entry->size != 0) {
 // Appending
 #ifdef DEBUGGING
         writeHelper("Flag is Appending\n");
 #endif
-        currIndex = entryNode->entry->firstBlock;
-        while (fat->blocks[currIndex] != 0xFFFF) {
-            currIndex = fat->blocks[currIndex];
+        // The tail is the last mapped block, which gets the new bytes and the link to the next one
+        if (getBlockMap(entryNode, fat) == NULL) {
+            return -1;
         }
-
-        if (entryNode->entry->size % fat->blockSize == 0) {
-            // Find the free free block
-            uint16_t nextIndex = 0;
-            for (unsigned int i = 1; i < fat->numEntries; i++) {
-                if (fat->blocks[i] == 0) {
-                    nextIndex = i;
-                    break;
-                }
-            }
-            fat->blocks[currIndex] = nextIndex;
-            currIndex = nextIndex;
+        if (len != 0 && unshareBlocks(entryNode, entryNode->mapBlocks - 1, fat) == -1) {
+            return -1;
         }
+        if (moveCommitted(entryNode, entryNode->entry->size, len, fat) == -1) {
+            return -1;
+        }
+        logical = entryNode->mapBlocks - 1;
+        currIndex = entryNode->blockMap[logical];
+        tailIndex = currIndex;
 
-// Get the current offset
+// Get the current offset, a full tail block gets its successor in the write loop
 #ifdef DEBUGGING
         writeHelper("Getting the current offset\n");
 #endif
         thisOffset = entryNode->entry->size % fat->blockSize;
-    } else if (offset > 0 && entryNode != NULL) {
-#ifdef DEBUGGING
-        writeHelper("Writing in offset\n");
-#endif
-        if (offset > entryNode->entry->size) {
-            printf("ERROR: Offset is greater than file length.\n");
-            return -1;
-        }
-        currIndex = entryNode->entry->firstBlock;
-
-        int blockAt = offset / fat->blockSize;
-        for (int i = 0; i < blockAt; i++) {
-            currIndex = fat->blocks[currIndex];
-        }
-
-        if (entryNode->entry->size % fat->blockSize == 0) {
-            // Find the free free block
-            uint16_t nextIndex = 0;
-            for (unsigned int i = 1; i < fat->numEntries; i++) {
-                if (fat->blocks[i] == 0) {
-                    nextIndex = i;
-                    break;
-                }
-            }
-            fat->blocks[currIndex] = nextIndex;
-            currIndex = nextIndex;
+        if (thisOffset == 0) {
+            thisOffset = fat->blockSize;
         }
-
-        // Get the current offset
-        thisOffset = offset % fat->blockSize;
     } else {
 // Get the first free block
 #ifdef DEBUGGING
         writeHelper("Getting the first free block\n");
 #endif
-        for (unsigned int i = 1; i < fat->numEntries; i++) {
-#ifdef DEBUGGING
-            printf("Iterating through all blocks, curr block = %d\n", i);
-            printf("fat->numEntries is %d\n", fat->numEntries);
-#endif
-            if (fat->blocks[i] == 0) {
-#ifdef DEBUGGING
-                printf("Looking at block %d = %d\n", i, fat->blocks[i]);
-#endif
-                currIndex = i;
-                break;
-            }
+        uint32_t got = 0;
+        currIndex = len == 0 ? 0x0000 : allocRun(fat, bytesToBlocks(len, fat), &got);
+        if (len != 0 && got == 0) {
+            printf("ERROR: Run out of free blocks.\n");
+            return -1;
         }
     }
 
     // Get the first index
-    uint16_t firstIndex = currIndex;
+    uint32_t firstIndex = currIndex;
 
-    int fd;
-#ifdef DEBUGGING
-    writeHelper("Opening the des file\n");
-#endif
-    if ((fd = open(fat->fileName, O_WRONLY | O_CREAT, 0644)) == -1) {
-        perror("ERROR: Fail to open the file.");
-        return -1;
-    }
-
-// Seek to the first empty block
+// Write the content
 #ifdef DEBUGGING
-    writeHelper("Finding the first empty block\n");
+    writeHelper("Writing...\n");
 #endif
-    uint32_t fatSize = fat->totalBlocks * fat->blockSize;
-    if (lseek(fd, fatSize + ((currIndex - 1) * fat->blockSize) + thisOffset, SEEK_SET) == -1) {
-        perror("ERROR: Fail to lseek the block.");
+    // Every block piece is queued, runs of adjacent blocks as one request, then written as one batch
+    ioRequest *requests = malloc((bytesToBlocks(len, fat) + 2) * sizeof(ioRequest));
+    if (requests == NULL) {
+        perror("ERROR: Fail to malloc the requests.");
         return -1;
     }
+    uint32_t count = 0;
+    uint8_t *zeros = NULL; // Rest of a new block left partly written, with checksums
 
-// Write the content
-#ifdef DEBUGGING
-    writeHelper("Writing...\n");
-#endif
-    int byteIdx = 0;
+    uint32_t byteIdx = 0;
     while (byteIdx < len) {
-        if (byteIdx != 0 && (byteIdx + thisOffset) % fat->blockSize == 0) {
-            if (fat->blocks[currIndex] == 0x0000 || fat->blocks[currIndex] == 0xFFFF) {
-                // Find the new block to write
-                uint16_t nextIndex = currIndex + 1;
-                if (nextIndex >= fat->numEntries) {
-                    nextIndex = 2;
-                }
-
-                for (unsigned int j = nextIndex; j < fat->numEntries; j++) {
-                    if (fat->blocks[j] == 0) {
-                        nextIndex = j;
-                        break;
-                    }
+        if (byteIdx + thisOffset != 0 && (byteIdx + thisOffset) % fat->blockSize == 0) {
+            if (fat->blocks[currIndex] == 0x0000 || fat->blocks[currIndex] == FAT_END) {
+                // Take adjacent blocks for the rest of the write, already chained and ended
+                uint32_t got;
+                uint32_t nextIndex = allocRun(fat, bytesToBlocks(len - byteIdx, fat), &got);
+                if (got == 0) {
+                    printf("ERROR: Run out of free blocks.\n");
+                    free(requests);
+                    return -1;
                 }
                 fat->blocks[currIndex] = nextIndex;
                 currIndex = nextIndex;
-                if (lseek(fd, fatSize + ((currIndex - 1) * fat->blockSize), SEEK_SET) == -1) {
-                    perror("ERROR: Fail to lseek the block.");
-                    return -1;
-                }
             } else {
                 currIndex = fat->blocks[currIndex];
             }
+
+            logical++;
+            mapBlock(entryNode, logical, currIndex);
         }
 
         // Write either enough bytes to get to the end of this block or the number of bytes to the end of the file
-        int bytesToWrite = fat->blockSize - (byteIdx + thisOffset) % fat->blockSize;
+        uint32_t bytesToWrite = fat->blockSize - (byteIdx + thisOffset) % fat->blockSize;
         if (bytesToWrite > len - byteIdx) {
             bytesToWrite = len - byteIdx;
         }
 
-        int totalBytesWritten = 0;
-        while (totalBytesWritten < bytesToWrite) {
-            int bytesWritten = write(fd, &bytes[byteIdx], bytesToWrite);
-            if (bytesWritten == -1) {
+        uint32_t blockPosition = (byteIdx + thisOffset) % fat->blockSize;
+        bool fresh = currIndex != tailIndex;
+        if (sumPiece(currIndex, blockPosition, &bytes[byteIdx], bytesToWrite, fresh, fat) == -1) {
+            free(requests);
+            return -1;
+        }
+        queueRequest(requests, &count, &bytes[byteIdx], bytesToWrite, blockOffset(currIndex, fat) + blockPosition);
+
+        // Keep a cached copy of the block current
+        if (fat->cache != NULL) {
+            cacheUpdate(fat->cache, currIndex, blockPosition, &bytes[byteIdx], bytesToWrite);
+        }
+
+        // The checksum of a new block counts zeros after the write, which the image has to hold too
+        uint32_t padding = fat->blockSize - blockPosition - bytesToWrite;
+        if (fat->sums != NULL && fresh && padding > 0) {
+            if (zeros == NULL && (zeros = calloc(fat->blockSize, sizeof(uint8_t))) == NULL) {
+                perror("ERROR: Fail to malloc the padding.");
+                free(requests);
                 return -1;
             }
-            totalBytesWritten += bytesWritten;
+            queueRequest(requests, &count, zeros, padding, blockOffset(currIndex, fat) + blockPosition + bytesToWrite);
+            if (fat->cache != NULL) {
+                cacheUpdate(fat->cache, currIndex, blockPosition + bytesToWrite, zeros, padding);
+            }
         }
         byteIdx = byteIdx + bytesToWrite;
     }
 
-// Set the end of the file
-#ifdef DEBUGGING
-    writeHelper("Setting the end of the file\n");
-#endif
-    if (len != 0) {
-        fat->blocks[currIndex] = 0xFFFF;
-    } else {
-        firstIndex = 0x0000;
-    }
-
-    if (f_close(fd) == -1) {
+    int writeResult = transferImage(requests, count, true, fat);
+    free(requests);
+    free(zeros);
+    if (writeResult == -1) {
+        perror("ERROR: Fail to write the block.");
         return -1;
     }
 
@@ -566,34 +1361,19 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
     } else if (entryNode == NULL) {
         dirEntryNode *newNode = initDirEntryNode(fileName, len, firstIndex, type, perm, time(NULL));
 
-        if (fat->numFile == 0) {
-            // Initialize the fat
-            fat->head = newNode;
-            fat->tail = newNode;
-        } else {
-            // Add new entry to the fat
-            fat->tail->next = newNode;
-            fat->tail = newNode;
-        }
-
-        // Update block count
-        fat->numFile++;
+        // Add new entry to its directory, updating the file count
+        addDirEntryNode(fat, parent, newNode);
     } else {
-        // Update existing entry
-        if (offset > 0 && offset + len > entryNode->entry->size) {
-            entryNode->entry->size = offset + len;
-        } else if (appending) {
-            entryNode->entry->size += len;
-        } else {
-            entryNode->entry->size = len;
-        }
-        if (!appending)
+        // Update existing entry, an empty file gets its first block from this write
+        if (entryNode->entry->size == 0)
             entryNode->entry->firstBlock = firstIndex;
+        entryNode->entry->size += len;
         entryNode->entry->mtime = time(NULL);
-    }
+        markDirEntryDirty(fat, entryNode);
 
-    // Update free block count
-    fat->freeBlocks += newNumOfFreeBlocks;
+        // The chain may have changed
+        dropExtents(entryNode);
+    }
 
 #ifdef DEBUGGING
     writeHelper("Finishing writing\n");
@@ -602,32 +1382,201 @@ int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uin
     return 0;
 }
 
+int writeFile(char *fileName, uint8_t *bytes, uint64_t offset, uint32_t len, uint8_t type, uint8_t perm, pennfat *fat, bool appending, bool flag, bool writeDir) {
+    // Find the directory holding the file, and the file if it exists
+    directory *parent;
+    char name[MAX_FILENAME];
+#ifdef DEBUGGING
+    writeHelper("Getting dirctory entry node\n");
+#endif
+    int resolved = resolvePath(fat, fileName, &parent, name);
+    if (resolved != 0) {
+        if (resolved == 1) {
+            printf("ERROR: %s is a directory.\n", fileName);
+        }
+        return -1;
+    }
+
+    return writeEntry(parent, name, lookupDirEntryNode(fat, parent, name), bytes, offset, len, type, perm, fat, appending, flag, writeDir);
+}
+
 int appendFile(char *fileName, uint8_t *bytes, uint32_t len, pennfat *fat, bool flag) { return writeFile(fileName, bytes, 0, len, REGULAR_FILETYPE, READWRITE_PERMS, fat, true, flag, false); }
 
+int appendEntry(dirEntryNode *entryNode, uint8_t *bytes, uint32_t len, pennfat *fat) { return writeEntry(entryNode->parent, entryNode->entry->name, entryNode, bytes, 0, len, REGULAR_FILETYPE, READWRITE_PERMS, fat, true, true, false); }
+
+// Log the blocks holding the changed slots of one directory whole, so their checksum is known before they reach the image
+static int writeDirBlocks(directory *dir, pennfat *fat) {
+    uint32_t perBlock = fat->blockSize / sizeof(dirEntry);
+    uint8_t *block = fat->sums->scratch;
+    for (uint32_t i = 0; i < dir->numDirty; i++) {
+        // Every dirty slot of a block goes with the first one
+        if (!dir->slotDirty[dir->dirtySlots[i]]) {
+            continue;
+        }
+
+        // Deleted slots keep only their mark, the slots past the last one read as the end of directory
+        uint32_t first = dir->dirtySlots[i] / perBlock * perBlock;
+        memset(block, 0, fat->blockSize);
+        for (uint32_t slot = first; slot < first + perBlock && slot < dir->numSlots; slot++) {
+            dir->slotDirty[slot] = 0;
+            uint8_t *bytes = &block[(slot - first) * sizeof(dirEntry)];
+            if (dir->slots[slot] == NULL) {
+                bytes[0] = 1;
+            } else {
+                encodeDirEntry(fat, dir->slots[slot]->entry, bytes);
+            }
+        }
+
+        uint32_t index = dir->dirBlocks[first / perBlock];
+        setBlockSum(fat, index, block);
+        if (journalWrite(fat, blockOffset(index, fat), block, fat->blockSize) == -1) {
+            return -1;
+        }
+        if (fat->cache != NULL) {
+            cacheUpdate(fat->cache, index, 0, block, fat->blockSize);
+        }
+    }
+    dir->numDirty = 0;
+
+    return 0;
+}
+
+// Log the changed slots of one directory
+static int writeDirSlots(directory *dir, pennfat *fat) {
+    if (fat->sums != NULL) {
+        return writeDirBlocks(dir, fat);
+    }
+
+    // A deleted entry only needs its first byte
+    uint8_t deletedMark = 1;
+    uint8_t endMark = 0;
+    for (uint32_t i = 0; i < dir->numDirty; i++) {
+        uint32_t slot = dir->dirtySlots[i];
+        dir->slotDirty[slot] = 0;
+
+        uint32_t position = slot * sizeof(dirEntry);
+        uint32_t block = dir->dirBlocks[position / fat->blockSize];
+        uint32_t blockPosition = position % fat->blockSize;
+
+        uint8_t encoded[sizeof(dirEntry)];
+        uint8_t *bytes = &deletedMark;
+        uint32_t len = 1;
+        if (dir->slots[slot] != NULL) {
+            encodeDirEntry(fat, dir->slots[slot]->entry, encoded);
+            bytes = encoded;
+            len = sizeof(dirEntry);
+        }
+
+        if (journalWrite(fat, blockOffset(block, fat) + blockPosition, bytes, len) == -1) {
+            return -1;
+        }
+        if (fat->cache != NULL) {
+            cacheUpdate(fat->cache, block, blockPosition, bytes, len);
+        }
+
+        // Mark the end of directory after a changed last slot, the rest of the block may hold old entries
+        position += sizeof(dirEntry);
+        if (slot == dir->numSlots - 1 && position % fat->blockSize != 0) {
+            if (journalWrite(fat, blockOffset(block, fat) + blockPosition + sizeof(dirEntry), &endMark, 1) == -1) {
+                return -1;
+            }
+            if (fat->cache != NULL) {
+                cacheUpdate(fat->cache, block, blockPosition + sizeof(dirEntry), &endMark, 1);
+            }
+        }
+    }
+    dir->numDirty = 0;
+
+    return 0;
+}
+
 int writeDirEntries(pennfat *fat) {
-    uint32_t fileSize = fat->numFile * sizeof(dirEntry);
-    uint32_t length = fileSize;
-    if (fileSize % fat->blockSize != 0)
-        length += 1;
+    // Grow first, a grown directory dirties its own entry in the parent, which is queued ahead of it
+    for (directory *dir = fat->dirtyDirs; dir != NULL; dir = dir->nextDirty) {
+        if (growDirectory(dir, dir->numSlots, fat) == -1) {
+            return -1;
+        }
+    }
+
+    while (fat->dirtyDirs != NULL) {
+        directory *dir = fat->dirtyDirs;
+        if (writeDirSlots(dir, fat) == -1) {
+            return -1;
+        }
+        fat->dirtyDirs = dir->nextDirty;
+        dir->nextDirty = NULL;
+        dir->queued = false;
+    }
+
+    return 0;
+}
 
-    uint8_t bytes[length];
+// Start a directory file with one empty block
+static int newDirectoryBlock(pennfat *fat) {
+    uint32_t block = allocBlock(fat);
+    if (block == 0) {
+        printf("ERROR: Fail to find a free block for the directory.\n");
+        return 0;
+    }
+
+    uint8_t *zeros = calloc(fat->blockSize, sizeof(uint8_t));
+    if (zeros != NULL) {
+        setBlockSum(fat, block, zeros);
+    }
+    if (zeros == NULL || writeImage(zeros, fat->blockSize, blockOffset(block, fat), fat) == -1) {
+        perror("ERROR: Fail to write the directory block.");
+        free(zeros);
+        releaseBlock(fat, block);
+        return 0;
+    }
+    free(zeros);
+    if (fat->cache != NULL) {
+        cacheInvalidate(fat->cache, block);
+    }
+    return block;
+}
 
-    if (fileSize % fat->blockSize != 0)
-        bytes[length - 1] = 0x00;
+int makeDirectory(char *dirName, pennfat *fat) {
+    directory *parent;
+    char name[MAX_FILENAME];
+    int resolved = resolvePath(fat, dirName, &parent, name);
+    if (resolved == -1) {
+        return -1;
+    }
+    if (resolved == 1 || lookupDirEntryNode(fat, parent, name) != NULL) {
+        printf("ERROR: %s already exists.\n", dirName);
+        return -1;
+    }
+
+    // The new entry may need one more block in the parent
+    uint32_t needed = parent->numHoles == 0 && parent->numSlots != 0 && (sizeof(dirEntry) * parent->numSlots) % fat->blockSize == 0 ? 2 : 1;
+    if (reclaimBlocks(fat, needed) == -1) {
+        return -1;
+    }
+    if (needed > fat->freeBlocks) {
+        printf("ERROR: Fail to find enough free blocks for the directory.\n");
+        return -1;
+    }
 
-    int bufIdx = 0;
-    dirEntryNode *entryNode = fat->head;
-    while (entryNode != NULL) {
-        memcpy(&bytes[bufIdx], entryNode->entry, sizeof(dirEntry));
-        entryNode = entryNode->next;
-        bufIdx += sizeof(dirEntry);
+    uint32_t block = newDirectoryBlock(fat);
+    if (block == 0) {
+        return -1;
     }
 
-    if (writeFile(NULL, bytes, 0, length, DIRECTORY_FILETYPE, NONE_PERMS, fat, false, true, true) == -1) {
-        printf("ERROR: Failed to wrtie the directory file.\n");
+    dirEntryNode *newNode = initDirEntryNode(name, fat->blockSize, block, DIRECTORY_FILETYPE, READWRITE_PERMS, time(NULL));
+    newNode->dir = initDirectory(parent, newNode);
+    if (newNode->dir == NULL || addDirBlock(newNode->dir, block) == -1) {
+        releaseBlock(fat, block);
+        freeDirectory(newNode->dir);
+        freeDirEntryNode(newNode);
         return -1;
     }
+    addDirEntryNode(fat, parent, newNode);
 
+    if (parent->node != NULL) {
+        parent->node->entry->mtime = newNode->entry->mtime;
+        markDirEntryDirty(fat, parent->node);
+    }
     return 0;
 }
 
@@ -646,63 +1595,333 @@ int chmodFile(pennfat *fat, char *fileName, int newPerms) {
     }
 
     entryNode->entry->perm = newPerms;
+    markDirEntryDirty(fat, entryNode);
 
     return 0;
 }
 
+/* ------------------------------------------------------------------------
+---------------------------- File Descriptors -----------------------------
+------------------------------------------------------------------------*/
+
+static openFile openFiles[MAX_OPEN_FILES]; // Global open file table
+static int hostFds[MAX_FILES];             // Descriptor table used outside of a PennOS process
+static bool hostFdsReady = false;
+
+// Descriptor table of the running process
+static int *currentFdTable() {
+    PCB *pcb = get_current_PCB();
+    if (pcb != NULL) {
+        return pcb->open_fds;
+    }
+
+    if (!hostFdsReady) {
+        initFdTable(hostFds);
+        hostFdsReady = true;
+    }
+    return hostFds;
+}
+
+// Host descriptor behind a standard descriptor
+static int hostFd(int fd) {
+    PCB *pcb = get_current_PCB();
+    if (pcb != NULL && fd == STDIN_FILENO) {
+        return pcb->stdin;
+    }
+    if (pcb != NULL && fd == STDOUT_FILENO) {
+        return pcb->stdout;
+    }
+    return fd;
+}
+
+// Open file behind a FAT descriptor, NULL if the descriptor is not open
+static openFile *getOpenFile(int fd) {
+    if (fd < FIRST_FAT_FD || fd >= MAX_FILES) {
+        return NULL;
+    }
+
+    int *fds = currentFdTable();
+    if (fds[fd] == NO_FD) {
+        return NULL;
+    }
+    return &openFiles[fds[fd]];
+}
+
+// Drop one descriptor on an open file, the last one commits a written file
+static void releaseOpenFile(openFile *file) {
+    if (--file->refCount > 0) {
+        return;
+    }
+
+    if (file->node != NULL) {
+        file->node->opens--;
+        if (file->mode != F_READ) {
+            file->node->writing = false;
+            saveFat(file->fat);
+        }
+    }
+    file->node = NULL;
+    file->fat = NULL;
+}
+
+void initFdTable(int *fds) {
+    for (int fd = 0; fd < MAX_FILES; fd++) {
+        fds[fd] = NO_FD;
+    }
+}
+
+void closeFdTable(int *fds) {
+    for (int fd = FIRST_FAT_FD; fd < MAX_FILES; fd++) {
+        if (fds[fd] != NO_FD) {
+            releaseOpenFile(&openFiles[fds[fd]]);
+            fds[fd] = NO_FD;
+        }
+    }
+}
+
+void closeFatFiles(pennfat *fat) {
+    // Entries stay taken until their descriptors are closed, so a stale descriptor never reaches another file
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (openFiles[i].refCount != 0 && openFiles[i].fat == fat) {
+            openFiles[i].node = NULL;
+            openFiles[i].fat = NULL;
+        }
+    }
+}
+
 int f_open(const char *filename, int mode) {
-    int fd;
-    int flag = -1;
+    pennfat *fat = mounted_fat;
+    if (fat == NULL) {
+        printf("ERROR: No file system is mounted.\n");
+        return -1;
+    }
 
-    switch (mode) {
-    case 0: // Read
-        flag = O_RDONLY;
-        break;
-    case 1: // Write
-        flag = O_WRONLY | O_CREAT | O_TRUNC;
-        break;
-    case 2: // Append
-        flag = O_WRONLY | O_CREAT | O_APPEND;
-        break;
-    default:
-        fprintf(stderr, "Invalid mode\n");
+    if (mode != F_WRITE && mode != F_READ && mode != F_APPEND) {
+        printf("ERROR: Invalid mode %d.\n", mode);
         return -1;
     }
 
-    if ((fd = open(filename, flag, 0644)) == -1) {
-        perror("ERROR: Fail to open the file.");
+    // Take a descriptor and an open file entry before touching the file
+    int *fds = currentFdTable();
+    int fd = FIRST_FAT_FD;
+    while (fd < MAX_FILES && fds[fd] != NO_FD) {
+        fd++;
+    }
+    int slot = 0;
+    while (slot < MAX_OPEN_FILES && openFiles[slot].refCount != 0) {
+        slot++;
+    }
+    if (fd == MAX_FILES || slot == MAX_OPEN_FILES) {
+        printf("ERROR: Too many open files.\n");
+        return -1;
+    }
+
+    dirEntryNode *entryNode;
+    getDirEntryNode(NULL, &entryNode, (char *)filename, fat);
+    if (entryNode != NULL && entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("ERROR: %s is a directory.\n", filename);
         return -1;
     }
 
+    if (mode == F_READ) {
+        if (entryNode == NULL) {
+            printf("ERROR: Fail to find %s.\n", filename);
+            return -1;
+        }
+        if (!(entryNode->entry->perm & READ_PERMS)) {
+            printf("ERROR: Fail to open %s due to lack of read permission.\n", filename);
+            return -1;
+        }
+    } else {
+        if (entryNode != NULL && !(entryNode->entry->perm & WRITE_PERMS)) {
+            printf("ERROR: Fail to open %s due to lack of write permission.\n", filename);
+            return -1;
+        }
+        if (entryNode != NULL && entryNode->writing) {
+            printf("ERROR: %s is already open for writing.\n", filename);
+            return -1;
+        }
+
+        // F_WRITE truncates the file, both modes create a missing one
+        if (entryNode == NULL || mode == F_WRITE) {
+            if (writeFile((char *)filename, NULL, 0, 0, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, true, false) == -1) {
+                return -1;
+            }
+            getDirEntryNode(NULL, &entryNode, (char *)filename, fat);
+        }
+        entryNode->writing = true;
+    }
+    entryNode->opens++;
+
+    openFile *file = &openFiles[slot];
+    file->node = entryNode;
+    file->fat = fat;
+    file->cursor = mode == F_APPEND ? entryNode->entry->size : 0;
+    file->mode = mode;
+    file->refCount = 1;
+    file->raWindow = READAHEAD_MIN_BLOCKS;
+    file->raLast = 0;
+    file->raNext = 0;
+    fds[fd] = slot;
+
     return fd;
 }
 
 int f_close(int fd) {
-    int result = close(fd);
-    if (result < 0) {
-        perror("close");
+    openFile *file = getOpenFile(fd);
+    if (file == NULL) {
+        printf("ERROR: Invalid file descriptor %d.\n", fd);
         return -1;
     }
+
+    currentFdTable()[fd] = NO_FD;
+    releaseOpenFile(file);
     return 0;
 }
 
+// Ask the host to fetch blocks first to last - 1 of the file, one hint per run of adjacent blocks
+static void prefetchBlocks(dirEntryNode *entryNode, uint32_t first, uint32_t last, pennfat *fat) {
+    uint32_t runStart = first;
+    for (uint32_t i = first + 1; i <= last; i++) {
+        if (i < last && entryNode->blockMap[i] == entryNode->blockMap[i - 1] + 1) {
+            continue;
+        }
+
+        off_t offset = blockOffset(entryNode->blockMap[runStart], fat);
+        off_t length = (off_t)(i - runStart) * fat->blockSize;
+        if (fat->image != NULL) {
+            // madvise needs a page aligned start
+            off_t aligned = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise(&fat->image[aligned], length + offset - aligned, MADV_WILLNEED);
+        } else {
+            posix_fadvise(fat->fd, offset, length, POSIX_FADV_WILLNEED);
+        }
+        runStart = i;
+    }
+    fat->raBlocks += last - first;
+}
+
+// Grow the window while reads stay sequential, shrink it when they jump, and keep the window prefetched ahead of the cursor
+static void readAhead(openFile *file, uint64_t offset, uint32_t len) {
+    dirEntryNode *entryNode = file->node;
+    pennfat *fat = file->fat;
+    uint32_t first = offset / fat->blockSize;
+    uint32_t last = (offset + len - 1) / fat->blockSize;
+
+    if (file->raNext != 0 && (first == file->raLast || first == file->raLast + 1)) {
+        if (last > file->raLast && last < file->raNext) {
+            fat->raHits++;
+            file->raWindow = file->raWindow * 2 > READAHEAD_MAX_BLOCKS ? READAHEAD_MAX_BLOCKS : file->raWindow * 2;
+        }
+    } else if (file->raNext != 0 || offset != 0) {
+        // Not where the stream was going, drop what it prefetched
+        fat->raMisses++;
+        file->raWindow = file->raWindow / 2 < READAHEAD_MIN_BLOCKS ? READAHEAD_MIN_BLOCKS : file->raWindow / 2;
+        file->raNext = 0;
+    }
+    file->raLast = last;
+
+    // Top the window up once half of it has been read
+    uint32_t from = file->raNext > last + 1 ? file->raNext : last + 1;
+    uint32_t to = last + 1 + file->raWindow;
+    if (to > entryNode->mapBlocks) {
+        to = entryNode->mapBlocks;
+    }
+    if (from >= to || (file->raNext > last + 1 && file->raNext - (last + 1) > file->raWindow / 2)) {
+        return;
+    }
+
+    prefetchBlocks(entryNode, from, to, fat);
+    file->raNext = to;
+}
+
 int f_read(int fd, int n, char *buf) {
-    if (read(fd, buf, n) == -1) {
-        perror("ERROR: Fail to read the file.");
+    if (fd >= 0 && fd < FIRST_FAT_FD) {
+        ssize_t bytesRead = read(hostFd(fd), buf, n);
+        if (bytesRead == -1) {
+            perror("ERROR: Fail to read the file.");
+            return -1;
+        }
+        return bytesRead;
+    }
+
+    openFile *file = getOpenFile(fd);
+    if (file == NULL || file->node == NULL || n < 0) {
+        printf("ERROR: Invalid file descriptor %d.\n", fd);
         return -1;
     }
-    return 0;
+
+    dirEntryNode *entryNode = file->node;
+    pennfat *fat = file->fat;
+    uint64_t size = entryNode->entry->size;
+    if (file->cursor >= size || n == 0) {
+        return 0;
+    }
+
+    uint32_t len = size - file->cursor > (uint32_t)n ? (uint32_t)n : size - file->cursor;
+    if (readFileAt(entryNode, (uint8_t *)buf, file->cursor, len, fat) == -1) {
+        return -1;
+    }
+    readAhead(file, file->cursor, len);
+    file->cursor += len;
+
+    return len;
 }
 
 int f_write(int fd, char *str, int n) {
-    if (write(fd, str, n) == -1) {
-        perror("ERROR: fail to write the file.");
+    if (fd >= 0 && fd < FIRST_FAT_FD) {
+        ssize_t bytesWritten = write(hostFd(fd), str, n);
+        if (bytesWritten == -1) {
+            perror("ERROR: fail to write the file.");
+            return -1;
+        }
+        return bytesWritten;
+    }
+
+    openFile *file = getOpenFile(fd);
+    if (file == NULL || file->node == NULL || n < 0) {
+        printf("ERROR: Invalid file descriptor %d.\n", fd);
         return -1;
     }
-    return 0;
+    if (file->mode == F_READ) {
+        printf("ERROR: File descriptor %d is open for reading only.\n", fd);
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    dirEntryNode *entryNode = file->node;
+    pennfat *fat = file->fat;
+    uint64_t size = entryNode->entry->size;
+
+    // Appends always go to the end, and the file may have shrunk under the cursor
+    if (file->mode == F_APPEND || file->cursor > size) {
+        file->cursor = size;
+    }
+
+    // Overwrite up to the end of the file, then extend it from the tail
+    uint32_t inPlace = size - file->cursor > (uint32_t)n ? (uint32_t)n : size - file->cursor;
+    if (inPlace > 0 && overwriteBlocks(entryNode, (uint8_t *)str, file->cursor, inPlace, fat) == -1) {
+        return -1;
+    }
+    if (inPlace < (uint32_t)n && appendEntry(entryNode, (uint8_t *)&str[inPlace], n - inPlace, fat) == -1) {
+        return -1;
+    }
+
+    entryNode->entry->mtime = time(NULL);
+    markDirEntryDirty(fat, entryNode);
+    file->cursor += n;
+
+    return n;
 }
 
 int f_unlink(char *filename) {
+    if (mounted_fat == NULL) {
+        printf("ERROR: No file system is mounted.\n");
+        return -1;
+    }
+
     if (deleteFile(filename, mounted_fat, false) == -1) {
         return -1;
     }
@@ -710,11 +1929,41 @@ int f_unlink(char *filename) {
     return 0;
 }
 
-int f_lseek(int fd, int offset, int whence) {
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        perror("ERROR: fail to lseek the file.");
+off_t f_lseek(int fd, off_t offset, int whence) {
+    openFile *file = getOpenFile(fd);
+    if (file == NULL || file->node == NULL) {
+        printf("ERROR: Invalid file descriptor %d.\n", fd);
         return -1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    int64_t base;
+    switch (whence) {
+    case F_SEEK_SET:
+        base = 0;
+        break;
+    case F_SEEK_CUR:
+        base = (int64_t)file->cursor;
+        break;
+    case F_SEEK_END:
+        base = (int64_t)file->node->entry->size;
+        break;
+    default:
+        printf("ERROR: Invalid whence %d.\n", whence);
+        return -1;
+    }
+
+    int64_t position;
+    if (__builtin_add_overflow(base, (int64_t)offset, &position)) {
+        printf("ERROR: Offset %lld is outside of the file.\n", (long long)offset);
+        return -1;
+    }
+
+    // Files have no holes, so the cursor stays inside the file
+    if (position < 0 || (uint64_t)position > file->node->entry->size) {
+        printf("ERROR: Offset %lld is outside of the file.\n", (long long)position);
+        return -1;
+    }
+    file->cursor = position;
+
+    return position;
+}
@@ -2,6 +2,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "fat.h"
 
@@ -19,9 +21,19 @@
 #define READWRITE_PERMS 6
 #define READWRITEEXE_PERMS 7
 
-#define F_SEEK_SET
-#define F_SEEK_CUR
-#define F_SEEK_END
+#define F_SEEK_SET 0
+#define F_SEEK_CUR 1
+#define F_SEEK_END 2
+
+#define MAX_OPEN_FILES 1024 // Entries in the global open file table
+#define NO_FD -1            // Unused slot of a descriptor table
+#define FIRST_FAT_FD 3      // Descriptors below are the host stdin, stdout and stderr
+
+#define READAHEAD_MIN_BLOCKS 4   // Read-ahead window of a new or broken sequential stream
+#define READAHEAD_MAX_BLOCKS 256 // Largest read-ahead window
+
+#define EXPORT_CHUNK_SIZE (64 * 1024) // Staging buffer of exportFile when the kernel cannot copy the runs, and its write size with checksums
+#define EXPORT_IOVECS 64              // Runs gathered by exportFile per vectored write
 
 typedef struct file {
     uint8_t *contents;
@@ -30,23 +42,57 @@ typedef struct file {
     uint8_t perm;
 } file;
 
+// Entry of the global open file table, descriptors point to one of these
+typedef struct openFile {
+    dirEntryNode *node; // Open file, NULL once its FAT is unmounted
+    pennfat *fat;       // FAT holding the file
+    uint64_t cursor;    // Byte position of the next read or write
+    int mode;           // F_WRITE, F_READ or F_APPEND
+    int refCount;       // Descriptors on this entry, 0 when the entry is free
+
+    uint32_t raWindow; // Logical blocks to keep prefetched past the last read
+    uint32_t raLast;   // Last logical block read
+    uint32_t raNext;   // Logical block after the last prefetched one, 0 when none is
+} openFile;
+
+int bytesToBlocks(uint64_t numBytes, pennfat *fat); // Blocks needed to hold numBytes
 void freeFile(file *file);
 void getDirEntryNode(dirEntryNode **prev, dirEntryNode **target, char *fileName, pennfat *fat);
-file *getAllFile(pennfat *fat);
-uint8_t *getContents(uint16_t startIndex, uint32_t len, pennfat *fat);
+file *getAllFile(directory *dir, pennfat *fat); // Every slot of a directory file up to its end mark
+uint8_t *getContents(uint32_t startIndex, uint32_t len, pennfat *fat);
+int copyBlock(uint32_t from, uint32_t to, uint8_t *buf, pennfat *fat); // Copy a data block over another through buf, blockSize bytes
+int readImageBlock(uint32_t index, uint8_t *buf, pennfat *fat);        // Read a whole data block from the image, past the block cache and unchecked
+
+extent *getExtents(dirEntryNode *entryNode, pennfat *fat);      // Runs of the file chain, built on first use
+void dropExtents(dirEntryNode *entryNode);                        // Forget the runs after the chain changed
+uint32_t *getBlockMap(dirEntryNode *entryNode, pennfat *fat);     // Block of each logical block, built on first use
+void dropBlockMap(dirEntryNode *entryNode);                       // Forget the map after the chain was freed
+uint8_t *getExtentContents(dirEntryNode *entryNode, pennfat *fat); // Read the file with one read per run
 
 file *readFile(char *fileName, pennfat *fat);
-void deleteFileHelper(dirEntryNode *prev, dirEntryNode *entryNode, pennfat *fat, bool dirFile);
+int mapFile(char *fileName, struct iovec **iov, pennfat *fat); // Iovecs into the mapped image, one per contiguous run
+int exportFile(char *fileName, int fd, pennfat *fat);          // Copy the file to a host descriptor run by run, without staging it
+int readFileAt(dirEntryNode *entryNode, uint8_t *buf, uint64_t offset, uint32_t len, pennfat *fat); // Read len bytes at offset, all inside the file
+void deleteFileHelper(dirEntryNode *entryNode, pennfat *fat, bool dirFile);
 int deleteFile(char *fileName, pennfat *fat, bool flag);
+int deleteEntry(dirEntryNode *entryNode, char *fileName, pennfat *fat, bool flag); // Delete a found entry, fileName only names it in messages
 int renameFile(char *oldFileName, char *newFileName, pennfat *fat);
-int writeFile(char *fileName, uint8_t *bytes, uint32_t offset, uint32_t len, uint8_t type, uint8_t perm, pennfat *fat, bool flag, bool syscall, bool writeDir);
+int writeFile(char *fileName, uint8_t *bytes, uint64_t offset, uint32_t len, uint8_t type, uint8_t perm, pennfat *fat, bool flag, bool syscall, bool writeDir);
 int appendFile(char *fileName, uint8_t *bytes, uint32_t len, pennfat *fat, bool flag);
-int writeDirEntries(pennfat *fat);
+int appendEntry(dirEntryNode *entryNode, uint8_t *bytes, uint32_t len, pennfat *fat); // Append to a found entry, wherever its directory is
+int overwriteBlocks(dirEntryNode *entryNode, uint8_t *bytes, uint64_t offset, uint32_t len, pennfat *fat); // Overwrite len bytes at offset, all inside the file
+int truncateFile(dirEntryNode *entryNode, uint64_t size, pennfat *fat);                                    // Shrink or zero-extend the file, keeping its chain
+int writeDirEntries(pennfat *fat); // Log the dirty directory slots in the open journal transaction
+int makeDirectory(char *dirName, pennfat *fat); // Create an empty directory file
 int chmodFile(pennfat *fat, char *fileName, int newPerms);
 
+void initFdTable(int *fds);       // Mark every descriptor of a process table closed
+void closeFdTable(int *fds);      // Close the FAT descriptors left in a process table
+void closeFatFiles(pennfat *fat); // Detach the open files of a FAT about to be freed
+
 int f_open(const char *filename, int mode);     // returns a file descriptor on success and a negative value on error
 int f_close(int fd);                            // return 0 on success, or a negative value on failure.
 int f_read(int fd, int n, char *buf);           // returns the number of bytes read, 0 if EOF is reached, or a negative number on error.
 int f_write(int fd, char *str, int n);    // the number of bytes written, or a negative value on error.
 int f_unlink(char *filename);             // return 0 on success, or a negative value on failure.
-int f_lseek(int fd, int offset, int whence);    // return 0 on success, or a negative value on failure.
\ No newline at end of file
+off_t f_lseek(int fd, off_t offset, int whence); // returns the new offset on success, or a negative value on failure.
\ No newline at end of file
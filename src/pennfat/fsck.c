@@ -0,0 +1,679 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "fsck.h"
+#include "reflink.h"
+
+#define FSCK_END_OK 0    // Ends with the end of chain mark
+#define FSCK_END_FREE 1  // Runs into a free FAT entry
+#define FSCK_END_RANGE 2 // Points at a reserved block or past the data region
+#define FSCK_END_CYCLE 3 // Loops back onto itself
+
+// The directory tree is read first, one directory at a time. The chains are then walked by a pool of
+// threads that take them in batches from a shared counter and count how many chains go through each
+// block, and how many FAT entries of a chain link to it. A second round finds the chains starting at
+// a block another chain goes through, the blocks in no chain, and the blocks whose links differ from
+// the ones the link table records: only those it records are reflinks, any other is a cross-link. The
+// FAT is only read during both rounds, and repairs are made afterwards by the calling thread, in tree
+// order, so the earlier chain always keeps a block it shares. When asked, a third round reads every
+// block in a chain and checks it against its checksum; a repair then rebuilds the checksums.
+
+// Chain of a file or a directory, as the check found it
+typedef struct fsckChain {
+    dirEntryNode *node;  // Entry owning the chain, NULL for the root directory
+    char *path;          // Path of the entry, for the messages
+    uint32_t first;      // First block, 0 for an empty file
+    uint32_t length;     // Distinct blocks up to the end, a bad link or the block closing a cycle
+    uint32_t last;       // Last of those blocks, 0 when there is none
+    uint8_t end;         // How the chain ends, FSCK_END_*
+    uint32_t shared;     // First block when it is also in another chain, 0 otherwise
+    bool unread;         // Directory whose entries were not read, its chain being broken
+    uint32_t subtreeEnd; // Chain after the last one under this directory
+} fsckChain;
+
+// Check of one image, shared by the walker threads
+typedef struct fsckState {
+    pennfat *fat;
+    uint32_t limit; // Blocks below this one may be in a chain
+
+    fsckChain *chains; // Every chain, the root first, then the tree in preorder
+    uint32_t numChains;
+    uint32_t chainsCap; // Allocated length of chains
+
+    uint32_t *refs;     // Chains through each block
+    uint32_t *links;    // FAT entries of a chain linking to each block
+    uint32_t nextChain; // First chain of the next batch to hand out
+    uint32_t nextBlock; // First FAT entry of the next batch to scan
+    uint32_t leaked;    // Blocks taken in the FAT but in no chain
+    uint32_t badLinks;  // Blocks linked more or less often than the link table records
+
+    bool checkData;      // Read the blocks in a chain and check them against their checksums
+    uint64_t *badSums;   // Bit i is set when block i does not match its checksum
+    uint32_t sumErrors;  // Blocks set in badSums
+    bool readFailed;     // A block could not be read
+} fsckState;
+
+static int addChain(fsckState *state, dirEntryNode *node, char *path, uint32_t first) {
+    if (state->numChains == state->chainsCap) {
+        uint32_t newCap = state->chainsCap == 0 ? 64 : state->chainsCap * 2;
+        fsckChain *newChains = realloc(state->chains, newCap * sizeof(fsckChain));
+        if (newChains == NULL) {
+            perror("ERROR: Fail to malloc the chain list.");
+            return -1;
+        }
+        state->chains = newChains;
+        state->chainsCap = newCap;
+    }
+
+    fsckChain *chain = &state->chains[state->numChains++];
+    memset(chain, 0, sizeof(fsckChain));
+    chain->node = node;
+    chain->path = path;
+    chain->first = first;
+    chain->subtreeEnd = state->numChains;
+    return 0;
+}
+
+static void freeChains(fsckState *state) {
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        free(state->chains[c].path);
+    }
+    free(state->chains);
+    state->chains = NULL;
+    state->numChains = 0;
+    state->chainsCap = 0;
+}
+
+// Brent's cycle detection on a chain known to loop, every block on the way being valid
+static void findCycle(pennfat *fat, fsckChain *chain) {
+    uint32_t power = 1;
+    uint32_t cycle = 1;
+    uint32_t tortoise = chain->first;
+    uint32_t hare = fat->blocks[chain->first];
+    while (tortoise != hare) {
+        if (power == cycle) {
+            tortoise = hare;
+            power *= 2;
+            cycle = 0;
+        }
+        hare = fat->blocks[hare];
+        cycle++;
+    }
+
+    // Blocks before the cycle starts
+    uint32_t start = 0;
+    tortoise = hare = chain->first;
+    for (uint32_t i = 0; i < cycle; i++) {
+        hare = fat->blocks[hare];
+    }
+    while (tortoise != hare) {
+        tortoise = fat->blocks[tortoise];
+        hare = fat->blocks[hare];
+        start++;
+    }
+
+    chain->length = start + cycle;
+    chain->last = chain->first;
+    for (uint32_t i = 1; i < chain->length; i++) {
+        chain->last = fat->blocks[chain->last];
+    }
+    chain->end = FSCK_END_CYCLE;
+}
+
+// Follow the chain up to its end or its first bad link, only reading the FAT
+static void walkChain(fsckState *state, fsckChain *chain) {
+    pennfat *fat = state->fat;
+    bool root = chain->node == NULL;
+    chain->length = 0;
+    chain->last = 0;
+    chain->end = FSCK_END_OK;
+    chain->shared = 0;
+
+    uint32_t curr = chain->first;
+    if (curr == 0x0000 && !root) {
+        // Empty file
+        return;
+    }
+
+    while (curr != FAT_END) {
+        if (curr == 0x0000) {
+            chain->end = FSCK_END_FREE;
+            return;
+        }
+        if (curr == 1 && root && chain->length > 0) {
+            chain->end = FSCK_END_CYCLE;
+            return;
+        }
+        if ((curr == 1 && !root) || curr >= state->limit) {
+            chain->end = FSCK_END_RANGE;
+            return;
+        }
+        if (chain->length == state->limit) {
+            // More blocks than the image has, one of them came twice
+            findCycle(fat, chain);
+            return;
+        }
+
+        chain->last = curr;
+        chain->length++;
+        curr = fat->blocks[curr];
+    }
+}
+
+// Whether the links found into a block are the ones the link table records, an unshared block having one or none
+static bool linksMatch(pennfat *fat, uint32_t index, uint32_t links) {
+    uint32_t recorded = blockLinks(fat, index);
+    return recorded == 1 ? links <= 1 : links == recorded;
+}
+
+// Walk the chains of the batches taken and count them in refs, and their links in links
+static void *walkChains(void *arg) {
+    fsckState *state = arg;
+    while (true) {
+        uint32_t from = __atomic_fetch_add(&state->nextChain, FSCK_CHAIN_BATCH, __ATOMIC_RELAXED);
+        if (from >= state->numChains) {
+            return NULL;
+        }
+        uint32_t to = state->numChains - from < FSCK_CHAIN_BATCH ? state->numChains : from + FSCK_CHAIN_BATCH;
+
+        for (uint32_t c = from; c < to; c++) {
+            fsckChain *chain = &state->chains[c];
+            walkChain(state, chain);
+
+            // Chains sharing a block share the links past it, only the first one through counts them
+            uint32_t curr = chain->first;
+            for (uint32_t i = 0; i < chain->length; i++) {
+                uint32_t next = state->fat->blocks[curr];
+                if (__atomic_fetch_add(&state->refs[curr], 1, __ATOMIC_RELAXED) == 0 && i + 1 < chain->length) {
+                    __atomic_fetch_add(&state->links[next], 1, __ATOMIC_RELAXED);
+                }
+                curr = next;
+            }
+        }
+    }
+}
+
+// Once every chain is counted, find the chains whose first block is shared, the blocks in no chain and the cross-links
+static void *crossCheck(void *arg) {
+    fsckState *state = arg;
+    pennfat *fat = state->fat;
+    while (true) {
+        uint32_t from = __atomic_fetch_add(&state->nextChain, FSCK_CHAIN_BATCH, __ATOMIC_RELAXED);
+        if (from >= state->numChains) {
+            break;
+        }
+        uint32_t to = state->numChains - from < FSCK_CHAIN_BATCH ? state->numChains : from + FSCK_CHAIN_BATCH;
+
+        for (uint32_t c = from; c < to; c++) {
+            fsckChain *chain = &state->chains[c];
+            chain->shared = chain->length > 0 && state->refs[chain->first] > 1 ? chain->first : 0;
+        }
+    }
+
+    while (true) {
+        uint32_t from = __atomic_fetch_add(&state->nextBlock, FSCK_BLOCK_BATCH, __ATOMIC_RELAXED);
+        if (from >= state->limit) {
+            break;
+        }
+        uint32_t to = state->limit - from < FSCK_BLOCK_BATCH ? state->limit : from + FSCK_BLOCK_BATCH;
+
+        uint32_t leaked = 0;
+        uint32_t badLinks = 0;
+        for (uint32_t i = from < 2 ? 2 : from; i < to; i++) {
+            leaked += fat->blocks[i] != 0x0000 && state->refs[i] == 0 ? 1 : 0;
+            badLinks += linksMatch(fat, i, state->links[i]) ? 0 : 1;
+        }
+        __atomic_fetch_add(&state->leaked, leaked, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&state->badLinks, badLinks, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Read count blocks from first on, the blocks past the end of the image reading as zeros
+static int readBlocks(pennfat *fat, uint8_t *buf, uint32_t first, uint32_t count) {
+    size_t size = (size_t) count * fat->blockSize;
+    off_t offset = (off_t) fat->totalBlocks * fat->blockSize + (off_t) (first - 1) * fat->blockSize;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fat->fd, buf + done, size - done, offset + done);
+        if (n == -1) {
+            perror("ERROR: Fail to read the data blocks.");
+            return -1;
+        }
+        if (n == 0) {
+            memset(buf + done, 0, size - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Read the blocks in a chain of the batches taken and check them against their checksums
+static void *checkSums(void *arg) {
+    fsckState *state = arg;
+    pennfat *fat = state->fat;
+    uint8_t *buf = malloc((size_t) FSCK_SUM_BATCH * fat->blockSize);
+    if (buf == NULL) {
+        perror("ERROR: Fail to malloc the block buffer.");
+        state->readFailed = true;
+        return NULL;
+    }
+
+    while (true) {
+        uint32_t from = __atomic_fetch_add(&state->nextBlock, FSCK_SUM_BATCH, __ATOMIC_RELAXED);
+        if (from >= state->limit) {
+            break;
+        }
+        uint32_t to = state->limit - from < FSCK_SUM_BATCH ? state->limit : from + FSCK_SUM_BATCH;
+        from = from < 2 ? 2 : from;
+
+        bool inChain = false;
+        for (uint32_t i = from; i < to && !inChain; i++) {
+            inChain = state->refs[i] > 0;
+        }
+        if (!inChain) {
+            continue;
+        }
+        if (readBlocks(fat, buf, from, to - from) == -1) {
+            state->readFailed = true;
+            break;
+        }
+
+        uint32_t errors = 0;
+        for (uint32_t i = from; i < to; i++) {
+            if (state->refs[i] > 0 && crc32c(0, &buf[(size_t) (i - from) * fat->blockSize], fat->blockSize) != fat->sums->sums[i]) {
+                __atomic_fetch_or(&state->badSums[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+                errors++;
+            }
+        }
+        __atomic_fetch_add(&state->sumErrors, errors, __ATOMIC_RELAXED);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Run work on numThreads threads, the calling one included
+static void runThreads(void *(*work)(void *), fsckState *state, int numThreads) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int started = 0;
+    while (started < numThreads - 1 && pthread_create(&threads[started], NULL, work, state) == 0) {
+        started++;
+    }
+
+    // Whatever the threads that did not start would have taken is left to this one
+    work(state);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static char *joinPath(char *dirPath, char *name) {
+    size_t len = strlen(dirPath) + MAX_FILENAME + 2;
+    char *path = malloc(len);
+    if (path == NULL) {
+        perror("ERROR: Fail to malloc the path.");
+        return NULL;
+    }
+    snprintf(path, len, "%s/%.*s", strcmp(dirPath, "/") == 0 ? "" : dirPath, MAX_FILENAME, name);
+    return path;
+}
+
+// Add the chains of the entries of dir, reading every subdirectory whose chain ends cleanly
+static int collectDirectory(fsckState *state, directory *dir, char *path) {
+    for (dirEntryNode *curr = dir->head; curr != NULL; curr = curr->next) {
+        char *childPath = joinPath(path, curr->entry->name);
+        uint32_t index = state->numChains;
+        if (childPath == NULL || addChain(state, curr, childPath, curr->entry->firstBlock) == -1) {
+            free(childPath);
+            return -1;
+        }
+        if (curr->entry->type != DIRECTORY_FILETYPE) {
+            continue;
+        }
+
+        walkChain(state, &state->chains[index]);
+        if (state->chains[index].end != FSCK_END_OK || state->chains[index].length == 0 || getDirectory(state->fat, curr) == NULL) {
+            state->chains[index].unread = true;
+        } else if (collectDirectory(state, curr->dir, childPath) == -1) {
+            return -1;
+        }
+        state->chains[index].subtreeEnd = state->numChains;
+    }
+    return 0;
+}
+
+// Print what is wrong with each chain, returning the problem number
+static uint32_t reportProblems(fsckState *state) {
+    pennfat *fat = state->fat;
+    uint32_t problems = 0;
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        fsckChain *chain = &state->chains[c];
+        if (chain->end == FSCK_END_FREE) {
+            printf("%s: chain runs into a free FAT entry after %u blocks.\n", chain->path, chain->length);
+        } else if (chain->end == FSCK_END_RANGE) {
+            printf("%s: chain points outside the data region after %u blocks.\n", chain->path, chain->length);
+        } else if (chain->end == FSCK_END_CYCLE) {
+            printf("%s: chain loops back on itself after %u blocks.\n", chain->path, chain->length);
+        } else if (chain->unread) {
+            printf("%s: directory has no blocks.\n", chain->path);
+        }
+        problems += chain->end != FSCK_END_OK || chain->unread ? 1 : 0;
+
+        if (chain->shared != 0) {
+            printf("%s: block %u is also in another chain.\n", chain->path, chain->shared);
+            problems++;
+        }
+
+        if (chain->node == NULL) {
+            continue;
+        }
+        dirEntry *entry = chain->node->entry;
+        if (entry->type == DIRECTORY_FILETYPE && entry->size != (uint64_t) chain->length * fat->blockSize) {
+            printf("%s: directory size is %llu bytes for %u blocks.\n", chain->path, (unsigned long long) entry->size, chain->length);
+            problems++;
+        } else if (entry->type != DIRECTORY_FILETYPE && (uint64_t) bytesToBlocks(entry->size, fat) != chain->length) {
+            printf("%s: size is %llu bytes, but the chain has %u blocks.\n", chain->path, (unsigned long long) entry->size, chain->length);
+            problems++;
+        }
+    }
+
+    for (uint32_t i = 2; i < state->limit && state->badLinks > 0; i++) {
+        if (linksMatch(fat, i, state->links[i])) {
+            continue;
+        }
+        if (fat->refs == NULL) {
+            printf("Block %u is in several chains, %u FAT entries link to it.\n", i, state->links[i]);
+        } else {
+            printf("Block %u has %u links in the FAT, the link table records %u.\n", i, state->links[i], blockLinks(fat, i));
+        }
+    }
+    problems += state->badLinks;
+
+    for (uint32_t i = 2; i < state->limit && state->sumErrors > 0; i++) {
+        if (state->badSums[i / 64] & (1ULL << (i % 64))) {
+            printf("Block %u does not match its checksum.\n", i);
+        }
+    }
+    problems += state->sumErrors;
+
+    if (state->leaked > 0) {
+        printf("%u blocks are taken in the FAT but in no chain.\n", state->leaked);
+        problems++;
+    }
+    return problems;
+}
+
+// Drop the entry of a directory whose chain is lost, with everything loaded under it
+static void dropDirectory(pennfat *fat, dirEntryNode *node) {
+    directory *dir = node->dir;
+    if (dir != NULL) {
+        forgetDirectory(fat, dir);
+    }
+    removeDirEntryNode(fat, node);
+    freeDirectory(dir);
+    freeDirEntryNode(node);
+}
+
+// Cut every chain at its first bad link or cross-link, fit the sizes to the chains, free the leaked blocks and recount the links
+static int repairImage(fsckState *state) {
+    pennfat *fat = state->fat;
+    uint8_t *owned = calloc(fat->numEntries, sizeof(uint8_t));
+    uint32_t *accepted = calloc(fat->numEntries, sizeof(uint32_t));
+    if (owned == NULL || accepted == NULL) {
+        perror("ERROR: Fail to malloc the block owners.");
+        free(owned);
+        free(accepted);
+        return -1;
+    }
+
+    uint32_t repaired = 0;
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        fsckChain *chain = &state->chains[c];
+        dirEntryNode *node = chain->node;
+        bool isDir = node == NULL || node->entry->type == DIRECTORY_FILETYPE;
+
+        // A file keeps the blocks its size needs. The earlier chain keeps a shared block, a later one
+        // joins it only through a link the table records, and never at its first block. Nothing tells
+        // which of the links into a block with too many is the bad one, so no chain joins it then
+        uint32_t need = isDir ? UINT32_MAX : (uint32_t) bytesToBlocks(node->entry->size, fat);
+        uint32_t kept = 0;
+        uint32_t prev = 0;
+        uint32_t curr = chain->first;
+        bool fresh = false; // The last kept block is this chain's own, its link into curr not taken yet
+        uint32_t join = 0;
+        uint32_t joinKept = 0;
+        uint32_t joinPrev = 0;
+        while (kept < chain->length && kept < need && curr != FAT_END) {
+            bool taken = owned[curr];
+            uint32_t recorded = blockLinks(fat, curr);
+            if (taken && (kept == 0 || (fresh && (accepted[curr] >= recorded || state->links[curr] > recorded)))) {
+                break;
+            }
+            if (taken && fresh) {
+                join = curr;
+                joinKept = kept;
+                joinPrev = prev;
+            }
+            accepted[curr] += fresh ? 1 : 0;
+            fresh = !taken;
+            owned[curr] = 1;
+            prev = curr;
+            kept++;
+            curr = fat->blocks[curr];
+        }
+
+        // Cutting inside blocks an earlier chain keeps would cut that chain too, this one ends before joining it
+        if (kept > 0 && !fresh && kept < chain->length && curr != FAT_END) {
+            accepted[join]--;
+            kept = joinKept;
+            prev = joinPrev;
+        }
+
+        bool changed = false;
+        if (kept < chain->length || chain->end != FSCK_END_OK) {
+            // What follows the last kept block is freed with the leaks
+            if (prev == 0 && node != NULL) {
+                node->entry->firstBlock = 0;
+            } else if (prev != 0) {
+                fat->blocks[prev] = FAT_END;
+            }
+            changed = true;
+        }
+
+        if (node != NULL && isDir && kept == 0) {
+            printf("%s: removed, its directory file is lost.\n", chain->path);
+            dropDirectory(fat, node);
+            repaired++;
+            c = chain->subtreeEnd - 1;
+            continue;
+        }
+        if (node != NULL && isDir && node->entry->size != (uint64_t) kept * fat->blockSize) {
+            node->entry->size = (uint64_t) kept * fat->blockSize;
+            changed = true;
+        } else if (!isDir && node->entry->size > (uint64_t) kept * fat->blockSize) {
+            node->entry->size = (uint64_t) kept * fat->blockSize;
+            changed = true;
+        }
+        if (!changed) {
+            continue;
+        }
+        repaired++;
+
+        // A directory file that lost blocks gets them back at the next commit, every slot being rewritten
+        directory *dir = node == NULL ? fat->root : node->dir;
+        if (dir != NULL) {
+            if (loadDirChain(fat, dir, node == NULL ? 1 : node->entry->firstBlock) == -1) {
+                free(owned);
+                free(accepted);
+                return -1;
+            }
+            for (dirEntryNode *child = dir->head; child != NULL; child = child->next) {
+                markDirEntryDirty(fat, child);
+            }
+        }
+        if (node != NULL) {
+            dropExtents(node);
+            dropBlockMap(node);
+            markDirEntryDirty(fat, node);
+        }
+    }
+
+    // Blocks in no chain may still belong to a directory not read yet, the next pass frees them
+    bool allRead = true;
+    for (uint32_t c = 0; c < state->numChains; c++) {
+        allRead = allRead && !state->chains[c].unread;
+    }
+    uint32_t freed = 0;
+    for (uint32_t i = 2; i < state->limit && allRead; i++) {
+        if (!owned[i] && fat->blocks[i] != 0x0000) {
+            fat->blocks[i] = 0x0000;
+            freed++;
+        }
+    }
+
+    // The data is all there is to go by, the checksum of a kept block that does not match it is rebuilt
+    uint32_t rebuilt = 0;
+    for (uint32_t i = 2; i < state->limit && state->sumErrors > 0; i++) {
+        if (!owned[i] || !(state->badSums[i / 64] & (1ULL << (i % 64)))) {
+            continue;
+        }
+        if (readBlocks(fat, fat->sums->scratch, i, 1) == -1) {
+            free(owned);
+            free(accepted);
+            return -1;
+        }
+        setBlockSum(fat, i, fat->sums->scratch);
+        rebuilt++;
+    }
+    free(owned);
+    free(accepted);
+    if (rebuilt > 0) {
+        printf("Rebuilt the checksums of %u blocks.\n", rebuilt);
+    }
+
+    // Every link left is one the table records or one of an unshared block
+    printf("Repaired %u chains and freed %u blocks.\n", repaired, freed);
+    if (buildFreeMap(fat) == -1 || countLinks(fat) == -1) {
+        return -1;
+    }
+    return journalCommit(fat, true);
+}
+
+static double elapsedMs(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+int fsckImage(char *fileName, bool repair, bool checkData, int numThreads) {
+    if (numThreads < 1) {
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > FSCK_MAX_THREADS) {
+        numThreads = FSCK_MAX_THREADS;
+    }
+
+    // A repair replays the journal first and checks the last committed state, a check alone writes nothing
+    pennfat *fat = loadFat(fileName, false, !repair);
+    if (fat == NULL) {
+        return -1;
+    }
+    if (!repair) {
+        int pending = pendingJournal(fat->fd, fat->journal->offset);
+        if (pending == -1) {
+            freeFat(&fat);
+            return -1;
+        }
+        if (pending == 1) {
+            printf("The journal holds a committed transaction not in place yet, checking the image without it; a repair replays it.\n");
+        }
+    }
+
+    fsckState state;
+    memset(&state, 0, sizeof(fsckState));
+    state.fat = fat;
+    state.limit = blockLimit(fat);
+    state.checkData = checkData && fat->sums != NULL;
+    if (checkData && fat->sums == NULL) {
+        printf("%s has no block checksums, only the chains are checked.\n", fileName);
+    }
+    state.refs = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state.links = malloc((size_t) fat->numEntries * sizeof(uint32_t));
+    state.badSums = calloc(fat->numEntries / 64 + 1, sizeof(uint64_t));
+    if (state.refs == NULL || state.links == NULL || state.badSums == NULL) {
+        perror("ERROR: Fail to malloc the block references.");
+        free(state.refs);
+        free(state.links);
+        free(state.badSums);
+        freeFat(&fat);
+        return -1;
+    }
+
+    int result = 0;
+    for (int pass = 1; pass <= FSCK_MAX_PASSES; pass++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        char *rootPath = strdup("/");
+        if (rootPath == NULL || addChain(&state, NULL, rootPath, 1) == -1 || collectDirectory(&state, fat->root, "/") == -1) {
+            free(rootPath);
+            result = -1;
+            break;
+        }
+        state.chains[0].subtreeEnd = state.numChains;
+
+        memset(state.refs, 0, (size_t) fat->numEntries * sizeof(uint32_t));
+        memset(state.links, 0, (size_t) fat->numEntries * sizeof(uint32_t));
+        state.nextChain = 0;
+        runThreads(walkChains, &state, numThreads);
+        state.nextChain = 0;
+        state.nextBlock = 0;
+        state.leaked = 0;
+        state.badLinks = 0;
+        runThreads(crossCheck, &state, numThreads);
+        memset(state.badSums, 0, (size_t) (fat->numEntries / 64 + 1) * sizeof(uint64_t));
+        state.sumErrors = 0;
+        if (state.checkData) {
+            state.nextBlock = 0;
+            runThreads(checkSums, &state, numThreads);
+        }
+        if (state.readFailed) {
+            result = -1;
+            break;
+        }
+
+        uint64_t used = 0;
+        for (uint32_t c = 0; c < state.numChains; c++) {
+            used += state.chains[c].length;
+        }
+        uint32_t problems = reportProblems(&state);
+        printf("Pass %d: %u files in %llu blocks, %u problems, checked with %d threads in %.1f ms.\n", pass, state.numChains, (unsigned long long) used, problems,
+               numThreads, elapsedMs(&start));
+
+        result = problems;
+        if (problems == 0 || !repair) {
+            break;
+        }
+        if (repairImage(&state) == -1) {
+            result = -1;
+            break;
+        }
+        freeChains(&state);
+    }
+
+    freeChains(&state);
+    free(state.refs);
+    free(state.links);
+    free(state.badSums);
+    freeFat(&fat);
+    return result;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+#define FSCK_MAX_THREADS 64   // Walker threads at most
+#define FSCK_CHAIN_BATCH 64   // Chains a thread takes from the shared counter at once
+#define FSCK_BLOCK_BATCH 4096 // FAT entries a thread scans for leaks at once
+#define FSCK_SUM_BATCH 64     // Data blocks a thread reads at once to check their checksums
+#define FSCK_MAX_PASSES 8     // Check and repair rounds, a repaired directory is only read in the next one
+
+/* ------------------------------------------------------------------------
+----------------------------- Consistency Check ---------------------------
+------------------------------------------------------------------------*/
+
+int fsckImage(char *fileName, bool repair, bool checkData, int numThreads); // Check an unmounted image, its data blocks too if asked, repairing it if asked, 0 threads being one per CPU; returns the problems left, -1 on error
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+fsckImage           Done
+*/
@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "io.h"
+
+// Move what is left of a request with plain pread/pwrite, from done bytes on
+static int finishRequest(int fd, ioRequest *request, uint32_t done, bool writing) {
+    int calls = 0;
+    while (done < request->count) {
+        ssize_t n = writing ? pwrite(fd, request->buf + done, request->count - done, request->offset + done)
+                            : pread(fd, request->buf + done, request->count - done, request->offset + done);
+        calls++;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0 && !writing) {
+            // Past the end of the image
+            memset(request->buf + done, 0, request->count - done);
+            break;
+        }
+        done += n;
+    }
+    return calls;
+}
+
+/* ------------------------------------------------------------------------
+------------------------------ preadv Backend -----------------------------
+------------------------------------------------------------------------*/
+
+// One preadv/pwritev per group of requests that follow each other in the image
+static int syncSubmit(ioBackend *io, int fd, ioRequest *requests, uint32_t count, bool writing) {
+    (void) io;
+    struct iovec iov[IO_QUEUE_DEPTH];
+    int calls = 0;
+
+    uint32_t first = 0;
+    while (first < count) {
+        uint32_t last = first + 1;
+        off_t end = requests[first].offset + requests[first].count;
+        while (last < count && last - first < IO_QUEUE_DEPTH && requests[last].offset == end) {
+            end += requests[last].count;
+            last++;
+        }
+
+        size_t total = 0;
+        for (uint32_t i = first; i < last; i++) {
+            iov[i - first].iov_base = requests[i].buf;
+            iov[i - first].iov_len = requests[i].count;
+            total += requests[i].count;
+        }
+
+        ssize_t n;
+        do {
+            n = writing ? pwritev(fd, iov, last - first, requests[first].offset) : preadv(fd, iov, last - first, requests[first].offset);
+            calls++;
+        } while (n == -1 && errno == EINTR);
+        if (n == -1) {
+            return -1;
+        }
+
+        // A short transfer ends request by request
+        if ((size_t) n < total) {
+            for (uint32_t i = first; i < last; i++) {
+                uint32_t done = (size_t) n > requests[i].count ? requests[i].count : n;
+                n -= done;
+                int more = finishRequest(fd, &requests[i], done, writing);
+                if (more == -1) {
+                    return -1;
+                }
+                calls += more;
+            }
+        }
+        first = last;
+    }
+
+    return calls;
+}
+
+static void syncDestroy(ioBackend *io) { (void) io; }
+
+/* ------------------------------------------------------------------------
+----------------------------- io_uring Backend ----------------------------
+------------------------------------------------------------------------*/
+
+// Rings shared with the kernel
+typedef struct uringState {
+    int ringFd;
+    uint32_t entries; // Submission queue length
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+} uringState;
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) { return syscall(__NR_io_uring_setup, entries, params); }
+
+static int uringEnter(int ringFd, unsigned toSubmit, unsigned minComplete) { return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0); }
+
+static void uringDestroy(ioBackend *io) {
+    uringState *state = io->state;
+    if (state == NULL) {
+        return;
+    }
+
+    if (state->sqes != NULL && state->sqes != MAP_FAILED)
+        munmap(state->sqes, state->sqesSize);
+    if (state->cqRing != NULL && state->cqRing != MAP_FAILED && state->cqRing != state->sqRing)
+        munmap(state->cqRing, state->cqRingSize);
+    if (state->sqRing != NULL && state->sqRing != MAP_FAILED)
+        munmap(state->sqRing, state->sqRingSize);
+    close(state->ringFd);
+    free(state);
+    io->state = NULL;
+}
+
+// Take back the entries the kernel did not consume and wait for the ones it did, whose buffers the caller gets back
+static void drainUring(uringState *state, uint32_t inFlight) {
+    __atomic_store_n(state->sqTail, __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+
+    while (inFlight > 0) {
+        unsigned head = *state->cqHead;
+        while (inFlight > 0 && head != __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE)) {
+            head++;
+            inFlight--;
+        }
+        __atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+
+        if (inFlight > 0 && uringEnter(state->ringFd, 0, inFlight) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return;
+        }
+    }
+}
+
+// Queue up to the ring length of requests, then wait for all of them before the next group
+static int uringSubmit(ioBackend *io, int fd, ioRequest *requests, uint32_t count, bool writing) {
+    uringState *state = io->state;
+    int calls = 0;
+    int failed = 0; // errno of the first failed request
+
+    for (uint32_t first = 0; first < count; first += state->entries) {
+        uint32_t batch = count - first < state->entries ? count - first : state->entries;
+
+        unsigned tail = *state->sqTail;
+        for (uint32_t i = 0; i < batch; i++) {
+            ioRequest *request = &requests[first + i];
+            unsigned slot = tail & *state->sqMask;
+            struct io_uring_sqe *sqe = &state->sqes[slot];
+
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t) (uintptr_t) request->buf;
+            sqe->len = request->count;
+            sqe->off = request->offset;
+            sqe->user_data = first + i;
+
+            state->sqArray[slot] = slot;
+            tail++;
+        }
+        __atomic_store_n(state->sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit the group and reap its completions
+        uint32_t submitted = 0;
+        uint32_t completed = 0;
+        while (completed < batch) {
+            int n = uringEnter(state->ringFd, batch - submitted, batch - completed);
+            calls++;
+            if (n == -1) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                int error = errno;
+                drainUring(state, submitted - completed);
+                errno = error;
+                return -1;
+            }
+            submitted += n;
+
+            unsigned head = *state->cqHead;
+            while (head != __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+                ioRequest *request = &requests[cqe->user_data];
+                head++;
+                completed++;
+
+                // Opcodes unknown to an old kernel and short transfers end synchronously, errors wait for the whole group
+                uint32_t done = cqe->res < 0 ? 0 : cqe->res;
+                if (cqe->res < 0 && cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP && cqe->res != -EAGAIN) {
+                    failed = -cqe->res;
+                } else if (done < request->count && (cqe->res != 0 || writing)) {
+                    int more = failed ? 0 : finishRequest(fd, request, done, writing);
+                    if (more == -1) {
+                        failed = errno;
+                    }
+                    calls += more == -1 ? 0 : more;
+                } else if (done < request->count) {
+                    // Past the end of the image
+                    memset(request->buf, 0, request->count);
+                }
+            }
+            __atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        if (failed) {
+            errno = failed;
+            return -1;
+        }
+    }
+
+    return calls;
+}
+
+// Set up the rings, NULL when io_uring is missing or forbidden
+static uringState *initUring() {
+    uringState *state = calloc(1, sizeof(uringState));
+    if (state == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    state->ringFd = uringSetup(IO_QUEUE_DEPTH, &params);
+    if (state->ringFd == -1) {
+        free(state);
+        return NULL;
+    }
+    state->entries = params.sq_entries;
+
+    state->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    state->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqRingSize > state->sqRingSize)
+            state->sqRingSize = state->cqRingSize;
+        state->cqRingSize = state->sqRingSize;
+    }
+
+    ioBackend io = {.state = state};
+    state->sqRing = mmap(NULL, state->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ringFd, IORING_OFF_SQ_RING);
+    if (state->sqRing == MAP_FAILED) {
+        uringDestroy(&io);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqRing = state->sqRing;
+    } else {
+        state->cqRing = mmap(NULL, state->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ringFd, IORING_OFF_CQ_RING);
+        if (state->cqRing == MAP_FAILED) {
+            uringDestroy(&io);
+            return NULL;
+        }
+    }
+    state->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->ringFd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        uringDestroy(&io);
+        return NULL;
+    }
+
+    uint8_t *sq = state->sqRing;
+    uint8_t *cq = state->cqRing;
+    state->sqHead = (unsigned *) (sq + params.sq_off.head);
+    state->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    state->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    state->sqArray = (unsigned *) (sq + params.sq_off.array);
+    state->cqHead = (unsigned *) (cq + params.cq_off.head);
+    state->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    state->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return state;
+}
+
+ioBackend *initIoBackend(char *name) {
+    if (name != NULL && strcmp(name, "uring") != 0 && strcmp(name, "sync") != 0) {
+        printf("ERROR: Unknown I/O backend %s, use uring or sync.\n", name);
+        return NULL;
+    }
+
+    ioBackend *io = malloc(sizeof(ioBackend));
+    if (io == NULL) {
+        perror("ERROR: Fail to malloc the I/O backend.");
+        return NULL;
+    }
+
+    // Fall back to preadv when the kernel has no io_uring or it is disabled
+    io->state = NULL;
+    if (name == NULL || strcmp(name, "uring") == 0) {
+        io->state = initUring();
+        if (io->state == NULL && name != NULL) {
+            printf("WARNING: io_uring is unavailable, using preadv.\n");
+        }
+    }
+
+    if (io->state != NULL) {
+        io->name = "uring";
+        io->submit = uringSubmit;
+        io->destroy = uringDestroy;
+    } else {
+        io->name = "sync";
+        io->submit = syncSubmit;
+        io->destroy = syncDestroy;
+    }
+
+    return io;
+}
+
+void freeIoBackend(ioBackend **io) {
+    if (*io == NULL) {
+        return;
+    }
+
+    (*io)->destroy(*io);
+    free(*io);
+    *io = NULL;
+}
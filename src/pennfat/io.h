@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define IO_QUEUE_DEPTH 64 // Requests in flight at once with io_uring
+
+/* ------------------------------------------------------------------------
+-------------------------------- I/O Backend ------------------------------
+------------------------------------------------------------------------*/
+
+// One contiguous transfer between a buffer and the image
+typedef struct ioRequest {
+    uint8_t *buf;
+    uint32_t count;
+    off_t offset;
+} ioRequest;
+
+// Way block transfers reach the image, chosen at mount
+typedef struct ioBackend {
+    const char *name;
+
+    // Do every request of the batch, reads past the end of the image give zeros; returns the syscall number, -1 on error
+    int (*submit)(struct ioBackend *io, int fd, ioRequest *requests, uint32_t count, bool writing);
+    void (*destroy)(struct ioBackend *io);
+    void *state; // Backend private data
+} ioBackend;
+
+ioBackend *initIoBackend(char *name); // "uring" or "sync", NULL picks io_uring when the kernel allows it
+void freeIoBackend(ioBackend **io);
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+initIoBackend       Done
+freeIoBackend       Done
+*/
@@ -0,0 +1,382 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "journal.h"
+#include "reflink.h"
+
+// Only metadata goes through the journal: the FAT, the directory slots, the block checksums and the
+// link counts reach their home locations once the transaction holding them is on disk, data blocks
+// are written in place
+
+// FNV-1a over the transaction, the checksum field itself counts as zero
+static uint32_t journalChecksum(uint8_t *bytes, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t byte = i >= offsetof(journalHeader, checksum) && i < offsetof(journalHeader, checksum) + sizeof(uint32_t) ? 0 : bytes[i];
+        hash ^= byte;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int pwriteAll(int fd, uint8_t *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pwrite(fd, buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int preadAll(int fd, uint8_t *buf, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fd, buf + done, count - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int syncImage(pennfat *fat) {
+    fat->journal->syncs++;
+    if (fdatasync(fat->fd) == -1) {
+        perror("ERROR: Fail to sync the image.");
+        return -1;
+    }
+    return 0;
+}
+
+// Mark the journal region empty
+static int clearJournal(int fd, off_t offset) {
+    journalHeader header;
+    memset(&header, 0, sizeof(journalHeader));
+    if (pwriteAll(fd, (uint8_t *) &header, sizeof(journalHeader), offset) == -1 || fdatasync(fd) == -1) {
+        perror("ERROR: Fail to clear the journal.");
+        return -1;
+    }
+    return 0;
+}
+
+journal *initJournal(pennfat *fat, bool creating) {
+    journal *newJournal = malloc(sizeof(journal));
+    if (newJournal == NULL) {
+        perror("ERROR: Fail to malloc the journal.");
+        return NULL;
+    }
+
+    newJournal->offset = (off_t) fat->totalBlocks * fat->blockSize + (off_t) (fat->numEntries - 1) * fat->blockSize;
+    newJournal->capacity = fat->blockSize;
+    newJournal->buffer = malloc(newJournal->capacity);
+    newJournal->committed = calloc(fat->numEntries, sizeof(uint32_t));
+    newJournal->freed = calloc((fat->numEntries + 63) / 64, sizeof(uint64_t));
+    if (newJournal->buffer == NULL || newJournal->committed == NULL || newJournal->freed == NULL) {
+        perror("ERROR: Fail to malloc the journal.");
+        free(newJournal->buffer);
+        free(newJournal->committed);
+        free(newJournal->freed);
+        free(newJournal);
+        return NULL;
+    }
+
+    // The FAT in memory is what the image holds once replayed, a new image holds nothing until the first commit
+    if (!creating) {
+        memcpy(newJournal->committed, fat->blocks, (size_t) fat->numEntries * sizeof(uint32_t));
+    }
+    newJournal->numFreed = 0;
+    newJournal->length = sizeof(journalHeader);
+    newJournal->count = 0;
+    newJournal->sequence = 1;
+    newJournal->ops = 0;
+    newJournal->committing = false;
+    newJournal->commits = 0;
+    newJournal->syncs = 0;
+
+    return newJournal;
+}
+
+void freeJournal(journal **journal) {
+    if (*journal == NULL) {
+        return;
+    }
+
+    free((*journal)->buffer);
+    free((*journal)->committed);
+    free((*journal)->freed);
+    free(*journal);
+    *journal = NULL;
+}
+
+// Read the transaction of the journal region; returns 1 and the transaction for a committed one, 0 when there is none, -1 on error
+static int readTransaction(int fd, off_t offset, uint8_t **transaction, bool *torn) {
+    *transaction = NULL;
+    *torn = false;
+
+    journalHeader header;
+    if (preadAll(fd, (uint8_t *) &header, sizeof(journalHeader), offset) == -1 || header.magic != JOURNAL_MAGIC) {
+        // No journal yet, or an empty one
+        return 0;
+    }
+
+    if (header.length < sizeof(journalHeader)) {
+        return 0;
+    }
+    uint8_t *buffer = malloc(header.length);
+    if (buffer == NULL) {
+        perror("ERROR: Fail to malloc the journal.");
+        return -1;
+    }
+
+    // A torn transaction never committed, the home locations still hold the previous state
+    if (preadAll(fd, buffer, header.length, offset) == -1 || journalChecksum(buffer, header.length) != header.checksum) {
+        #ifdef DEBUGGING
+            printf("Found the torn transaction %llu\n", (unsigned long long) header.sequence);
+        #endif
+        free(buffer);
+        *torn = true;
+        return 0;
+    }
+
+    *transaction = buffer;
+    return 1;
+}
+
+int pendingJournal(int fd, off_t offset) {
+    uint8_t *buffer;
+    bool torn;
+    int found = readTransaction(fd, offset, &buffer, &torn);
+    if (found != 1) {
+        return found;
+    }
+
+    // The last transaction stays in the journal after its checkpoint, it only waits when a home location differs
+    journalHeader header;
+    memcpy(&header, buffer, sizeof(journalHeader));
+    int pending = 0;
+    uint32_t position = sizeof(journalHeader);
+    for (uint32_t i = 0; i < header.count && pending == 0; i++) {
+        journalRecord *record = (journalRecord *) &buffer[position];
+        position += sizeof(journalRecord);
+        if (position + record->length > header.length) {
+            break;
+        }
+
+        uint8_t *home = malloc(record->length);
+        if (home == NULL) {
+            perror("ERROR: Fail to malloc the journal record.");
+            pending = -1;
+        } else if (preadAll(fd, home, record->length, record->offset) == -1 || memcmp(home, &buffer[position], record->length) != 0) {
+            pending = 1;
+        }
+        free(home);
+        position += record->length;
+    }
+    free(buffer);
+    return pending;
+}
+
+int replayJournal(int fd, off_t offset) {
+    uint8_t *buffer;
+    bool torn;
+    int found = readTransaction(fd, offset, &buffer, &torn);
+    if (found != 1) {
+        return found == 0 && torn ? clearJournal(fd, offset) : found;
+    }
+    journalHeader header;
+    memcpy(&header, buffer, sizeof(journalHeader));
+
+    // Redo every record, doing it twice is harmless
+    uint32_t position = sizeof(journalHeader);
+    for (uint32_t i = 0; i < header.count; i++) {
+        journalRecord *record = (journalRecord *) &buffer[position];
+        position += sizeof(journalRecord);
+        if (position + record->length > header.length) {
+            break;
+        }
+
+        if (pwriteAll(fd, &buffer[position], record->length, record->offset) == -1) {
+            perror("ERROR: Fail to replay the journal.");
+            free(buffer);
+            return -1;
+        }
+        position += record->length;
+    }
+    free(buffer);
+
+    #ifdef DEBUGGING
+        printf("Replayed the transaction %llu with %u records\n", (unsigned long long) header.sequence, header.count);
+    #endif
+
+    if (fdatasync(fd) == -1) {
+        perror("ERROR: Fail to sync the image.");
+        return -1;
+    }
+    return clearJournal(fd, offset);
+}
+
+int journalWrite(pennfat *fat, off_t offset, void *bytes, uint32_t len) {
+    journal *journal = fat->journal;
+
+    uint32_t needed = journal->length + sizeof(journalRecord) + len;
+    if (needed > journal->capacity) {
+        uint32_t newCap = journal->capacity;
+        while (newCap < needed) {
+            newCap *= 2;
+        }
+        uint8_t *newBuffer = realloc(journal->buffer, newCap);
+        if (newBuffer == NULL) {
+            perror("ERROR: Fail to malloc the journal.");
+            return -1;
+        }
+        journal->buffer = newBuffer;
+        journal->capacity = newCap;
+    }
+
+    journalRecord record = {.offset = offset, .length = len, .reserved = 0};
+    memcpy(&journal->buffer[journal->length], &record, sizeof(journalRecord));
+    memcpy(&journal->buffer[journal->length + sizeof(journalRecord)], bytes, len);
+    journal->length = needed;
+    journal->count++;
+    return 0;
+}
+
+// Write every record of the committed transaction to its home location
+static int checkpoint(pennfat *fat) {
+    journal *journal = fat->journal;
+
+    uint32_t position = sizeof(journalHeader);
+    for (uint32_t i = 0; i < journal->count; i++) {
+        journalRecord *record = (journalRecord *) &journal->buffer[position];
+        position += sizeof(journalRecord);
+        if (pwriteAll(fat->fd, &journal->buffer[position], record->length, record->offset) == -1) {
+            perror("ERROR: Fail to checkpoint the journal.");
+            return -1;
+        }
+        fat->writes++;
+        position += record->length;
+    }
+
+    return 0;
+}
+
+static uint64_t elapsedMs(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+int journalCommit(pennfat *fat, bool force) {
+    journal *journal = fat->journal;
+    if (journal == NULL || journal->committing) {
+        return 0;
+    }
+
+    // Let the group grow until it is big or old enough
+    if (!force) {
+        if (journal->ops++ == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &journal->since);
+        }
+        if (journal->ops < JOURNAL_GROUP_OPS && elapsedMs(&journal->since) < JOURNAL_GROUP_MS) {
+            return 0;
+        }
+    }
+    journal->ops = 0;
+    journal->committing = true;
+
+    // Directory slots first, growing the directory may change the FAT
+    journal->length = sizeof(journalHeader);
+    journal->count = 0;
+    if (writeDirEntries(fat) == -1) {
+        journal->committing = false;
+        return -1;
+    }
+
+    // Then every changed chunk of the FAT, in its on-disk width
+    uint8_t chunk[JOURNAL_FAT_CHUNK * sizeof(uint32_t)];
+    for (uint32_t i = 0; i < fat->numEntries; i += JOURNAL_FAT_CHUNK) {
+        uint32_t count = fat->numEntries - i < JOURNAL_FAT_CHUNK ? fat->numEntries - i : JOURNAL_FAT_CHUNK;
+        if (memcmp(&fat->blocks[i], &journal->committed[i], count * sizeof(uint32_t)) == 0) {
+            continue;
+        }
+
+        encodeFat(fat, i, count, chunk);
+        if (journalWrite(fat, (off_t) i * fatEntrySize(fat), chunk, count * fatEntrySize(fat)) == -1) {
+            journal->committing = false;
+            return -1;
+        }
+    }
+
+    // And the checksums of the blocks written and the link counts changed since the last commit
+    if (journalSums(fat) == -1 || journalRefs(fat) == -1) {
+        journal->committing = false;
+        return -1;
+    }
+
+    // Nothing changed since the last commit, the blocks released before it are not linked anymore
+    if (journal->count == 0) {
+        releasePending(fat);
+        journal->committing = false;
+        return 0;
+    }
+
+    journalHeader *header = (journalHeader *) journal->buffer;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = journal->sequence;
+    header->length = journal->length;
+    header->count = journal->count;
+    header->checksum = journalChecksum(journal->buffer, journal->length);
+
+    // The data written so far and the previous checkpoint reach the disk before this transaction replaces it
+    int result = -1;
+    if (syncImage(fat) == 0) {
+        if (pwriteAll(fat->fd, journal->buffer, journal->length, journal->offset) == -1) {
+            perror("ERROR: Fail to write the journal.");
+        } else if (syncImage(fat) == 0 && checkpoint(fat) == 0) {
+            // Committed, a crash from here on replays it at the next mount
+            fat->writes++;
+            memcpy(journal->committed, fat->blocks, (size_t) fat->numEntries * sizeof(uint32_t));
+            commitSums(fat->sums);
+            commitRefs(fat->refs);
+            releasePending(fat);
+            journal->sequence++;
+            journal->commits++;
+            result = 0;
+        }
+    }
+
+    journal->committing = false;
+    return result;
+}
+
+int closeJournal(pennfat *fat) {
+    if (fat->journal == NULL) {
+        return 0;
+    }
+
+    if (journalCommit(fat, true) == -1) {
+        return -1;
+    }
+
+    // Every transaction is home once synced
+    if (fat->journal->commits > 0 && syncImage(fat) == -1) {
+        return -1;
+    }
+    return fat->journal->commits > 0 ? clearJournal(fat->fd, fat->journal->offset) : 0;
+}
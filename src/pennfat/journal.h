@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_GROUP_OPS 32     // Saves grouped into one commit at most
+#define JOURNAL_GROUP_MS 1000    // Age of the oldest grouped save that forces a commit at the next save, syncFat commits sooner when idle
+#define JOURNAL_FAT_CHUNK 64     // FAT entries per FAT record
+
+/* ------------------------------------------------------------------------
+------------------------------ Metadata Journal ---------------------------
+------------------------------------------------------------------------*/
+
+// Start of a committed transaction in the journal region
+typedef struct journalHeader {
+    uint32_t magic;    // JOURNAL_MAGIC, anything else means no transaction
+    uint32_t checksum; // FNV-1a of the transaction with this field zeroed
+    uint64_t sequence; // Transaction number
+    uint32_t length;   // Bytes of the transaction, header included
+    uint32_t count;    // Record number
+} journalHeader;
+
+// Redo record, followed by length bytes to write at offset in the image
+typedef struct journalRecord {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+} journalRecord;
+
+// Metadata changes not yet on disk, committed in groups
+typedef struct journal {
+    off_t offset;        // Byte offset of the journal region, right after the data region
+    uint8_t *buffer;     // Transaction being built, header first
+    uint32_t length;     // Bytes used in buffer
+    uint32_t capacity;   // Allocated length of buffer
+    uint32_t count;      // Records in buffer
+    uint64_t sequence;   // Number of the next transaction
+    uint32_t *committed; // FAT as of the last commit
+    uint64_t *freed;     // Bitmap of the blocks released since then that the committed FAT links to, still taken
+    uint32_t numFreed;   // Blocks in freed
+
+    uint32_t ops;          // Saves since the last commit
+    struct timespec since; // Time of the first of them
+    bool committing;       // Inside journalCommit
+
+    uint64_t commits; // Transactions committed since mount
+    uint64_t syncs;   // fdatasync calls since mount
+} journal;
+
+struct pennfat;
+
+journal *initJournal(struct pennfat *fat, bool creating);                     // Start journaling from the FAT in memory, or from an all-zero one for a new image
+void freeJournal(journal **journal);
+int replayJournal(int fd, off_t offset);                                      // Redo a committed transaction left by a crash
+int pendingJournal(int fd, off_t offset);                                     // 1 when a committed transaction is not fully in place yet, 0 otherwise, -1 on error
+int journalWrite(struct pennfat *fat, off_t offset, void *bytes, uint32_t len); // Add a metadata write to the transaction
+int journalCommit(struct pennfat *fat, bool force);                           // Commit the group, unless it may still grow
+int closeJournal(struct pennfat *fat);                                        // Commit everything and mark the journal empty
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+initJournal         Done
+freeJournal         Done
+replayJournal       Done
+pendingJournal      Done
+journalWrite        Done
+journalCommit       Done
+closeJournal        Done
+*/
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 
 #include "../pennos/process_control.h"
 #include "../pennos/scheduler.h"
@@ -24,22 +25,56 @@ int fsCommandHandler(char **commands, int commandCount, pennfat **fat) {
             writeHelper("**** mkfs func ****\n");
         #endif
         if (commands[1] == NULL || commands[2] == NULL || commands[3] == NULL) {
-            printf("INPUT FORMAT: [mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG].\n");
+            printf("INPUT FORMAT: [mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG [ -32 ] [ -s ] [ -r ]].\n");
             return result;
         }
 
-        result = pennfatMkfs(commands[1], (char) atoi(commands[2]), (char) atoi(commands[3]), fat);
+        // -32 makes the 32-bit FAT, which may span more FAT blocks; -s keeps a checksum of every data block;
+        // -r keeps the link table that lets cp share blocks between copies
+        bool wide = false;
+        bool checksums = false;
+        bool reflinks = false;
+        for (int i = 4; commands[i] != NULL; i++) {
+            if (strcmp(commands[i], "-32") == 0) {
+                wide = true;
+            } else if (strcmp(commands[i], "-s") == 0) {
+                checksums = true;
+            } else if (strcmp(commands[i], "-r") == 0) {
+                reflinks = true;
+            } else {
+                printf("INPUT FORMAT: [mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG [ -32 ] [ -s ] [ -r ]].\n");
+                return result;
+            }
+        }
+
+        result = pennfatMkfs(commands[1], atoi(commands[2]), (char) atoi(commands[3]), wide, checksums, reflinks, fat);
     } else if (strcmp(command, "mount") == 0) { // mount
         #ifdef DEBUGGING
             writeHelper("**** mount func ****\n");
         #endif
         // Check input format
         if (commands[1] == NULL) {
-            printf("INPUT FORMAT: [mount FS_NAME].\n");
+            printf("INPUT FORMAT: [mount FS_NAME [ -m ] [ -c CACHE_BLOCKS ] [ -i uring|sync ]].\n");
             return result;
         }
 
-        result = pennfatMount(commands[1], fat);
+        // -m maps the whole image, not only the FAT; -c sets the block cache capacity; -i picks the I/O backend
+        bool mapImage = false;
+        int cacheBlocks = -1;
+        char *ioBackend = NULL;
+        for (int i = 2; commands[i] != NULL; i++) {
+            if (strcmp(commands[i], "-m") == 0) {
+                mapImage = true;
+            } else if (strcmp(commands[i], "-c") == 0 && commands[i + 1] != NULL) {
+                cacheBlocks = atoi(commands[++i]);
+            } else if (strcmp(commands[i], "-i") == 0 && commands[i + 1] != NULL) {
+                ioBackend = commands[++i];
+            } else {
+                printf("INPUT FORMAT: [mount FS_NAME [ -m ] [ -c CACHE_BLOCKS ] [ -i uring|sync ]].\n");
+                return result;
+            }
+        }
+        result = pennfatMount(commands[1], mapImage, cacheBlocks, ioBackend, fat);
         #ifdef DEBUGGING
             writeHelper("Mounted fat's name is ");
             writeHelper(commands[1]);
@@ -153,7 +188,23 @@ int fsCommandHandler(char **commands, int commandCount, pennfat **fat) {
             writeHelper("ERROR: No mounted FAT.\n");
             return -1;
         }
-        result = pennfatLs(*fat);
+        result = pennfatLs(commands[1], *fat);
+    } else if (strcmp(command, "cd") == 0) { // cd
+        #ifdef DEBUGGING
+            writeHelper("**** cd func ****\n");
+        #endif
+        result = pennfatCd(commands[1], *fat);
+    } else if (strcmp(command, "mkdir") == 0) { // mkdir
+        #ifdef DEBUGGING
+            writeHelper("**** mkdir func ****\n");
+        #endif
+        // Check input format
+        if (commands[1] == NULL) {
+            printf("INPUT FORMAT: [mkdir DIR ...].\n");
+            return -1;
+        }
+
+        result = pennfatMkdir(commands, *fat);
     } else if (strcmp(command, "chmod") == 0) { //chmod
         #ifdef DEBUGGING
             writeHelper("**** chmod func ****\n");
@@ -183,6 +234,55 @@ int fsCommandHandler(char **commands, int commandCount, pennfat **fat) {
         }
 
         result = pennfatChmod(commands, perm, *fat);
+    } else if (strcmp(command, "truncate") == 0) { // truncate
+        #ifdef DEBUGGING
+            writeHelper("**** truncate func ****\n");
+        #endif
+        // Check input format
+        char *end = NULL;
+        unsigned long long size = commands[1] == NULL || commands[2] == NULL ? 0 : strtoull(commands[2], &end, 10);
+        if (end == NULL || *end != '\0' || commands[2][0] == '-') {
+            printf("INPUT FORMAT: [truncate FILE SIZE].\n");
+            return -1;
+        }
+
+        result = pennfatTruncate(commands[1], size, *fat);
+    } else if (strcmp(command, "defrag") == 0) { // defrag
+        #ifdef DEBUGGING
+            writeHelper("**** defrag func ****\n");
+        #endif
+        if (fat == NULL) {
+            writeHelper("ERROR: No mounted FAT.\n");
+            return -1;
+        }
+        result = pennfatDefrag(*fat);
+    } else if (strcmp(command, "fsck") == 0) { // fsck
+        #ifdef DEBUGGING
+            writeHelper("**** fsck func ****\n");
+        #endif
+        // -r repairs what the check finds; -s checks the data blocks against their checksums too, and with -r
+        // rebuilds the ones that do not match; -t sets the walker threads, one per CPU by default
+        bool repair = false;
+        bool checkData = false;
+        int numThreads = 0;
+        bool valid = commands[1] != NULL;
+        for (int i = 2; valid && commands[i] != NULL; i++) {
+            if (strcmp(commands[i], "-r") == 0) {
+                repair = true;
+            } else if (strcmp(commands[i], "-s") == 0) {
+                checkData = true;
+            } else if (strcmp(commands[i], "-t") == 0 && commands[i + 1] != NULL && atoi(commands[i + 1]) > 0) {
+                numThreads = atoi(commands[++i]);
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            printf("INPUT FORMAT: [fsck FS_NAME [ -r ] [ -s ] [ -t THREADS ]].\n");
+            return -1;
+        }
+
+        result = pennfatFsck(commands[1], repair, checkData, numThreads, fat == NULL ? NULL : *fat);
     } else if (strcmp(command, "show") == 0){
         result = pennfatShow(*fat);
     } else {
@@ -225,6 +325,12 @@ int main() {
 
     // interactive mode
     while (1) {
+        // Nothing typed ahead, the grouped changes go to the image instead of waiting for the next command
+        struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+        if (currFat != NULL && poll(&input, 1, 0) == 0) {
+            syncFat(currFat);
+        }
+
         // prompt the user and get their inputs
         writeHelper("pennfat# ");
         
@@ -252,6 +358,9 @@ int main() {
             fsCommandHandler(cmd_args, num_commands, &currFat);
         }
     }
+
+    // Commit what is left in the journal
+    exitGracefully(SUCCESS, currFat);
 }
 
 /* PROGRESS NOTES:
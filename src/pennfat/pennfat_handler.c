@@ -11,12 +11,13 @@
 #include "pennfat_handler.h"
 #include "utils.h"
 
-int pennfatMkfs(char *fileName, uint8_t numBlocks, uint8_t blockSizeIndex, pennfat **fat) {
+int pennfatMkfs(char *fileName, uint32_t numBlocks, uint8_t blockSizeIndex, bool wide, bool checksums, bool reflinks, pennfat **fat) {
     if (fat != NULL) {
+        closeFatFiles(*fat);
         freeFat(fat);
     }
 
-    *fat = initFat(fileName, numBlocks, blockSizeIndex, true);
+    *fat = initFat(fileName, numBlocks, blockSizeIndex, wide, checksums, reflinks, true, false, false);
     if (*fat == NULL) {
         printf("ERROR: Fail to initialize FAT.\n");
         return -1;
@@ -25,8 +26,9 @@ int pennfatMkfs(char *fileName, uint8_t numBlocks, uint8_t blockSizeIndex, pennf
     return 0;
 }
 
-int pennfatMount(char *fileName, pennfat **fat) {
+int pennfatMount(char *fileName, bool mapImage, int cacheBlocks, char *ioBackend, pennfat **fat) {
     if (*fat != NULL) {
+        closeFatFiles(*fat);
         freeFat(fat);
     }
     
@@ -36,18 +38,30 @@ int pennfatMount(char *fileName, pennfat **fat) {
         writeHelper("\n");
     #endif
 
-    *fat = loadFat(fileName);
+    *fat = loadFat(fileName, mapImage, false);
 
     if (*fat == NULL) {
         printf("ERROR: Fail to load FAT.\n");
         return -1;
     }
 
+    // Resize the block cache if asked
+    if (cacheBlocks >= 0 && setCacheCapacity(*fat, cacheBlocks) == -1) {
+        printf("ERROR: Fail to create the block cache.\n");
+        return -1;
+    }
+
+    // Switch the I/O backend if asked
+    if (ioBackend != NULL && setIoBackend(*fat, ioBackend) == -1) {
+        return -1;
+    }
+
     return 0;
 }
 
 int pennfatUnmount(pennfat **fat) {
     saveFat(*fat);
+    closeFatFiles(*fat);
     freeFat(fat);
     return 0;
 }
@@ -100,48 +114,42 @@ int pennfatCat(char **commands, int count, pennfat *fat) {
 
     // Read user input to overwiret [cat -w OUTPUT_FILE] or append [cat -a OUTPUT_FILE] the file
     if (count == 3 && (w_flag || a_flag)) {
-        // Get user input
-        char *line = NULL;
-        size_t len = 0;
-        ssize_t n;
-
         #ifdef DEBUGGING
-            printf("Reading user input...\n");
+                if (w_flag) {
+                    printf("Writing to the output file...\n");
+                } else if (a_flag) {
+                    printf("Appending to the output file...\n");
+                }
         #endif
-        n = getline(&line, &len, stdin);
+        // Empty the output for -w, create it if missing for -a
+        if (writeFile(commands[2], NULL, 0, 0, REGULAR_FILETYPE, READWRITE_PERMS, fat, a_flag, false, false) == -1) {
+            return -1;
+        }
 
-        // User input reading error handling
-        if (n == -1) {
-            if (line != NULL) {
-                free(line);
-            }
+        uint8_t *buffer = malloc(IMPORT_CHUNK_SIZE);
+        if (buffer == NULL) {
+            perror("ERROR: Fail to malloc the buffer.");
+            return -1;
+        }
 
-            if (errno == EINVAL || errno == ENOMEM) {
-                perror("ERROR: Fail to execute getline().");
-                return -1;
-            } else {
-                ssize_t numBytes = write(STDERR_FILENO, "\n", 1);
-                if (numBytes == -1) {
-                    perror("ERROR: Fail to write.");
-                    return -1;
-                }
-                // TODO: add a writeHelper which check the error when writing
+        // Read user input in large pieces until end of file, each one appended to the tail of the chain
+        size_t n;
+        while ((n = fread(buffer, 1, IMPORT_CHUNK_SIZE, stdin)) > 0) {
+            if (appendFile(commands[2], buffer, n, fat, true) == -1) {
+                free(buffer);
+                clearerr(stdin);
                 return -1;
             }
         }
+        free(buffer);
 
-        #ifdef DEBUGGING
-                if (w_flag) {
-                    printf("Writing to the output file...\n");
-                } else if (a_flag) {
-                    printf("Appending to the output file...\n");
-                }
-        #endif
-        if (writeFile(commands[2], (uint8_t *)line, 0, n, REGULAR_FILETYPE, READWRITE_PERMS, fat, a_flag, false, false) == -1) {
-            free(line);
+        // Keep reading commands after the end of the input
+        bool failed = ferror(stdin);
+        clearerr(stdin);
+        if (failed) {
+            perror("ERROR: Fail to read the input.");
             return -1;
         }
-        free(line);
     } else {
         // Concatenates the files and prints them to stdout [cat FILE ...], or overwrites [cat FILE ... -w OUTPUT_FILE], or append [cat FILE ... -a OUTPUT_FILE]
         int lastInputFile;
@@ -152,12 +160,43 @@ int pennfatCat(char **commands, int count, pennfat *fat) {
             lastInputFile = count - 1;
         }
 
-        file *files[lastInputFile];
+        // Stream each file to stdout in order, straight from the image
+        if (!w_flag && !a_flag) {
+            if (fflush(stdout) != 0) {
+                perror("ERROR: Fail to flush.");
+                return -1;
+            }
+
+            for (int i = 0; i < lastInputFile; i++) {
+                if (exportFile(commands[i + 1], STDOUT_FILENO, fat) == -1) {
+                    return -1;
+                }
+            }
+
+            return 0;
+        }
+
+        // Check every input before the output changes
+        char *outputFile = commands[count - 1];
+        dirEntryNode *outputNode;
+        getDirEntryNode(NULL, &outputNode, outputFile, fat);
         for (int i = 0; i < lastInputFile; i++) {
-            files[i] = readFile(commands[i + 1], fat);
-            if (files[i] == NULL) {
-                for (int j = 0; j < i; j++)
-                    freeFile(files[j]);
+            dirEntryNode *entryNode;
+            getDirEntryNode(NULL, &entryNode, commands[i + 1], fat);
+            if (entryNode == NULL) {
+                printf("Error: Cannot found %s.\n", commands[i + 1]);
+                return -1;
+            }
+            if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+                printf("Error: %s is a directory.\n", commands[i + 1]);
+                return -1;
+            }
+            if (entryNode->entry->perm != READWRITE_PERMS && entryNode->entry->perm != READ_PERMS) {
+                printf("Error: Lack of read permission for %s.\n", commands[i + 1]);
+                return -1;
+            }
+            if (w_flag && entryNode == outputNode) {
+                printf("ERROR: Input file %s is the output file.\n", outputFile);
                 return -1;
             }
         }
@@ -165,31 +204,36 @@ int pennfatCat(char **commands, int count, pennfat *fat) {
         #ifdef DEBUGGING
             if (w_flag) {
                 printf("Writing to the output file...\n");
-            } else if (a_flag) {
-                printf("Appending to the output file...\n");
             } else {
-                printf("Printing to stdout...\n");
+                printf("Appending to the output file...\n");
             }
         #endif
 
-        for (int i = 0; i < lastInputFile; i++) {
-            if (!w_flag && !a_flag) {
-                printf("%s", (char *)files[i]->contents);
-            } else if (i == 0 && w_flag) {
-                if (writeFile(commands[count - 1], files[i]->contents, 0, files[i]->len, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, false, false) == -1)
-                    return -1;
-            // } else {
-            //     if (writeFileToFAT(commands[count - 1], files[i]->contents, 0, files[i]->len, REGULAR_FILETYPE, READWRITE_PERMS, fat, true, false, false) == -1)
-            //         return -1;
-            }
-            freeFile(files[i]);
+        // Empty the output for -w, create it if missing for -a
+        if (writeFile(outputFile, NULL, 0, 0, REGULAR_FILETYPE, READWRITE_PERMS, fat, a_flag, false, false) == -1) {
+            return -1;
         }
 
-        // Flush the output if haven't
-        if (!w_flag && !a_flag && fflush(stdout) != 0) {
-            perror("ERROR: Fail to flush.");
+        uint8_t *buffer = malloc(EXPORT_CHUNK_SIZE);
+        if (buffer == NULL) {
+            perror("ERROR: Fail to malloc the buffer.");
             return -1;
         }
+
+        // Append the inputs chunk by chunk, up to their size when cat started
+        for (int i = 0; i < lastInputFile; i++) {
+            dirEntryNode *entryNode;
+            getDirEntryNode(NULL, &entryNode, commands[i + 1], fat);
+            uint64_t length = entryNode->entry->size;
+            for (uint64_t offset = 0; offset < length; offset += EXPORT_CHUNK_SIZE) {
+                uint32_t chunk = length - offset > EXPORT_CHUNK_SIZE ? EXPORT_CHUNK_SIZE : length - offset;
+                if (readFileAt(entryNode, buffer, offset, chunk, fat) == -1 || appendFile(outputFile, buffer, chunk, fat, true) == -1) {
+                    free(buffer);
+                    return -1;
+                }
+            }
+        }
+        free(buffer);
     }
 
     if (w_flag || a_flag) {
@@ -203,94 +247,128 @@ int pennfatCat(char **commands, int count, pennfat *fat) {
     return 0;
 }
 
+// Copy a host file into the FAT one chunk at a time, appending each chunk to the tail of the chain
+static int importHostFile(char *hostName, char *fileName, pennfat *fat) {
+    int f;
+    if ((f = open(hostName, O_RDONLY)) == -1) {
+        perror("ERROR: fail to open the file.");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(f, &st) == -1) {
+        perror("ERROR: fail to get the length of the file.");
+        close(f);
+        return -1;
+    }
+
+    // Check the space up front, the blocks a replaced file owns come back but the ones it shares with a copy stay
+    dirEntryNode *entryNode;
+    getDirEntryNode(NULL, &entryNode, fileName, fat);
+    off_t required = (st.st_size + fat->blockSize - 1) / fat->blockSize;
+    uint32_t available = fat->freeBlocks + fat->journal->numFreed;
+    if (entryNode != NULL && entryNode->entry->size != 0) {
+        uint32_t blocks = bytesToBlocks(entryNode->entry->size, fat);
+        available += blocks - sharedBlocks(entryNode, blocks - 1, fat);
+    }
+    if (required > available) {
+        printf("ERROR: Fail to find enough free blocks, %lld blocks required, %u blocks is free.\n", (long long)required, available);
+        close(f);
+        return -1;
+    }
+
+    // Start from an empty file
+    if (writeFile(fileName, NULL, 0, 0, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, false, false) == -1) {
+        close(f);
+        return -1;
+    }
+
+    uint8_t *buffer = malloc(IMPORT_CHUNK_SIZE);
+    if (buffer == NULL) {
+        perror("ERROR: Fail to malloc the buffer.");
+        close(f);
+        return -1;
+    }
+
+    posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t position = 0;
+    while (true) {
+        ssize_t bytesRead = read(f, buffer, IMPORT_CHUNK_SIZE);
+        if (bytesRead == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("ERROR: fail to read the file.");
+            break;
+        }
+        if (bytesRead == 0) {
+            free(buffer);
+            return close(f);
+        }
+        position += bytesRead;
+
+        // Let the host read the next chunk while this one goes to the image
+        posix_fadvise(f, position, IMPORT_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+
+        if (appendFile(fileName, buffer, bytesRead, fat, true) == -1) {
+            break;
+        }
+    }
+
+    // Drop the part copied so far rather than leave a short file behind
+    free(buffer);
+    close(f);
+    deleteFile(fileName, fat, true);
+    return -1;
+}
+
 int pennfatCopy(char **commands, int count, bool copyingFromHost, bool copyingToHost, pennfat *fat) {
     if (copyingFromHost) {
         #ifdef DEBUGGING
             writeHelper("Copying from host...\n");
         #endif
-        int f;
-        if ((f = open(commands[2], O_RDONLY, 0644)) == -1) {
-            perror("ERROR: fail to open the file.");
+        if (importHostFile(commands[2], commands[3], fat) == -1) {
+            printf("ERROR: Failed to copy host file %s to %s\n", commands[2], commands[3]);
             return -1;
         }
-
-        // get length of the file
-        int size = lseek(f, 0, SEEK_END);
-        if (size == -1) {
-            perror("ERROR: fail to get the length of the file.");
+        saveFat(fat);
+    } else if (copyingToHost && fat->image != NULL && fat->sums == NULL) {
+        // Write straight from the mapped image, exportFile checks the blocks of an image with checksums as it writes them
+        struct iovec *iov;
+        int iovCount = mapFile(commands[1], &iov, fat);
+        if (iovCount == -1) {
+            printf("ERROR: Fail to read the host files.\n");
             return -1;
         }
 
-        if (lseek(f, 0, SEEK_SET) == -1) {
-            perror("ERROR: fail to lseek the file.");
+        int f;
+        if ((f = open(commands[3], O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            perror("ERROR: fail to open the file.");
+            free(iov);
             return -1;
         }
 
-        // Create an empty file
-        if (size == 0) {
-            if (writeFile(commands[3], NULL, 0, size, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, false, false) == -1) {
-                printf("ERROR: Failed to copy host file %s to %s\n", commands[2], commands[3]);
-                return -1;
-            }
-        }
-
-        // Read the file
-        #ifdef DEBUGGING
-            writeHelper("Malloc the buffer in pennfatCopy\n");
-        #endif
-        uint8_t *buffer = malloc(sizeof(uint8_t) * size);
-        if (buffer == NULL) {
-            perror("ERROR: Fail to malloc the file.");
+        if (writeIovecs(f, iov, iovCount) == -1) {
+            perror("ERROR: fail to write the file.");
+            close(f);
+            free(iov);
             return -1;
         }
-
-        ssize_t bytesRead;
-        int bufIdx = 0;
-
-        #ifdef DEBUGGING
-            writeHelper("Reading all bytes in pennfatCopy\n");
-        #endif
-        // read all bytes to buffer
-        while ((bytesRead = read(f, &buffer[bufIdx], fminl(size, SSIZE_MAX))) != 0) {
-            if (bytesRead == -1) {
-                perror("ERROR: fail to read the file.");
-                free(buffer);
-                return -1;
-            }
-            bufIdx += bytesRead;
-            if (bufIdx == size)
-                break;
-        }
-
-        #ifdef DEBUGGING
-            writeHelper("Finished reading all bytes in pennfatCopy\n");
-        #endif
+        free(iov);
 
         if (close(f) == -1) {
             perror("ERROR: fail to close the file.");
-            free(buffer);
             return -1;
         }
-
-        #ifdef DEBUGGING
-            writeHelper("Writing to the file in pennfatCopy\n");
-        #endif
-        // Write to the file
-        if (writeFile(commands[3], buffer, 0, size, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, false, false) == -1) {
-            printf("Failed to copy host file %s to %s\n", commands[2], commands[3]);
-            free(buffer);
-            return -1;
-        }
-
-        free(buffer);
-        saveFat(fat);
     } else if (copyingToHost) {
         #ifdef DEBUGGING
             writeHelper("Copying to host...\n");
         #endif
-        file *file = readFile(commands[1], fat);
-        if (file == NULL) {
-            printf("ERROR: Fail to read the host files.\n");
+        // Leave the host untouched when there is nothing to copy
+        dirEntryNode *entryNode;
+        getDirEntryNode(NULL, &entryNode, commands[1], fat);
+        if (entryNode == NULL) {
+            printf("Error: Cannot found %s.\n", commands[1]);
             return -1;
         }
 
@@ -300,20 +378,49 @@ int pennfatCopy(char **commands, int count, bool copyingFromHost, bool copyingTo
             return -1;
         }
 
-        // Write on the host
-        for (int i = 0; i < file->len; i++) {
-            if (write(f, &file->contents[i], sizeof(uint8_t)) == -1) {
-                perror("ERROR: fail to write the file.");
-                return -1;
-            }
+        // Write on the host, run by run from the image
+        if (exportFile(commands[1], f, fat) == -1) {
+            printf("ERROR: Fail to copy %s to host file %s.\n", commands[1], commands[3]);
+            close(f);
+            return -1;
         }
 
         if (close(f) == -1) {
             perror("ERROR: fail to close the file.");
             return -1;
         }
+    } else if (fat->refs != NULL) {
+        // Share the blocks of the source, each file copies them once it changes them
+        if (reflinkFile(commands[1], commands[2], fat) == -1) {
+            printf("Failed to copy file %s to %s\n", commands[1], commands[2]);
+            return -1;
+        }
+        saveFat(fat);
+    } else if (fat->image != NULL) {
+        if (strcmp(commands[1], commands[2]) == 0) {
+            return 0;
+        }
 
-        freeFile(file);
+        // Without a link table, write the source runs straight from the mapped image, the first one replacing the destination
+        struct iovec *iov;
+        int iovCount = mapFile(commands[1], &iov, fat);
+        if (iovCount == -1) {
+            printf("ERROR: Fail to get the host files.\n");
+            return -1;
+        }
+
+        for (int i = 0; i == 0 || i < iovCount; i++) {
+            uint8_t *bytes = iovCount == 0 ? NULL : iov[i].iov_base;
+            uint32_t len = iovCount == 0 ? 0 : iov[i].iov_len;
+            if (writeFile(commands[2], bytes, 0, len, REGULAR_FILETYPE, READWRITE_PERMS, fat, i != 0, false, false) == -1) {
+                printf("Failed to copy file %s to %s\n", commands[1], commands[2]);
+                free(iov);
+                return -1;
+            }
+        }
+
+        free(iov);
+        saveFat(fat);
     } else {
         file *file = readFile(commands[1], fat);
         if (file == NULL) {
@@ -322,7 +429,8 @@ int pennfatCopy(char **commands, int count, bool copyingFromHost, bool copyingTo
         }
 
         if (writeFile(commands[2], file->contents, 0, file->len, REGULAR_FILETYPE, READWRITE_PERMS, fat, false, false, false) == -1) {
-            printf("Failed to copy file %s to %s\n", commands[2], commands[3]);
+            printf("Failed to copy file %s to %s\n", commands[1], commands[2]);
+            freeFile(file);
             return -1;
         }
 
@@ -333,11 +441,24 @@ int pennfatCopy(char **commands, int count, bool copyingFromHost, bool copyingTo
     return 0;
 }
 
-int pennfatLs(pennfat *fat) {
+int pennfatLs(char *dirName, pennfat *fat) {
+    // Only the listed directory is read, a file lists itself
+    dirEntryNode *entryNode = NULL;
+    dirEntryNode *only = NULL;
+    if (dirName == NULL) {
+        entryNode = fat->cwd->head;
+    } else {
+        getDirEntryNode(NULL, &only, dirName, fat);
+        directory *dir = only != NULL && only->entry->type != DIRECTORY_FILETYPE ? NULL : resolveDirectory(fat, dirName);
+        if (only == NULL && dir == NULL) {
+            return -1;
+        }
+        entryNode = dir != NULL ? dir->head : only;
+        only = dir != NULL ? NULL : only;
+    }
     #ifdef DEBUGGING
-        printf("listing the fat...numFile in Fat-%s is %d\n", fat->fileName, fat->numFile);
+        printf("listing the fat...numFile in Fat-%s is %d\n", fat->fileName, fat->cwd->numFile);
     #endif
-    dirEntryNode *entryNode = fat->head;
 
     while (entryNode != NULL) {
         dirEntry *entry = entryNode->entry;
@@ -383,10 +504,10 @@ int pennfatLs(pennfat *fat) {
         strftime(day, 3, "%d", localTime);
         strftime(time, 6, "%H:%M", localTime);
 
-        // Print
-        printf("%3s %6d %4s %3s %6s %s\n", perms, entry->size, month, day, time, entry->name);
+        // Print, with a slash after directories
+        printf("%3s %6llu %4s %3s %6s %.*s%s\n", perms, (unsigned long long)entry->size, month, day, time, MAX_FILENAME, entry->name, entry->type == DIRECTORY_FILETYPE ? "/" : "");
 
-        entryNode = entryNode->next;
+        entryNode = only != NULL ? NULL : entryNode->next;
     }
 
     return 0;
@@ -400,6 +521,104 @@ int pennfatChmod(char **commands, int perm, pennfat *fat) {
     return 0;
 }
 
+int pennfatTruncate(char *fileName, uint64_t size, pennfat *fat) {
+    dirEntryNode *entryNode;
+    getDirEntryNode(NULL, &entryNode, fileName, fat);
+    if (entryNode == NULL) {
+        printf("ERROR: Fail to find %s.\n", fileName);
+        return -1;
+    }
+    if (entryNode->entry->type == DIRECTORY_FILETYPE) {
+        printf("ERROR: %s is a directory.\n", fileName);
+        return -1;
+    }
+
+    // Check write permissions
+    if (entryNode->entry->perm != WRITE_PERMS && entryNode->entry->perm != READWRITE_PERMS) {
+        printf("ERROR: Fail to truncate the file %s due to lack of write permission.\n", fileName);
+        return -1;
+    }
+
+    if (truncateFile(entryNode, size, fat) == -1)
+        return -1;
+
+    saveFat(fat);
+    return 0;
+}
+
+int pennfatCd(char *dirName, pennfat *fat) {
+    directory *dir = resolveDirectory(fat, dirName == NULL ? "/" : dirName);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    fat->cwd = dir;
+    return 0;
+}
+
+int pennfatMkdir(char **dirs, pennfat *fat) {
+    int idx = 1;
+    char *dirName = dirs[idx];
+
+    while (dirName != NULL) {
+        if (makeDirectory(dirName, fat) == -1) {
+            printf("ERROR: Fail to create %s.\n", dirName);
+            return -1;
+        }
+        dirName = dirs[++idx];
+    }
+
+    saveFat(fat);
+    return 0;
+}
+
+int pennfatDefrag(pennfat *fat) {
+    defragReport report;
+    if (getDefragReport(fat, &report) == -1) {
+        return -1;
+    }
+    printDefragReport("Before", &report);
+
+    // Step by step, each one committed on its own
+    uint64_t total = 0;
+    int moved;
+    while ((moved = defragStep(fat, DEFRAG_STEP_BLOCKS)) > 0) {
+        total += moved;
+    }
+    if (moved == -1) {
+        printf("ERROR: Defrag stopped after moving %llu blocks.\n", (unsigned long long) total);
+        return -1;
+    }
+
+    if (getDefragReport(fat, &report) == -1) {
+        return -1;
+    }
+    printDefragReport("After", &report);
+    printf("Moved %llu blocks.\n", (unsigned long long) total);
+    return 0;
+}
+
+int pennfatFsck(char *fileName, bool repair, bool checkData, int numThreads, pennfat *fat) {
+    // The check and the repairs go behind the back of a mounted FAT
+    if (fat != NULL && strcmp(fat->fileName, fileName) == 0) {
+        printf("ERROR: %s is mounted, unmount it first.\n", fileName);
+        return -1;
+    }
+
+    int problems = fsckImage(fileName, repair, checkData, numThreads);
+    if (problems == -1) {
+        printf("ERROR: Fail to check %s.\n", fileName);
+        return -1;
+    }
+
+    if (problems == 0) {
+        printf("%s is clean.\n", fileName);
+    } else {
+        printf("%s has %d problems%s.\n", fileName, problems, repair ? " left" : ", run fsck -r to repair them");
+    }
+    return 0;
+}
+
 int pennfatShow(pennfat *fat) {
     printf("*****************************\n");
     printf("fat->fileName =  %s\n",     fat->fileName);
@@ -407,7 +626,29 @@ int pennfatShow(pennfat *fat) {
     printf("fat->freeBlocks =  %d\n",   fat->freeBlocks);
     printf("fat->blockSize =  %d\n",    fat->blockSize);
     printf("fat->numEntries =  %d\n",   fat->numEntries);
-    printf("fat->numFile =  %d\n",      fat->numFile);
+    printf("fat->cwd->numFile =  %d\n",      fat->cwd->numFile);
+    printf("fat->cwd->indexSize =  %d\n",    fat->cwd->indexSize);
+    printf("fat->probes/lookups =  %llu/%llu\n", (unsigned long long) fat->probes, (unsigned long long) fat->lookups);
+    printf("fat->reads/writes =  %llu/%llu\n", (unsigned long long) fat->reads, (unsigned long long) fat->writes);
+    printf("fat->io->name =  %s\n", fat->io->name);
+    printf("fat->readahead hits/misses/blocks =  %llu/%llu/%llu\n", (unsigned long long) fat->raHits, (unsigned long long) fat->raMisses, (unsigned long long) fat->raBlocks);
+    printf("fat->journal->commits/syncs =  %llu/%llu\n", (unsigned long long) fat->journal->commits, (unsigned long long) fat->journal->syncs);
+    if (fat->cache != NULL) {
+        printf("fat->cache->capacity =  %d\n", fat->cache->capacity);
+        printf("fat->cache->hits/misses =  %llu/%llu\n", (unsigned long long) fat->cache->hits, (unsigned long long) fat->cache->misses);
+    }
+    if (fat->sums != NULL) {
+        printf("fat->sums->kernel =  %s\n", crc32cKernel());
+        printf("fat->sums->start/blocks =  %u/%u\n", fat->sums->start, fat->sums->blocks);
+        printf("fat->sums->verified/failures =  %llu/%llu\n", (unsigned long long) fat->sums->verified, (unsigned long long) fat->sums->failures);
+    }
+    if (fat->refs != NULL) {
+        printf("fat->refs->start/blocks =  %u/%u\n", fat->refs->start, fat->refs->blocks);
+        printf("fat->refs->used =  %u\n", fat->refs->used);
+    }
+    if (fat->scrub != NULL) {
+        printf("fat->scrub->passes/anomalies =  %llu/%llu\n", (unsigned long long) fat->scrub->passes, (unsigned long long) fat->scrub->anomalies);
+    }
     printf("*****************************\n");
     return 0;
 }
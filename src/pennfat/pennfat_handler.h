@@ -1,18 +1,29 @@
 #pragma once
 
+#include "defrag.h"
 #include "file.h"
+#include "fsck.h"
+#include "reflink.h"
+#include "scrub.h"
+
+#define IMPORT_CHUNK_SIZE (64 * 1024) // Bytes read from the host per chunk by cp -h and cat -w/-a
 
 // Standalone handler
-int pennfatMkfs(char *fileName, uint8_t numBlocks, uint8_t blockSizeIndex, pennfat **fat);
-int pennfatMount(char *fileName, pennfat **fat);
+int pennfatMkfs(char *fileName, uint32_t numBlocks, uint8_t blockSizeIndex, bool wide, bool checksums, bool reflinks, pennfat **fat);
+int pennfatMount(char *fileName, bool mapImage, int cacheBlocks, char *ioBackend, pennfat **fat);
 int pennfatUnmount(pennfat **fat);
 int pennfatTouch(char **files, pennfat *fat);
 int pennfatMove(char *oldFileName, char *newFileName, pennfat *fat);
 int pennfatRemove(char **files, pennfat *fat);
 int pennfatCat(char **commands, int count, pennfat *fat);
 int pennfatCopy(char **commands, int count, bool copyingFromHost, bool copyingToHost, pennfat *fat);
-int pennfatLs(pennfat *fat);
+int pennfatLs(char *dirName, pennfat *fat); // NULL lists the working directory
 int pennfatChmod(char **commands, int perm, pennfat *fat);
+int pennfatTruncate(char *fileName, uint64_t size, pennfat *fat);
+int pennfatCd(char *dirName, pennfat *fat);  // NULL goes back to the root
+int pennfatMkdir(char **dirs, pennfat *fat);
+int pennfatDefrag(pennfat *fat); // Lay every chain out in one run, free space last
+int pennfatFsck(char *fileName, bool repair, bool checkData, int numThreads, pennfat *fat); // Check an image other than the mounted one
 int pennfatShow(pennfat *fat);
 
 /* PROGRESS NOTES:
@@ -27,4 +38,9 @@ cat         pennfatCat              Done
 copy        pennfatCopy             Done
 ls          pennfatLs               Done
 chmod       pennfatChmod            Done
+truncate    pennfatTruncate         Done
+cd          pennfatCd               Done
+mkdir       pennfatMkdir            Done
+defrag      pennfatDefrag           Done
+fsck        pennfatFsck             Done
 */
\ No newline at end of file
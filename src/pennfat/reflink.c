@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "reflink.h"
+
+// A copy gets its own first block, linked on to the second block of the source, so the two chains
+// share everything past their first blocks. Every shared run then starts at a block several FAT
+// entries link to. The links into each block past the first one are kept in a region at the end of
+// the image, two bytes at 2 * index, and reach it like the FAT, through the journal: fsck tells a
+// reflink from a cross-link by comparing the two. A file changing a shared block copies it and every
+// block before it back to its own part of the chain, the copy of the last one linking on to the
+// shared rest.
+
+// Byte offset of the link region in the image
+static off_t regionOffset(pennfat *fat) { return (off_t) fat->totalBlocks * fat->blockSize + (off_t) (fat->refs->start - 1) * fat->blockSize; }
+
+/* ------------------------------------------------------------------------
+-------------------------------- Block Links ------------------------------
+------------------------------------------------------------------------*/
+
+// Enough blocks for the link counts of every block left below them
+uint32_t refRegionBlocks(uint32_t limit, uint32_t blockSize) { return ((uint64_t) limit * sizeof(uint16_t) + blockSize + sizeof(uint16_t) - 1) / (blockSize + sizeof(uint16_t)); }
+
+refTable *initRefTable(pennfat *fat, uint32_t limit, bool creating) {
+    uint32_t blocks = refRegionBlocks(limit, fat->blockSize);
+    if (limit < blocks + 3) {
+        printf("ERROR: The image is too small for a link table.\n");
+        return NULL;
+    }
+
+    refTable *refs = calloc(1, sizeof(refTable));
+    if (refs == NULL) {
+        perror("ERROR: Fail to malloc the link table.");
+        return NULL;
+    }
+    refs->blocks = blocks;
+    refs->start = limit - blocks;
+    refs->extra = calloc(refs->start, sizeof(uint16_t));
+    refs->committed = calloc(refs->start, sizeof(uint16_t));
+    if (refs->extra == NULL || refs->committed == NULL) {
+        perror("ERROR: Fail to malloc the link table.");
+        freeRefTable(&refs);
+        return NULL;
+    }
+    fat->refs = refs;
+
+    // The region of a new image reads as zeros, no block being shared yet
+    if (creating) {
+        return refs;
+    }
+
+    size_t size = (size_t) refs->start * sizeof(uint16_t);
+    uint8_t *bytes = (uint8_t *) refs->extra;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fat->fd, bytes + done, size - done, regionOffset(fat) + done);
+        if (n == -1) {
+            perror("ERROR: Fail to read the link table.");
+            fat->refs = NULL;
+            freeRefTable(&refs);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    memcpy(refs->committed, refs->extra, size);
+
+    for (uint32_t i = 0; i < refs->start; i++) {
+        refs->used += refs->extra[i] != 0 ? 1 : 0;
+    }
+    return refs;
+}
+
+void freeRefTable(refTable **refs) {
+    if (*refs == NULL) {
+        return;
+    }
+
+    free((*refs)->extra);
+    free((*refs)->committed);
+    free(*refs);
+    *refs = NULL;
+}
+
+int countLinks(pennfat *fat) {
+    refTable *refs = fat->refs;
+    if (refs == NULL) {
+        return 0;
+    }
+
+    // A block gets an extra link the second time a FAT entry links to it
+    uint64_t *linked = calloc(refs->start / 64 + 1, sizeof(uint64_t));
+    if (linked == NULL) {
+        perror("ERROR: Fail to malloc the link table.");
+        return -1;
+    }
+    memset(refs->extra, 0, (size_t) refs->start * sizeof(uint16_t));
+    refs->used = 0;
+
+    uint32_t limit = blockLimit(fat);
+    for (uint32_t i = 1; i < limit; i++) {
+        uint32_t next = fat->blocks[i];
+        if (next < 2 || next >= limit) {
+            continue;
+        }
+
+        if (!(linked[next / 64] & (1ULL << (next % 64)))) {
+            linked[next / 64] |= 1ULL << (next % 64);
+        } else if (addLink(fat, next) == -1) {
+            free(linked);
+            return -1;
+        }
+    }
+    free(linked);
+
+    return 0;
+}
+
+uint32_t blockLinks(pennfat *fat, uint32_t index) {
+    refTable *refs = fat->refs;
+    if (refs == NULL || index >= refs->start) {
+        return 1;
+    }
+    return refs->extra[index] + 1;
+}
+
+int addLink(pennfat *fat, uint32_t index) {
+    refTable *refs = fat->refs;
+    if (refs == NULL || index >= refs->start) {
+        printf("ERROR: Block %u cannot be shared, the image has no link table for it.\n", index);
+        return -1;
+    }
+    if (refs->extra[index] == UINT16_MAX) {
+        printf("ERROR: Block %u is shared by too many copies.\n", index);
+        return -1;
+    }
+
+    refs->used += refs->extra[index] == 0 ? 1 : 0;
+    refs->extra[index]++;
+    return 0;
+}
+
+uint32_t dropLink(pennfat *fat, uint32_t index) {
+    refTable *refs = fat->refs;
+    if (refs == NULL || index >= refs->start || refs->extra[index] == 0) {
+        return 0;
+    }
+
+    refs->extra[index]--;
+    refs->used -= refs->extra[index] == 0 ? 1 : 0;
+    return refs->extra[index] + 1;
+}
+
+void releaseChain(pennfat *fat, uint32_t first) {
+    uint32_t curr = first;
+    while (curr != FAT_END && curr != 0x0000 && dropLink(fat, curr) == 0) {
+        uint32_t next = fat->blocks[curr];
+        releaseBlock(fat, curr);
+        curr = next;
+    }
+}
+
+int journalRefs(pennfat *fat) {
+    refTable *refs = fat->refs;
+    if (refs == NULL) {
+        return 0;
+    }
+
+    // Every changed chunk, like the FAT
+    for (uint32_t i = 0; i < refs->start; i += REF_CHUNK) {
+        uint32_t count = refs->start - i < REF_CHUNK ? refs->start - i : REF_CHUNK;
+        if (memcmp(&refs->extra[i], &refs->committed[i], count * sizeof(uint16_t)) == 0) {
+            continue;
+        }
+
+        if (journalWrite(fat, regionOffset(fat) + (off_t) i * sizeof(uint16_t), &refs->extra[i], count * sizeof(uint16_t)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void commitRefs(refTable *refs) {
+    if (refs != NULL) {
+        memcpy(refs->committed, refs->extra, (size_t) refs->start * sizeof(uint16_t));
+    }
+}
+
+/* ------------------------------------------------------------------------
+------------------------------ Reflink Copies -----------------------------
+------------------------------------------------------------------------*/
+
+// First logical block up to last that another chain reaches too, last + 1 when there is none; the map is built
+static uint32_t firstShared(dirEntryNode *entryNode, uint32_t last, pennfat *fat) {
+    // The first block of a file is always its own
+    uint32_t logical = entryNode->ownBlocks > 1 ? entryNode->ownBlocks : 1;
+    while (logical <= last && blockLinks(fat, entryNode->blockMap[logical]) < 2) {
+        logical++;
+    }
+
+    // Only a copy of this file shares a block before the ones found, and it lowers ownBlocks
+    entryNode->ownBlocks = logical;
+    return logical;
+}
+
+uint32_t sharedBlocks(dirEntryNode *entryNode, uint32_t last, pennfat *fat) {
+    if (fat->refs == NULL || fat->refs->used == 0 || getBlockMap(entryNode, fat) == NULL) {
+        return 0;
+    }
+    if (last >= entryNode->mapBlocks) {
+        last = entryNode->mapBlocks - 1;
+    }
+
+    uint32_t first = firstShared(entryNode, last, fat);
+    return first > last ? 0 : last - first + 1;
+}
+
+int unshareBlocks(dirEntryNode *entryNode, uint32_t last, pennfat *fat) {
+    if (fat->refs == NULL || fat->refs->used == 0 || entryNode->entry->size == 0) {
+        return 0;
+    }
+    if (getBlockMap(entryNode, fat) == NULL) {
+        return -1;
+    }
+    if (last >= entryNode->mapBlocks) {
+        last = entryNode->mapBlocks - 1;
+    }
+
+    uint32_t first = firstShared(entryNode, last, fat);
+    if (first > last) {
+        return 0;
+    }
+
+    uint32_t copies = last - first + 1;
+    if (reclaimBlocks(fat, copies) == -1) {
+        return -1;
+    }
+    if (copies > fat->freeBlocks) {
+        printf("ERROR: Fail to find enough free blocks, %d blocks required, %d blocks is free.\n", copies, fat->freeBlocks);
+        return -1;
+    }
+    uint8_t *buf = malloc(fat->blockSize);
+    if (buf == NULL) {
+        perror("ERROR: Fail to malloc the buffer.");
+        return -1;
+    }
+
+    // Each copy takes the place of its block in this chain only, the last one linking on to the shared rest
+    uint32_t *map = entryNode->blockMap;
+    uint32_t run = 0;
+    uint32_t got = 0;
+    int result = 0;
+    for (uint32_t logical = first; logical <= last; logical++) {
+        if (got == 0 && (run = allocRun(fat, last - logical + 1, &got), got == 0)) {
+            printf("ERROR: Run out of free blocks.\n");
+            result = -1;
+            break;
+        }
+        uint32_t from = map[logical];
+        uint32_t to = run++;
+        got--;
+
+        uint32_t next = fat->blocks[from];
+        if (copyBlock(from, to, buf, fat) == -1 || (next != FAT_END && next != 0x0000 && addLink(fat, next) == -1)) {
+            for (uint32_t i = to; i < run + got; i++) {
+                releaseBlock(fat, i);
+            }
+            result = -1;
+            break;
+        }
+        fat->blocks[to] = next;
+        fat->blocks[map[logical - 1]] = to;
+        dropLink(fat, from);
+        map[logical] = to;
+    }
+    free(buf);
+
+    dropExtents(entryNode);
+    if (result == 0) {
+        entryNode->ownBlocks = last + 1;
+    }
+    return result;
+}
+
+int reflinkFile(char *fromName, char *toName, pennfat *fat) {
+    dirEntryNode *from;
+    getDirEntryNode(NULL, &from, fromName, fat);
+    if (from == NULL) {
+        printf("Error: Cannot found %s.\n", fromName);
+        return -1;
+    }
+    if (from->entry->type == DIRECTORY_FILETYPE) {
+        printf("Error: %s is a directory.\n", fromName);
+        return -1;
+    }
+    if (from->entry->perm != READWRITE_PERMS && from->entry->perm != READ_PERMS) {
+        printf("Error: Lack of read permission for %s.\n", fromName);
+        return -1;
+    }
+
+    directory *parent;
+    char name[MAX_FILENAME];
+    int resolved = resolvePath(fat, toName, &parent, name);
+    if (resolved != 0) {
+        if (resolved == 1) {
+            printf("ERROR: %s is a directory.\n", toName);
+        }
+        return -1;
+    }
+    dirEntryNode *to = lookupDirEntryNode(fat, parent, name);
+    if (to == from) {
+        return 0;
+    }
+    if (to != NULL && to->entry->type == DIRECTORY_FILETYPE) {
+        printf("ERROR: %s is a directory.\n", toName);
+        return -1;
+    }
+    if (to != NULL && to->entry->perm != WRITE_PERMS && to->entry->perm != READWRITE_PERMS) {
+        printf("ERROR: Fail to write the file %s due to lack of write permission.\n", toName);
+        return -1;
+    }
+
+    // The first block of the copy, and a block for the new entry when the directory is full
+    uint32_t needed = from->entry->size != 0 ? 1 : 0;
+    if (to == NULL && parent->numHoles == 0 && parent->numSlots != 0 && (sizeof(dirEntry) * parent->numSlots) % fat->blockSize == 0) {
+        needed++;
+    }
+    if (reclaimBlocks(fat, needed) == -1) {
+        return -1;
+    }
+    if (needed > fat->freeBlocks) {
+        printf("ERROR: Fail to find enough free blocks, %d blocks required, %d blocks is free.\n", needed, fat->freeBlocks);
+        return -1;
+    }
+
+    // An existing destination drops its own blocks first
+    if (to != NULL && truncateFile(to, 0, fat) == -1) {
+        return -1;
+    }
+
+    uint32_t first = 0x0000;
+    if (from->entry->size != 0) {
+        first = allocBlock(fat);
+        uint32_t next = fat->blocks[from->entry->firstBlock];
+        uint8_t *buf = malloc(fat->blockSize);
+        if (buf == NULL) {
+            perror("ERROR: Fail to malloc the buffer.");
+        }
+        if (buf == NULL || copyBlock(from->entry->firstBlock, first, buf, fat) == -1 || (next != FAT_END && addLink(fat, next) == -1)) {
+            free(buf);
+            releaseBlock(fat, first);
+            return -1;
+        }
+        free(buf);
+        fat->blocks[first] = next;
+
+        // The second block of the source is shared from now on
+        if (from->ownBlocks > 1) {
+            from->ownBlocks = 1;
+        }
+    }
+
+    if (to == NULL) {
+        to = initDirEntryNode(name, from->entry->size, first, REGULAR_FILETYPE, READWRITE_PERMS, time(NULL));
+        addDirEntryNode(fat, parent, to);
+    } else {
+        to->entry->firstBlock = first;
+        to->entry->size = from->entry->size;
+        to->entry->mtime = time(NULL);
+        dropExtents(to);
+        dropBlockMap(to);
+        markDirEntryDirty(fat, to);
+    }
+    to->ownBlocks = 1;
+
+    return 0;
+}
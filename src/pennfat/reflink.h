@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fat.h"
+
+#define FAT_REF_FLAG 0x40 // Bit of the block size byte of FAT[0] marking an image with a link table, reflink copies need one
+#define REF_CHUNK 128     // Link counts per journal record
+
+/* ------------------------------------------------------------------------
+-------------------------------- Block Links ------------------------------
+------------------------------------------------------------------------*/
+
+// FAT entries linking to each block, stored in blocks set aside at the end of the image; a block with
+// several is the start of a run shared by reflink copies
+typedef struct refTable {
+    uint32_t start;      // First block of the link region, no data block lies past it
+    uint32_t blocks;     // Blocks of the link region
+    uint16_t *extra;     // Links into each block below start past the first one, a private copy reaching the image through the journal
+    uint16_t *committed; // extra as of the last commit
+    uint32_t used;       // Blocks with more than one link
+} refTable;
+
+uint32_t refRegionBlocks(uint32_t limit, uint32_t blockSize);          // Blocks of the link region of an image whose blocks end at limit
+refTable *initRefTable(pennfat *fat, uint32_t limit, bool creating);   // Read the link region, or set it up for a new image
+void freeRefTable(refTable **refs);
+int countLinks(pennfat *fat);                                          // Recount the links into every block from the FAT, after a repair
+uint32_t blockLinks(pennfat *fat, uint32_t index);                     // FAT entries linking to the block as the table records them, 1 for an unshared block
+int addLink(pennfat *fat, uint32_t index);                             // One more FAT entry links to the block
+uint32_t dropLink(pennfat *fat, uint32_t index);                       // One reference to the block is gone; returns the ones left, 0 when the block can be freed
+void releaseChain(pennfat *fat, uint32_t first);                       // Free the chain from a block that lost a reference, up to the first block still reached otherwise
+int journalRefs(pennfat *fat);                                         // Log the changed link counts into the transaction
+void commitRefs(refTable *refs);                                       // The logged link counts are on disk
+
+/* ------------------------------------------------------------------------
+------------------------------ Reflink Copies -----------------------------
+------------------------------------------------------------------------*/
+
+uint32_t sharedBlocks(dirEntryNode *entryNode, uint32_t last, pennfat *fat); // Blocks unshareBlocks would copy for the same logical block
+int unshareBlocks(dirEntryNode *entryNode, uint32_t last, pennfat *fat);     // Copy the shared blocks of the file up to logical block last, before changing it
+int reflinkFile(char *fromName, char *toName, pennfat *fat);                 // Copy a file by sharing its blocks, only its first block is copied
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+refRegionBlocks     Done
+initRefTable        Done
+freeRefTable        Done
+countLinks          Done
+blockLinks          Done
+addLink             Done
+dropLink            Done
+releaseChain        Done
+journalRefs         Done
+commitRefs          Done
+sharedBlocks        Done
+unshareBlocks       Done
+reflinkFile         Done
+*/
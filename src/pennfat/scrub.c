@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "scrub.h"
+
+// A pass checks every FAT entry and walks the tree slot by slot, depth first, checking each entry and its
+// chain. The cursor is a directory and a slot, so entries added behind it wait for the next pass and a
+// deleted directory only moves it on. A chain longer than a step allows keeps its place in the walk, and
+// the next step goes on from there as long as the link it stopped at is still in the FAT. Other processes may be preempted in the middle of a change, so an
+// entry that looks wrong is only recorded when the next step still finds it wrong. On an image with checksums each
+// step also reads a few blocks in use from a cursor of its own, straight from the image, and compares them with their checksums.
+
+// Path of the entries of dir, empty for the root
+static void dirPath(directory *dir, char *buf, size_t len) {
+    if (dir->node == NULL) {
+        buf[0] = '\0';
+        return;
+    }
+
+    dirPath(dir->parent, buf, len);
+    size_t used = strlen(buf);
+    snprintf(&buf[used], len - used, "/%.*s", MAX_FILENAME, dir->node->entry->name);
+}
+
+// Path of the entry, for the messages
+static void entryPath(dirEntryNode *node, char *buf, size_t len) {
+    dirPath(node->parent, buf, len);
+    size_t used = strlen(buf);
+    snprintf(&buf[used], len - used, "/%.*s", MAX_FILENAME, node->entry->name);
+}
+
+// Check the fields of the entry and start the walk of its chain, leaving message empty when the fields are sound
+static void startWalk(scrubWalk *walk, dirEntryNode *node, char *message, size_t len) {
+    dirEntry *entry = node->entry;
+    char path[SCRUB_MESSAGE / 2];
+    message[0] = '\0';
+    walk->node = NULL;
+
+    if (entry->type != UNKNOWN_FILETYPE && entry->type != REGULAR_FILETYPE && entry->type != DIRECTORY_FILETYPE && entry->type != SYMLINK_FILETYPE) {
+        entryPath(node, path, sizeof(path));
+        snprintf(message, len, "%s has the unknown type %u", path, entry->type);
+        return;
+    }
+    if (entry->perm != NONE_PERMS && entry->perm != WRITE_PERMS && entry->perm != READ_PERMS && entry->perm != READEXE_PERMS && entry->perm != READWRITE_PERMS &&
+        entry->perm != READWRITEEXE_PERMS) {
+        entryPath(node, path, sizeof(path));
+        snprintf(message, len, "%s has the unknown permissions %u", path, entry->perm);
+        return;
+    }
+
+    walk->node = node;
+    walk->first = entry->firstBlock;
+    walk->prev = 0;
+    walk->block = entry->firstBlock;
+    walk->count = 0;
+}
+
+// Check up to budget blocks of the chain against the FAT, the walk ends with the chain and message is left empty when it is sound;
+// returns the blocks checked
+static uint32_t continueWalk(pennfat *fat, scrubWalk *walk, uint32_t budget, char *message, size_t len) {
+    dirEntry *entry = walk->node->entry;
+    char path[SCRUB_MESSAGE / 2];
+    message[0] = '\0';
+
+    // A chain changed where the last step stopped is walked again from its first block
+    if (entry->firstBlock != walk->first || (walk->count > 0 && fat->blocks[walk->prev] != walk->block)) {
+        walk->first = entry->firstBlock;
+        walk->block = entry->firstBlock;
+        walk->count = 0;
+    }
+
+    uint32_t limit = blockLimit(fat);
+    uint32_t walked = 0;
+    for (; walk->block != FAT_END && !(walk->block == 0x0000 && walk->count == 0); walk->block = fat->blocks[walk->block]) {
+        if (walked == budget) {
+            return walked;
+        }
+
+        if (walk->block == 0x0000) {
+            entryPath(walk->node, path, sizeof(path));
+            snprintf(message, len, "%s runs into a free FAT entry after %u blocks", path, walk->count);
+            walk->node = NULL;
+            return walked;
+        }
+        if (walk->block < 2 || walk->block >= limit) {
+            entryPath(walk->node, path, sizeof(path));
+            snprintf(message, len, "%s links the block %u after %u blocks", path, walk->block, walk->count);
+            walk->node = NULL;
+            return walked;
+        }
+        if (walk->count == limit) {
+            entryPath(walk->node, path, sizeof(path));
+            snprintf(message, len, "%s loops back on itself", path);
+            walk->node = NULL;
+            return walked;
+        }
+        walk->prev = walk->block;
+        walk->count++;
+        walked++;
+    }
+
+    uint32_t count = walk->count;
+    if (entry->type == DIRECTORY_FILETYPE && entry->size != (uint64_t) count * fat->blockSize) {
+        entryPath(walk->node, path, sizeof(path));
+        snprintf(message, len, "%s is a directory of %llu bytes in %u blocks", path, (unsigned long long) entry->size, count);
+    } else if (entry->type != DIRECTORY_FILETYPE && (uint64_t) bytesToBlocks(entry->size, fat) != count) {
+        entryPath(walk->node, path, sizeof(path));
+        snprintf(message, len, "%s holds %llu bytes in %u blocks", path, (unsigned long long) entry->size, count);
+    }
+    walk->node = NULL;
+    return walked;
+}
+
+static void recordAnomaly(scrubber *scrub, char *message) {
+    printf("SCRUB: %s.\n", message);
+    snprintf(scrub->log[scrub->logNext], SCRUB_MESSAGE, "%s", message);
+    scrub->logNext = (scrub->logNext + 1) % SCRUB_LOG_SIZE;
+    scrub->anomalies++;
+}
+
+// Check again the suspects of the earlier steps that are still in their slot, recording the ones still wrong; returns the budget used
+static uint32_t checkSuspects(pennfat *fat, scrubber *scrub, uint32_t budget) {
+    char message[SCRUB_MESSAGE];
+    uint32_t used = 0;
+    uint32_t done = 0;
+    for (; done < scrub->numSuspects && used < budget; done++) {
+        scrubSuspect *suspect = &scrub->suspects[done];
+        used++;
+        if (suspect->slot >= suspect->dir->numSlots || suspect->dir->slots[suspect->slot] != suspect->node) {
+            continue;
+        }
+
+        if (suspect->walk.node == NULL) {
+            startWalk(&suspect->walk, suspect->node, message, sizeof(message));
+            if (message[0] != '\0') {
+                recordAnomaly(scrub, message);
+                continue;
+            }
+        }
+
+        // A long chain goes on in the next step
+        used += continueWalk(fat, &suspect->walk, budget - used, message, sizeof(message));
+        if (suspect->walk.node != NULL) {
+            break;
+        }
+        if (message[0] != '\0') {
+            recordAnomaly(scrub, message);
+        }
+    }
+
+    // Keep the ones not settled yet
+    memmove(scrub->suspects, &scrub->suspects[done], (scrub->numSuspects - done) * sizeof(scrubSuspect));
+    scrub->numSuspects -= done;
+    return used;
+}
+
+// Read the blocks in use from the sum cursor and compare them with their checksums. A write records the checksum of a block
+// before the block reaches the image, so a block that does not match is only recorded when the next step still finds it wrong
+static int checkBlockSums(pennfat *fat, scrubber *scrub) {
+    if (fat->sums == NULL) {
+        return 0;
+    }
+    if (scrub->block == NULL && (scrub->block = malloc(fat->blockSize)) == NULL) {
+        perror("ERROR: Fail to malloc the scrubber.");
+        return -1;
+    }
+
+    // The suspects of the last step, dropped when the block was freed since
+    char message[SCRUB_MESSAGE];
+    for (uint32_t i = 0; i < scrub->numSumSuspects; i++) {
+        uint32_t index = scrub->sumSuspects[i];
+        if (fat->blocks[index] == 0x0000) {
+            continue;
+        }
+        if (readImageBlock(index, scrub->block, fat) == -1) {
+            perror("ERROR: Fail to read a block to scrub.");
+            return -1;
+        }
+        if (!blockMatches(fat, index, scrub->block)) {
+            snprintf(message, sizeof(message), "Block %u does not match its checksum", index);
+            recordAnomaly(scrub, message);
+        }
+    }
+    scrub->numSumSuspects = 0;
+
+    // At most once around the data blocks, free ones are skipped unread
+    uint32_t limit = blockLimit(fat);
+    uint32_t read = 0;
+    for (uint32_t i = 1; i < limit && read < SCRUB_SUM_BLOCKS; i++) {
+        if (scrub->sumCursor < 1 || scrub->sumCursor >= limit) {
+            scrub->sumCursor = 1;
+        }
+
+        uint32_t index = scrub->sumCursor++;
+        if (fat->blocks[index] == 0x0000) {
+            continue;
+        }
+        if (readImageBlock(index, scrub->block, fat) == -1) {
+            perror("ERROR: Fail to read a block to scrub.");
+            return -1;
+        }
+        read++;
+        scrub->blocks++;
+        if (!blockMatches(fat, index, scrub->block) && scrub->numSumSuspects < SCRUB_MAX_SUSPECTS) {
+            scrub->sumSuspects[scrub->numSumSuspects++] = index;
+        }
+    }
+    return 0;
+}
+
+// Set the entry aside to check it again in the next step, dropped when the list is full
+static void addSuspect(scrubber *scrub, directory *dir, uint32_t slot, dirEntryNode *node) {
+    if (scrub->numSuspects == SCRUB_MAX_SUSPECTS) {
+        return;
+    }
+
+    scrubSuspect *suspect = &scrub->suspects[scrub->numSuspects++];
+    suspect->dir = dir;
+    suspect->slot = slot;
+    suspect->node = node;
+    suspect->walk.node = NULL;
+}
+
+int scrubStep(pennfat *fat, uint32_t budget) {
+    if (fat == NULL) {
+        printf("ERROR: No mounted FAT.\n");
+        return -1;
+    }
+    if (fat->scrub == NULL) {
+        fat->scrub = calloc(1, sizeof(scrubber));
+        if (fat->scrub == NULL) {
+            perror("ERROR: Fail to malloc the scrubber.");
+            return -1;
+        }
+    }
+    scrubber *scrub = fat->scrub;
+
+    // Half of the budget on the FAT, at most once around it; every entry has to be free, the end of a chain or a data block
+    char message[SCRUB_MESSAGE];
+    uint32_t limit = blockLimit(fat);
+    uint32_t fatBudget = budget / 2 < limit - 2 ? budget / 2 : limit - 2;
+    for (uint32_t i = 0; i < fatBudget; i++) {
+        if (scrub->fatCursor < 2 || scrub->fatCursor >= limit) {
+            scrub->fatCursor = 2;
+        }
+
+        uint32_t next = fat->blocks[scrub->fatCursor];
+        if (next != 0x0000 && next != FAT_END && (next < 2 || next >= limit)) {
+            snprintf(message, sizeof(message), "FAT entry %u links the block %u", scrub->fatCursor, next);
+            recordAnomaly(scrub, message);
+        }
+        scrub->fatCursor++;
+    }
+
+    if (checkBlockSums(fat, scrub) == -1) {
+        return -1;
+    }
+
+    // The other half on the suspects and the entries, a chain longer than what is left goes on in the next step
+    uint32_t left = budget - budget / 2;
+    left -= checkSuspects(fat, scrub, left);
+    while (left > 0) {
+        if (scrub->walk.node != NULL) {
+            // Given up when the entry left its slot since the last step
+            directory *dir = scrub->dir;
+            dirEntryNode *node = scrub->walk.node;
+            if (dir == NULL || scrub->slot == 0 || scrub->slot > dir->numSlots || dir->slots[scrub->slot - 1] != node) {
+                scrub->walk.node = NULL;
+                continue;
+            }
+
+            left -= continueWalk(fat, &scrub->walk, left, message, sizeof(message));
+            if (scrub->walk.node != NULL) {
+                break;
+            }
+            if (message[0] != '\0') {
+                addSuspect(scrub, dir, scrub->slot - 1, node);
+            } else if (node->entry->type == DIRECTORY_FILETYPE) {
+                directory *subDir = getDirectory(fat, node);
+                if (subDir != NULL) {
+                    scrub->dir = subDir;
+                    scrub->slot = 0;
+                }
+            }
+            continue;
+        }
+
+        if (scrub->dir == NULL) {
+            scrub->dir = fat->root;
+            scrub->slot = 0;
+        }
+
+        // Back to the parent after the last slot, a pass ends after the last slot of the root
+        directory *dir = scrub->dir;
+        if (scrub->slot >= dir->numSlots) {
+            if (dir->node == NULL) {
+                scrub->dir = NULL;
+                scrub->passes++;
+                return 1;
+            }
+            scrub->slot = dir->node->slot == NO_SLOT ? dir->parent->numSlots : dir->node->slot + 1;
+            scrub->dir = dir->parent;
+            continue;
+        }
+
+        dirEntryNode *node = dir->slots[scrub->slot++];
+        left--;
+        if (node == NULL) {
+            continue;
+        }
+
+        // Its chain is walked from the top of the loop
+        scrub->entries++;
+        startWalk(&scrub->walk, node, message, sizeof(message));
+        if (message[0] != '\0') {
+            addSuspect(scrub, dir, scrub->slot - 1, node);
+        }
+    }
+
+    return 0;
+}
+
+// Whether dir is under, or is, ancestor
+static bool isUnder(directory *dir, directory *ancestor) {
+    for (directory *curr = dir; curr != NULL; curr = curr->parent) {
+        if (curr == ancestor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void scrubForget(scrubber *scrub, directory *dir) {
+    if (scrub == NULL) {
+        return;
+    }
+
+    // Carry on after the entry of the directory
+    if (scrub->dir != NULL && isUnder(scrub->dir, dir)) {
+        scrub->slot = dir->node->slot == NO_SLOT ? dir->parent->numSlots : dir->node->slot + 1;
+        scrub->dir = dir->parent;
+        scrub->walk.node = NULL;
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < scrub->numSuspects; i++) {
+        if (!isUnder(scrub->suspects[i].dir, dir)) {
+            scrub->suspects[kept++] = scrub->suspects[i];
+        }
+    }
+    scrub->numSuspects = kept;
+}
+
+void printScrubStatus(pennfat *fat) {
+    if (fat == NULL) {
+        printf("ERROR: No mounted FAT.\n");
+        return;
+    }
+    scrubber *scrub = fat->scrub;
+    if (scrub == NULL) {
+        printf("No scrub has run on %s yet.\n", fat->fileName);
+        return;
+    }
+
+    printf("Scrub of %s: %llu passes, %llu entries checked, %llu anomalies.\n", fat->fileName, (unsigned long long) scrub->passes,
+           (unsigned long long) scrub->entries, (unsigned long long) scrub->anomalies);
+    if (fat->sums != NULL) {
+        printf("%llu blocks checked against their checksums.\n", (unsigned long long) scrub->blocks);
+    }
+    for (uint32_t i = 0; i < SCRUB_LOG_SIZE; i++) {
+        char *message = scrub->log[(scrub->logNext + i) % SCRUB_LOG_SIZE];
+        if (message[0] != '\0') {
+            printf("  %s\n", message);
+        }
+    }
+}
+
+void freeScrubber(scrubber **scrub) {
+    if (*scrub != NULL) {
+        free((*scrub)->block);
+    }
+    free(*scrub);
+    *scrub = NULL;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fat.h"
+
+#define SCRUB_STEP_BLOCKS 1024 // FAT entries, slots and chain blocks one scrub step checks
+#define SCRUB_MAX_SUSPECTS 16  // Anomalies one step sets aside to check again in the next one
+#define SCRUB_SUM_BLOCKS 64    // Data blocks one scrub step reads to check against their checksums
+#define SCRUB_LOG_SIZE 16      // Recorded anomalies kept for scrub -s
+#define SCRUB_MESSAGE 128      // Longest anomaly description
+#define SCRUB_STEP_TICKS 1     // PennOS ticks the scrubber sleeps after each step
+#define SCRUB_PASS_TICKS 50    // PennOS ticks the scrubber sleeps after each pass
+
+/* ------------------------------------------------------------------------
+---------------------------------- Scrubber -------------------------------
+------------------------------------------------------------------------*/
+
+// Chain of an entry checked over as many steps as it takes
+typedef struct scrubWalk {
+    dirEntryNode *node; // Entry being checked, NULL when no walk is going on
+    uint32_t first;     // First block of the chain when the walk started
+    uint32_t prev;      // Last block checked, meaningless before the first one
+    uint32_t block;     // Next block to check
+    uint32_t count;     // Blocks checked so far
+} scrubWalk;
+
+// Entry that looked wrong once, possibly caught in the middle of a change
+typedef struct scrubSuspect {
+    directory *dir;     // Directory holding the entry
+    uint32_t slot;      // Slot of the entry in dir
+    dirEntryNode *node; // Entry seen in the slot, only compared, the slot may have changed since
+    scrubWalk walk;     // Check of the entry again, not started while walk.node is NULL
+} scrubSuspect;
+
+// Background check of a mounted FAT, resumed where the last step stopped
+typedef struct scrubber {
+    directory *dir;     // Directory being checked, NULL between passes
+    uint32_t slot;      // Next slot of dir to check
+    scrubWalk walk;     // Chain of the entry before that slot, when the last step stopped in it
+    uint32_t fatCursor; // Next FAT entry to check
+    uint32_t sumCursor; // Next data block to check against its checksum
+    uint8_t *block;     // One block read for the checksum checks, NULL until the first one
+
+    scrubSuspect suspects[SCRUB_MAX_SUSPECTS];
+    uint32_t numSuspects;
+    uint32_t sumSuspects[SCRUB_MAX_SUSPECTS]; // Blocks that did not match their checksum in the last step
+    uint32_t numSumSuspects;
+
+    uint64_t passes;    // Whole trees checked since mount
+    uint64_t entries;   // Directory entries checked since mount
+    uint64_t blocks;    // Data blocks checked against their checksums since mount
+    uint64_t anomalies; // Anomalies recorded since mount
+    char log[SCRUB_LOG_SIZE][SCRUB_MESSAGE]; // Last recorded anomalies, logNext the oldest
+    uint32_t logNext;
+} scrubber;
+
+int scrubStep(pennfat *fat, uint32_t budget);       // Check budget FAT entries, slots and blocks from the cursor, and SCRUB_SUM_BLOCKS blocks against their checksums;
+                                                    // returns 1 when a pass ends, -1 on error
+void scrubForget(scrubber *scrub, directory *dir);  // Move the cursor and the suspects out of a directory about to be freed
+void printScrubStatus(pennfat *fat);
+void freeScrubber(scrubber **scrub);
+
+/* PROGRESS NOTES:
+FUNCTION_NAME       IMPLEMENTATION      TESTING
+scrubStep           Done
+scrubForget         Done
+printScrubStatus    Done
+freeScrubber        Done
+*/
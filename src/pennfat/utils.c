@@ -1,3 +1,6 @@
+#include <limits.h>
+#include <stdint.h>
+
 #include "utils.h"
 
 void writeHelper(char *message) {
@@ -5,4 +8,27 @@ void writeHelper(char *message) {
         perror("ERROR: Fail to write.");
         exit(EXIT_FAILURE);
     }
+}
+
+int writeIovecs(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // Skip the iovecs written, and the written part of a partial one
+        while (count > 0 && n >= (ssize_t) iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
 }
\ No newline at end of file
@@ -10,8 +10,14 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 // #define DEBUGGING
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 // Helper functions
-void writeHelper(char *message);
\ No newline at end of file
+void writeHelper(char *message);
+int writeIovecs(int fd, struct iovec *iov, int count); // Write all iovecs, returns -1 on error
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include "process_control.h"
 #include "scheduler.h"
 #include "../macros.h"
+#include "../pennfat/pennfat_handler.h"
+#include "mounted_fat.h"
 #include "shell.h"
 #include "logger.h"
 
@@ -19,6 +21,11 @@ int main(int argc, char *argv[]) {
     // Start scheduler after init, swap to the shell process
     k_process_control_start();
 
+    // Commit the journal of the FAT still mounted at logout
+    if (mounted_fat != NULL) {
+        pennfatUnmount(&mounted_fat);
+    }
+
     close_log();
     return 0;
 }
\ No newline at end of file
@@ -16,6 +16,7 @@
 #include "scheduler.h"
 #include "shell.h"
 #include "logger.h"
+#include "mounted_fat.h"
 #include "ucontext_func.h"
 
 #define STACK_SIZE 16384
@@ -58,6 +59,7 @@ static int cpu_mode_stack[MAX_PROTECTION_LAYERS];
 static unsigned int protection_level = 0; // use to count
 void k_enter_protected_mode();
 void k_leave_last_protected_mode();
+void k_release_fat(PCB *pcb);
 pid_t last_scheduled_pid = 0;
 
 // signals
@@ -215,6 +217,9 @@ int k_terminate(PCB *pcb, bool signaled) {
                            pcb->process_name);
     }
 
+    // a process killed in the middle of a FAT operation no longer holds the FAT
+    k_release_fat(pcb);
+
     // check whether marked as Orphan, manipulate input pcb and waitpid
     pid_t pid = pcb->pid;
     // clean
@@ -327,6 +332,13 @@ void kernel_thread_returner() {
 // idle
 void kernel_thread_idle() {
     // printf("IDLE\n");
+    // Nothing is ready to run, so the grouped changes of the FAT go to the image now, unless a stopped process
+    // is in the middle of an operation
+    k_enter_protected_mode();
+    if (mounted_fat != NULL && mounted_fat->busy == 0) {
+        syncFat(mounted_fat);
+    }
+    k_leave_last_protected_mode();
     while (true) {
         usleep(1000000);
     }
@@ -402,6 +414,10 @@ PCB *k_process_create(PCB *parent) {
         pcb->stdout = parent->stdout;
     }
 
+    // FAT descriptors are not inherited
+    initFdTable(pcb->open_fds);
+    pcb->fat_busy = false;
+
     pcb_list[pcb->pid] = pcb;
     if (parent != NULL) {
         parent->children[parent->num_children++] = pcb->pid;
@@ -412,6 +428,7 @@ PCB *k_process_create(PCB *parent) {
 int k_process_cleanup(PCB *process) {
     if (process) {
         pcb_list[process->pid] = NULL;
+        closeFdTable(process->open_fds);
         free(process->context.uc_stack.ss_sp);
         free(process);
     }
@@ -749,6 +766,32 @@ void k_leave_last_protected_mode() {
     return;
 }
 
+// FAT operation
+void k_release_fat(PCB *pcb) {
+    if (pcb != NULL && pcb->fat_busy) {
+        if (mounted_fat != NULL) {
+            mounted_fat->busy--;
+        }
+        pcb->fat_busy = false;
+    }
+}
+
+void k_enter_fat_operation() {
+    // defrag steps and umount wait while the current process is switched out in the middle of the operation
+    k_enter_protected_mode();
+    if (mounted_fat != NULL && current_pcb != NULL && !current_pcb->fat_busy) {
+        mounted_fat->busy++;
+        current_pcb->fat_busy = true;
+    }
+    k_leave_last_protected_mode();
+}
+
+void k_leave_fat_operation() {
+    k_enter_protected_mode();
+    k_release_fat(current_pcb);
+    k_leave_last_protected_mode();
+}
+
 void p_logout() {
     k_enter_protected_mode();
     setcontext(&mainContext);
@@ -44,6 +44,7 @@ typedef struct PCB {
     int stdout;
     int pid_waitfor;  // this process is in waiting list
     int sleep_remain; // this process is in speical sleep list, how long remained to sleep
+    bool fat_busy;    // this process is in the middle of an operation on the mounted FAT, counted in its busy
 } PCB;
 
 typedef struct pNode {
@@ -103,6 +104,8 @@ int k_process_control_initiate();
 int k_process_control_start();
 void k_enter_protected_mode();
 void k_leave_last_protected_mode();
+void k_enter_fat_operation();
+void k_leave_fat_operation();
 
 bool W_WIFEXITED(int wstatus);
 bool W_WIFSTOPPED(int wstatus);
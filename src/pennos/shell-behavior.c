@@ -21,12 +21,17 @@ char *builtins[] = {"cat",
                     "echo",
                     "touch file ...",
                     "rm file ...",
-                    "ls",
+                    "ls [dir]",
+                    "cd [dir]",
+                    "mkdir dir ...",
+                    "defrag",
+                    "scrub [-s] [passes]",
                     "touch file ...",
                     "mv src dest",
                     "cp src dest",
                     "rm file ...",
                     "chmod",
+                    "truncate file size",
                     "ps",
                     "kill -[SIGNAL_NAME] pid ...",
                     "zombify",
@@ -62,7 +67,10 @@ void cmd_cat(char **argv) {
             return;
         }
     }
-    if (pennfatCat(argv, cmd_idx, mounted_fat) == -1) {
+    k_enter_fat_operation();
+    int result = pennfatCat(argv, cmd_idx, mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
         printf("INPUT ERROR: Invalid cat command.\n");
         return;
     }
@@ -91,18 +99,125 @@ void cmd_echo(char **argv) {
 int getCommandCount() { return 1; }
 
 void cmd_ls(char **argv) {
-    if (pennfatLs(mounted_fat) == -1) {
+    k_enter_fat_operation();
+    int result = pennfatLs(argv[1], mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
         printf("Failed to list files.\n");
     }
 }
 
+void cmd_cd(char *args[]) {
+    k_enter_fat_operation();
+    int result = pennfatCd(args[1], mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
+        printf("Failed to change directory.\n");
+    }
+}
+
+void cmd_mkdir(char *args[]) {
+    // Check input format
+    if (args[1] == NULL) {
+        printf("INPUT FORMAT: [mkdir DIR ...].\n");
+        return;
+    }
+    k_enter_fat_operation();
+    pennfatMkdir(args, mounted_fat);
+    k_leave_fat_operation();
+}
+
+void cmd_defrag() {
+    defragReport report;
+    k_enter_protected_mode();
+    int result = getDefragReport(mounted_fat, &report);
+    k_leave_last_protected_mode();
+    if (result == -1) {
+        printf("Failed to defragment.\n");
+        return;
+    }
+    printDefragReport("Before", &report);
+
+    // No other process sees the FAT halfway through a step, and each step gives the CPU back; while another
+    // process is switched out in the middle of an operation, the step waits for it to finish
+    unsigned long long total = 0;
+    int moved;
+    while (true) {
+        k_enter_protected_mode();
+        moved = defragStep(mounted_fat, DEFRAG_STEP_BLOCKS);
+        k_leave_last_protected_mode();
+        if (moved == DEFRAG_BUSY) {
+            p_sleep(DEFRAG_BUSY_TICKS);
+            continue;
+        }
+        if (moved <= 0) {
+            break;
+        }
+        total += moved;
+    }
+    if (moved == -1) {
+        printf("Failed to defragment after moving %llu blocks.\n", total);
+        return;
+    }
+
+    k_enter_protected_mode();
+    result = getDefragReport(mounted_fat, &report);
+    k_leave_last_protected_mode();
+    if (result == 0) {
+        printDefragReport("After", &report);
+    }
+    printf("Moved %llu blocks.\n", total);
+}
+
+void cmd_scrub(char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-s") == 0) {
+        k_enter_protected_mode();
+        printScrubStatus(mounted_fat);
+        k_leave_last_protected_mode();
+        return;
+    }
+
+    // Passes to run, none given keeps it going until it is killed
+    int passes = argv[1] == NULL ? 0 : atoi(argv[1]);
+    if (passes < 0) {
+        printf("INPUT FORMAT: [scrub [-s] [passes]].\n");
+        return;
+    }
+
+    // One bounded step per wake-up, then the CPU and the image go back to the others
+    int done = 0;
+    while (passes == 0 || done < passes) {
+        k_enter_protected_mode();
+        int result = scrubStep(mounted_fat, SCRUB_STEP_BLOCKS);
+        k_leave_last_protected_mode();
+        if (result == -1) {
+            printf("Failed to scrub.\n");
+            return;
+        }
+        if (result == 1) {
+            done++;
+            if (passes == 0 || done < passes) {
+                p_sleep(SCRUB_PASS_TICKS);
+            }
+        } else {
+            p_sleep(SCRUB_STEP_TICKS);
+        }
+    }
+
+    k_enter_protected_mode();
+    printScrubStatus(mounted_fat);
+    k_leave_last_protected_mode();
+}
+
 void cmd_touch(char **argv) {
     // Check input format
     if (argv[1] == NULL) {
         printf("INPUT FORMAT: [touch FILE ...].\n");
         return;
     }
+    k_enter_fat_operation();
     pennfatTouch(argv, mounted_fat);
+    k_leave_fat_operation();
 }
 
 void cmd_mv(char **argv) {
@@ -110,7 +225,9 @@ void cmd_mv(char **argv) {
         printf("Missing src or dest files\n");
         return;
     }
+    k_enter_fat_operation();
     pennfatMove(argv[1], argv[2], mounted_fat);
+    k_leave_fat_operation();
 }
 
 void cmd_cp(char **argv) {
@@ -146,7 +263,10 @@ void cmd_cp(char **argv) {
         }
     }
 
-    if (pennfatCopy(argv, cmd_idx, copyingFromHost, copyingToHost, mounted_fat) == -1) {
+    k_enter_fat_operation();
+    int result = pennfatCopy(argv, cmd_idx, copyingFromHost, copyingToHost, mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
         printf("INPUT ERROR: Invalid cp command.\n");
         return;
     }
@@ -157,7 +277,10 @@ void cmd_rm(char **argv) {
         printf("INPUT FORMAT: [rm FILE ...].\n");
         return;
     }
-    if (pennfatRemove(argv, mounted_fat) == -1) {
+    k_enter_fat_operation();
+    int result = pennfatRemove(argv, mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
         printf("Failed to remove file.\n");
     }
 }
@@ -187,11 +310,31 @@ void cmd_chmod(char **argv) {
         printf("PERM ERROR: Permission type must be one of [---, -w-, -r-, xr-, -rw, xrw]\n");
     }
 
-    if (pennfatChmod(argv, perm, mounted_fat) == -1) {
+    k_enter_fat_operation();
+    int result = pennfatChmod(argv, perm, mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
         printf("Failed to change file permissions.\n");
     }
 }
 
+void cmd_truncate(char **argv) {
+    // Check input format
+    char *end = NULL;
+    unsigned long long size = argv[1] == NULL || argv[2] == NULL ? 0 : strtoull(argv[2], &end, 10);
+    if (end == NULL || *end != '\0' || argv[2][0] == '-') {
+        printf("INPUT FORMAT: [truncate FILE SIZE].\n");
+        return;
+    }
+
+    k_enter_fat_operation();
+    int result = pennfatTruncate(argv[1], size, mounted_fat);
+    k_leave_fat_operation();
+    if (result == -1) {
+        printf("Failed to truncate %s.\n", argv[1]);
+    }
+}
+
 void cmd_ps() {
     processlists *pl = get_scheduler();
     int max_pid = k_find_max_pid_in_process_pool(pl);
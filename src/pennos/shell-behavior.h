@@ -80,6 +80,8 @@ void cmd_rm(char **argv);
 
 void cmd_chmod(char **argv);
 
+void cmd_truncate(char **argv);
+
 void cmd_ps(char **argv);
 
 void cmd_kill(char *argv[]);
@@ -98,6 +100,10 @@ void cmd_cd(char *args[]);
 
 void cmd_mkdir(char *args[]);
 
+void cmd_defrag();
+
+void cmd_scrub(char **argv);
+
 
 int getCommandCount();
 
@@ -32,6 +32,15 @@ pennfat *mounted_fat;
 int fd0_dup;
 int fd1_dup;
 
+// mkfs, mount and umount free the mounted FAT, so they wait for the processes in the middle of an operation on it
+static bool fatInUse() {
+    if (mounted_fat != NULL && mounted_fat->busy > 0) {
+        printf("ERROR: %s is in use by another process.\n", mounted_fat->fileName);
+        return true;
+    }
+    return false;
+}
+
 void shell() {
 
     fd0_dup = STDIN_FILENO;
@@ -133,23 +142,57 @@ void shell() {
 
             } else if (strncmp(cmd->commands[0][0], "mkfs", 4) == 0) {
                 if (cmd->commands[0][1] == NULL || cmd->commands[0][2] == NULL || cmd->commands[0][3] == NULL) {
-                    printf("INPUT FORMAT: [mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG].\n");
+                    printf("INPUT FORMAT: [mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG [ -32 ] [ -s ] [ -r ]].\n");
                     p_logout();
                 }
-                pennfatMkfs(cmd->commands[0][1], (char)atoi(cmd->commands[0][2]), (char)atoi(cmd->commands[0][3]), &mounted_fat);
+                bool wide = false;
+                bool checksums = false;
+                bool reflinks = false;
+                for (int i = 4; cmd->commands[0][i] != NULL; i++) {
+                    wide = wide || strcmp(cmd->commands[0][i], "-32") == 0;
+                    checksums = checksums || strcmp(cmd->commands[0][i], "-s") == 0;
+                    reflinks = reflinks || strcmp(cmd->commands[0][i], "-r") == 0;
+                }
+                if (fatInUse()) {
+                    continue;
+                }
+                pennfatMkfs(cmd->commands[0][1], atoi(cmd->commands[0][2]), (char)atoi(cmd->commands[0][3]), wide, checksums, reflinks, &mounted_fat);
                 continue;
 
             } else if (strncmp(cmd->commands[0][0], "mount", 5) == 0) {
                 if (cmd->commands[0][1] == NULL) {
-                    printf("INPUT FORMAT: [mount FS_NAME].\n");
+                    printf("INPUT FORMAT: [mount FS_NAME [ -m ] [ -c CACHE_BLOCKS ] [ -i uring|sync ]].\n");
                     p_logout();
                 }
-                pennfatMount(cmd->commands[0][1], &mounted_fat);
+                bool mapImage = false;
+                int cacheBlocks = -1;
+                char *ioBackend = NULL;
+                for (int j = 2; cmd->commands[0][j] != NULL; j++) {
+                    if (strcmp(cmd->commands[0][j], "-m") == 0) {
+                        mapImage = true;
+                    } else if (strcmp(cmd->commands[0][j], "-c") == 0 && cmd->commands[0][j + 1] != NULL) {
+                        cacheBlocks = atoi(cmd->commands[0][++j]);
+                    } else if (strcmp(cmd->commands[0][j], "-i") == 0 && cmd->commands[0][j + 1] != NULL) {
+                        ioBackend = cmd->commands[0][++j];
+                    }
+                }
+                if (fatInUse()) {
+                    continue;
+                }
+                pennfatMount(cmd->commands[0][1], mapImage, cacheBlocks, ioBackend, &mounted_fat);
                 continue;
 
             } else if (strncmp(cmd->commands[0][0], "umount", 6) == 0) {
+                if (fatInUse()) {
+                    continue;
+                }
                 pennfatUnmount(&mounted_fat);
                 continue;
+
+            } else if (strcmp(cmd->commands[0][0], "cd") == 0) {
+                // The working directory belongs to the shell
+                cmd_cd(cmd->commands[0]);
+                continue;
             }
 
             // // printf("Shell: redirection.\n");
@@ -206,6 +249,8 @@ void shell() {
                 pids[0] = p_spawn(cmd_rm, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
             } else if (strcmp(key, "chmod") == 0) {
                 pids[0] = p_spawn(cmd_chmod, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
+            } else if (strcmp(key, "truncate") == 0) {
+                pids[0] = p_spawn(cmd_truncate, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
             } else if (strcmp(key, "ps") == 0) {
                 pids[0] = p_spawn(cmd_ps, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
             } else if (strcmp(key, "kill") == 0) {
@@ -214,6 +259,16 @@ void shell() {
                 pids[0] = p_spawn(zombify, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
             } else if (strcmp(key, "orphanify") == 0) {
                 pids[0] = p_spawn(orphanify, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
+            } else if (strcmp(key, "mkdir") == 0) {
+                pids[0] = p_spawn(cmd_mkdir, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
+            } else if (strcmp(key, "defrag") == 0) {
+                pids[0] = p_spawn(cmd_defrag, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
+            } else if (strcmp(key, "scrub") == 0) {
+                // Background work, it only gets the CPU left over by the other priorities
+                pids[0] = p_spawn(cmd_scrub, &cmd->commands[i][cmd_start_idx], fd0_dup, fd1_dup);
+                if (pids[0] > 0) {
+                    p_nice(pids[0], LOW);
+                }
             } else {
                 // if (cmd->stdout_file != NULL) {
                 //     FILE *infile = fopen(key, "r");